@@ -0,0 +1,83 @@
+/**
+ * @file collect.cpp
+ * @brief Benchmarks a whole collection, listing, stats and serializing, of a
+ * number of domains on the test:///default driver, over 1, 2, 4 and 8
+ * sharded connections. Reports wall time per collection.
+ *
+ * usage: collect [domains] [iterations]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <cache.hpp>
+#include <collector.hpp>
+#include <libvirt/libvirt.h>
+
+int main(int argc, char **argv)
+{
+    int ndomains = argc > 1 ? atoi(argv[1]) : 1000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    const char *uri = "test:///default";
+
+    virEventRegisterDefaultImpl();
+    virConnectPtr conn = virConnectOpen(uri);
+    if (conn == NULL)
+    {
+        fprintf(stderr, "Failed to connect to %s\n", uri);
+        return EXIT_FAILURE;
+    }
+
+    cache::domain_cache domains;
+    domains.register_events(conn);
+
+    std::vector<virDomainPtr> doms;
+    for (int i = 0; i < ndomains; i++)
+    {
+        std::string xml = "<domain type='test'><name>bench-" + std::to_string(i) +
+                          "</name><memory>1048576</memory><vcpu>4</vcpu><os><type>hvm</type></os></domain>";
+        virDomainPtr dom = virDomainCreateXML(conn, xml.c_str(), 0);
+        if (dom == NULL)
+        {
+            fprintf(stderr, "Failed to create domain: %s\n", virGetLastErrorMessage());
+            return EXIT_FAILURE;
+        }
+        doms.push_back(dom);
+    }
+
+    collector::options opts;
+    printf("%d domains\n", ndomains);
+
+    for (size_t shards : {1, 2, 4, 8})
+    {
+        collector::engine engine(uri, shards, opts, domains);
+        std::string body;
+
+        // warm up the cache and the families
+        engine.collect();
+
+        collector::result res;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            body.clear();
+            res = engine.collect();
+            engine.render(body);
+        }
+        auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        printf("%zu shards %8d domains %8zu records %4zu rpcs %10.2f ms/collection %10zu bytes\n", shards, res.domains,
+               res.records, res.rpcs, ms / iterations, body.size());
+    }
+
+    for (virDomainPtr dom : doms)
+    {
+        virDomainDestroy(dom);
+        virDomainFree(dom);
+    }
+    virConnectClose(conn);
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+/**
+ * @file loadgen.cpp
+ * @brief Closed-loop load test of the exporter's HTTP server. Starts the
+ * exporter on a libvirt uri, then has a number of connections scrape it
+ * back to back, with keep-alive and with a connection per request.
+ * Reports throughput and p50/p99/p999 scrape latency, and checks that
+ * every response is complete and matches its Content-Length.
+ *
+ * usage: loadgen [--exporter=path] [--uri=uri] [--port=n] [--connections=n] [--requests=n] [--workers=n]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <signal.h>
+#include <string>
+#include <strings.h>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @brief Opens a connection to the exporter.
+ *
+ * @param port the port
+ * @return int the socket, -1 on failure
+ */
+static int dial(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @brief Reads one response from fd, and checks it.
+ *
+ * @param fd the socket
+ * @param keep_alive whether the connection stays open after it
+ * @param error what was wrong, if anything
+ * @return size_t the body length
+ */
+static size_t read_response(int fd, bool keep_alive, std::string &error)
+{
+    std::string buf;
+    char chunk[65536];
+    size_t head = std::string::npos;
+
+    while ((head = buf.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+        {
+            error = "connection closed before the headers";
+            return 0;
+        }
+        buf.append(chunk, n);
+    }
+
+    if (buf.compare(0, 12, "HTTP/1.1 200") != 0)
+    {
+        error = "unexpected status: " + buf.substr(0, buf.find("\r\n"));
+        return 0;
+    }
+
+    // Content-Length, case-insensitive.
+    long long length = -1;
+    for (size_t pos = buf.find("\r\n"); pos < head; pos = buf.find("\r\n", pos + 2))
+    {
+        if (strncasecmp(buf.c_str() + pos + 2, "Content-Length:", 15) == 0)
+            length = atoll(buf.c_str() + pos + 17);
+    }
+    if (length < 0)
+    {
+        error = "no Content-Length";
+        return 0;
+    }
+
+    size_t body = head + 4;
+    while (buf.size() < body + length)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+        {
+            error = "connection closed, " + std::to_string(buf.size() - body) + " of " + std::to_string(length) + " bytes";
+            return 0;
+        }
+        buf.append(chunk, n);
+    }
+
+    if (buf.size() > body + length)
+    {
+        error = "more bytes than Content-Length";
+        return 0;
+    }
+    if (length == 0 || buf.back() != '\n')
+    {
+        error = "body does not end with a complete line";
+        return 0;
+    }
+
+    // Without keep-alive, the server closes after the response.
+    if (!keep_alive && recv(fd, chunk, sizeof(chunk), 0) != 0)
+    {
+        error = "connection not closed after the response";
+        return 0;
+    }
+
+    return length;
+}
+
+/**
+ * @brief Outcome of a run.
+ */
+struct result
+{
+    std::vector<double> latencies;
+    size_t bytes = 0;
+    size_t errors = 0;
+    std::string first_error;
+};
+
+/**
+ * @brief One closed-loop client: a request, its response, the next request.
+ *
+ * @param port the port
+ * @param requests number of requests
+ * @param keep_alive reuse the connection
+ * @param res the outcome
+ */
+static void client(int port, int requests, bool keep_alive, result &res)
+{
+    const std::string request = keep_alive ? "GET /metrics HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: identity\r\n\r\n"
+                                           : "GET /metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    int fd = -1;
+
+    for (int i = 0; i < requests; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        if (fd < 0)
+            fd = dial(port);
+
+        std::string error;
+        size_t length = 0;
+        if (fd < 0)
+            error = std::string("connect: ") + strerror(errno);
+        else if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+            error = std::string("send: ") + strerror(errno);
+        else
+            length = read_response(fd, keep_alive, error);
+
+        if (!error.empty())
+        {
+            if (res.errors++ == 0)
+                res.first_error = error;
+        }
+        else
+        {
+            res.latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            res.bytes += length;
+        }
+
+        if (!keep_alive || !error.empty())
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+/**
+ * @brief Runs connections clients at once, and prints the outcome.
+ *
+ * @return size_t number of errors
+ */
+static size_t run(const char *name, int port, int connections, int requests, bool keep_alive)
+{
+    std::vector<result> results(connections);
+    std::vector<std::thread> clients;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < connections; i++)
+        clients.emplace_back(client, port, requests, keep_alive, std::ref(results[i]));
+    for (std::thread &t : clients)
+        t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result all;
+    for (result &r : results)
+    {
+        all.latencies.insert(all.latencies.end(), r.latencies.begin(), r.latencies.end());
+        all.bytes += r.bytes;
+        all.errors += r.errors;
+        if (all.first_error.empty())
+            all.first_error = r.first_error;
+    }
+    std::sort(all.latencies.begin(), all.latencies.end());
+
+    printf("%-12s %4d conns %8zu ok %6zu errors %10.1f req/s %8.1f MB/s  p50 %7.2f ms  p99 %7.2f ms  p999 %7.2f ms\n", name,
+           connections, all.latencies.size(), all.errors, all.latencies.size() / seconds, all.bytes / seconds / 1e6,
+           percentile(all.latencies, 0.5), percentile(all.latencies, 0.99), percentile(all.latencies, 0.999));
+    if (all.errors > 0)
+        fprintf(stderr, "%s: %s\n", name, all.first_error.c_str());
+
+    return all.errors;
+}
+
+int main(int argc, char **argv)
+{
+    std::string exporter = "./libvirt-prometheus-exporter";
+    std::string uri = "test:///default";
+    std::string workers = "1";
+    int port = 19091;
+    int connections = 32;
+    int requests = 100;
+
+    static struct option long_options[] = {
+        {"exporter", required_argument, 0, 'x'},
+        {"uri", required_argument, 0, 'u'},
+        {"port", required_argument, 0, 'p'},
+        {"connections", required_argument, 0, 'c'},
+        {"requests", required_argument, 0, 'r'},
+        {"workers", required_argument, 0, 'w'},
+        {0, 0, 0, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "x:u:p:c:r:w:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'x':
+            exporter = optarg;
+            break;
+        case 'u':
+            uri = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            connections = std::max(1, atoi(optarg));
+            break;
+        case 'r':
+            requests = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            workers = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--exporter=path] [--uri=uri] [--port=n] [--connections=n] [--requests=n] [--workers=n]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string port_arg = std::to_string(port);
+    std::string workers_arg = "--workers=" + workers;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Keep the exporter's startup lines out of the report.
+        freopen("/dev/null", "w", stdout);
+        execl(exporter.c_str(), exporter.c_str(), workers_arg.c_str(), port_arg.c_str(), uri.c_str(), (char *)NULL);
+        perror(exporter.c_str());
+        _exit(127);
+    }
+    if (pid < 0)
+    {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+
+    // Wait for it to listen.
+    bool up = false;
+    for (int i = 0; i < 100 && !up; i++)
+    {
+        int fd = dial(port);
+        up = fd >= 0;
+        if (up)
+            close(fd);
+        else
+            usleep(50000);
+
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break;
+    }
+
+    size_t errors = 0;
+    if (!up)
+    {
+        fprintf(stderr, "%s did not start listening on port %d\n", exporter.c_str(), port);
+        errors = 1;
+    }
+    else
+    {
+        printf("%s on %s, %s workers, %d requests per connection\n", exporter.c_str(), uri.c_str(), workers.c_str(), requests);
+        errors += run("keep-alive", port, connections, requests, true);
+        errors += run("close", port, connections, requests, false);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return errors == 0 ? 0 : 1;
+}
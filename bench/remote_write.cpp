@@ -0,0 +1,377 @@
+/**
+ * @file remote_write.cpp
+ * @brief Pushes synthetic collections with remote write, from their
+ * families, to a stub receiver on the loopback. The receiver decompresses
+ * and decodes every
+ * WriteRequest, checks that each series has sorted labels, a __name__ and
+ * one sample, and fails every so many requests, so they are retried.
+ * Reports encoding and end-to-end samples/s, and checks that every pushed
+ * sample is received. Then holds the receiver down, and checks that the
+ * oldest batches are shed, and the latest ones delivered.
+ *
+ * usage: remote_write [--domains=n] [--vcpus=n] [--pushes=n] [--batch=n] [--fail-every=n]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <string>
+#include <strings.h>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <compression.hpp>
+#include <exposition.hpp>
+#include <protobuf.hpp>
+#include <remote.hpp>
+
+/**
+ * @brief A remote write receiver, that checks what it gets.
+ */
+struct receiver
+{
+    int fd = -1;
+    int port = 0;
+    int fail_every = 0;
+    std::atomic<bool> down{false};
+    std::atomic<unsigned long long> requests{0};
+    std::atomic<unsigned long long> samples{0};
+    std::atomic<unsigned long long> errors{0};
+    std::string first_error;
+
+    void error(const std::string &what)
+    {
+        if (errors++ == 0)
+            first_error = what;
+    }
+
+    /**
+     * @brief Decodes a WriteRequest, and counts its samples.
+     */
+    void check(std::string_view body)
+    {
+        std::string request;
+        if (!compression::snappy_uncompress(body, request))
+            return error("corrupt snappy block");
+
+        protobuf::reader write_request(request);
+        int field;
+        protobuf::wire type;
+        unsigned long long n = 0;
+        while (write_request.next(field, type))
+        {
+            if (field != 1)
+            {
+                write_request.skip(type);
+                continue;
+            }
+
+            protobuf::reader series(write_request.bytes());
+            std::string previous;
+            bool named = false;
+            int sampled = 0;
+            while (series.next(field, type))
+            {
+                if (field == 1)
+                {
+                    protobuf::reader label(series.bytes());
+                    std::string name;
+                    while (label.next(field, type))
+                    {
+                        if (field == 1)
+                            name = label.bytes();
+                        else
+                            label.skip(type);
+                    }
+                    if (!previous.empty() && name <= previous)
+                        return error("labels not sorted: " + previous + ", " + name);
+                    named |= name == "__name__";
+                    previous = name;
+                }
+                else if (field == 2)
+                {
+                    protobuf::reader sample(series.bytes());
+                    int64_t timestamp = 0;
+                    while (sample.next(field, type))
+                    {
+                        if (field == 2)
+                            timestamp = (int64_t)sample.varint();
+                        else
+                            sample.skip(type);
+                    }
+                    if (timestamp <= 0)
+                        return error("sample without a timestamp");
+                    sampled++;
+                }
+                else
+                    series.skip(type);
+            }
+
+            if (!series.ok() || !named || sampled != 1)
+                return error("malformed series");
+            n++;
+        }
+
+        if (!write_request.ok())
+            return error("malformed WriteRequest");
+        samples += n;
+    }
+
+    void serve(int conn)
+    {
+        std::string in;
+        char buffer[65536];
+        while (true)
+        {
+            size_t end = in.find("\r\n\r\n");
+            if (end == std::string::npos)
+            {
+                ssize_t n = recv(conn, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                    break;
+                in.append(buffer, n);
+                continue;
+            }
+
+            std::string head = in.substr(0, end);
+            const char *length = strcasestr(head.c_str(), "Content-Length:");
+            if (length == NULL || strcasestr(head.c_str(), "Content-Encoding: snappy") == NULL ||
+                strcasestr(head.c_str(), "X-Prometheus-Remote-Write-Version: 0.1.0") == NULL)
+            {
+                error("missing remote write headers");
+                break;
+            }
+
+            size_t size = strtoul(length + 15, NULL, 10);
+            while (in.size() < end + 4 + size)
+            {
+                ssize_t n = recv(conn, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                    break;
+                in.append(buffer, n);
+            }
+            if (in.size() < end + 4 + size)
+                break;
+
+            unsigned long long nth = ++requests;
+            const char *response;
+            if (down || (fail_every > 0 && nth % fail_every == 0))
+                response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 10\r\n\r\ntry again\n";
+            else
+            {
+                check(std::string_view(in).substr(end + 4, size));
+                response = "HTTP/1.1 204 No Content\r\n\r\n";
+            }
+            in.erase(0, end + 4 + size);
+
+            if (send(conn, response, strlen(response), MSG_NOSIGNAL) < 0)
+                break;
+        }
+        close(conn);
+    }
+
+    bool start()
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+            getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+        {
+            perror("receiver");
+            return false;
+        }
+        port = ntohs(addr.sin_port);
+
+        std::thread([this]() {
+            while (true)
+            {
+                int conn = accept(fd, NULL, NULL);
+                if (conn < 0)
+                    break;
+                std::thread([this, conn]() { serve(conn); }).detach();
+            }
+        }).detach();
+        return true;
+    }
+};
+
+/**
+ * @brief Families with the series of the exporter's vcpu, interface and
+ * block groups.
+ */
+static void fill(exposition::families &f, int domains, int vcpus)
+{
+    for (int d = 0; d < domains; d++)
+    {
+        std::string domain = "instance-" + std::to_string(d);
+        std::string uuid = "ab000000-0000-4000-8000-" + std::to_string(100000000000ULL + d);
+        for (int c = 0; c < vcpus; c++)
+        {
+            for (const char *field : {"time", "wait", "delay"})
+                f.add(f.get("counter", "", "libvirt", "vcpu", field)).label("domain", domain).label("vcpu", (unsigned long long)c).label("uuid", uuid).label("tenant", "t1").value((double)(d * 1000 + c));
+        }
+        for (const char *field : {"bytes_rx", "pkts_rx", "errs_rx", "drop_rx", "bytes_tx", "pkts_tx", "errs_tx", "drop_tx"})
+            f.add(f.get("counter", "", "libvirt", "net", field)).label("domain", domain).label("interfaceid", 0ULL).label("name", "vnet0").label("uuid", uuid).label("tenant", "t1").value((double)d);
+        for (const char *field : {"reqs_rd", "bytes_rd", "times_rd", "reqs_wr", "bytes_wr", "times_wr", "reqs_fl", "times_fl"})
+            f.add(f.get("counter", "", "libvirt", "block", field)).label("domain", domain).label("blockid", 0ULL).label("name", "vda").label("uuid", uuid).label("tenant", "t1").value((double)d);
+    }
+}
+
+/**
+ * @brief A counter of the writer, from what it renders.
+ */
+static unsigned long long counter(const remote::writer &writer, const std::string &series)
+{
+    exposition::families f;
+    std::string out;
+    writer.render(f);
+    f.render(out);
+
+    size_t pos = out.find("\n" + series + " ");
+    return pos == std::string::npos ? 0 : strtoull(out.c_str() + pos + series.size() + 2, NULL, 10);
+}
+
+int main(int argc, char **argv)
+{
+    int domains = 500;
+    int vcpus = 4;
+    int pushes = 10;
+    size_t batch = 2000;
+    int fail_every = 10;
+
+    static struct option long_options[] = {
+        {"domains", required_argument, 0, 'd'},
+        {"vcpus", required_argument, 0, 'v'},
+        {"pushes", required_argument, 0, 'p'},
+        {"batch", required_argument, 0, 'b'},
+        {"fail-every", required_argument, 0, 'f'},
+        {0, 0, 0, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "d:v:p:b:f:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            domains = std::max(1, atoi(optarg));
+            break;
+        case 'v':
+            vcpus = std::max(0, atoi(optarg));
+            break;
+        case 'p':
+            pushes = std::max(1, atoi(optarg));
+            break;
+        case 'b':
+            batch = std::max(1, atoi(optarg));
+            break;
+        case 'f':
+            fail_every = std::max(0, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--domains=n] [--vcpus=n] [--pushes=n] [--batch=n] [--fail-every=n]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    receiver stub;
+    stub.fail_every = fail_every;
+    if (!stub.start())
+        return EXIT_FAILURE;
+
+    exposition::families f;
+    fill(f, domains, vcpus);
+    const exposition::families *sets[] = {&f};
+
+    // Encoding alone.
+    std::vector<remote::batch> batches;
+    auto start = std::chrono::steady_clock::now();
+    size_t n = 0;
+    for (int i = 0; i < pushes; i++)
+    {
+        batches.clear();
+        n = remote::encode(sets, 1, 1, batch, batches);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t compressed = 0;
+    for (const remote::batch &b : batches)
+        compressed += b.body.size();
+    printf("%-12s %8zu samples %6zu batches %12.0f samples/s %8.1f bytes/sample\n", "encode", n, batches.size(),
+           n * pushes / seconds, (double)compressed / n);
+
+    // End to end, with every fail_every-th request failing, and retried.
+    remote::options opts;
+    opts.url = "http://127.0.0.1:" + std::to_string(stub.port) + "/api/v1/write";
+    opts.batch = batch;
+    opts.queue = pushes * batches.size() + 1;
+    opts.backoff = std::chrono::milliseconds(1);
+
+    int errors = 0;
+    {
+        remote::writer writer(opts);
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < pushes; i++)
+            writer.push(sets, 1, std::chrono::system_clock::now());
+        bool drained = writer.drain(std::chrono::seconds(30));
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        unsigned long long retries = counter(writer, "libvirt_remote_write_retries_total");
+        printf("%-12s %8llu samples %6llu requests %12.0f samples/s %8llu retries\n", "push", stub.samples.load(),
+               stub.requests.load(), stub.samples / seconds, retries);
+
+        if (!drained || stub.samples != n * pushes)
+        {
+            fprintf(stderr, "push: received %llu of %zu samples\n", stub.samples.load(), n * pushes);
+            errors++;
+        }
+        if (fail_every > 0 && retries == 0)
+        {
+            fprintf(stderr, "push: failed requests were not retried\n");
+            errors++;
+        }
+    }
+
+    // With the receiver down, the queue keeps the latest batches.
+    {
+        opts.queue = batches.size();
+        opts.backoff = std::chrono::milliseconds(10);
+        opts.max_backoff = std::chrono::milliseconds(10);
+        stub.fail_every = 0;
+        stub.down = true;
+        unsigned long long received = stub.samples;
+
+        remote::writer writer(opts);
+        for (int i = 0; i < pushes; i++)
+            writer.push(sets, 1, std::chrono::system_clock::now());
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        stub.down = false;
+        bool drained = writer.drain(std::chrono::seconds(30));
+
+        unsigned long long shed = counter(writer, "libvirt_remote_write_dropped_samples_total{reason=\"queue_full\"}");
+        received = stub.samples - received;
+        printf("%-12s %8llu samples %6zu queued %12llu shed\n", "backpressure", received, opts.queue, shed);
+
+        if (!drained || received + shed != n * pushes || (pushes > 1 && shed == 0))
+        {
+            fprintf(stderr, "backpressure: received %llu and shed %llu of %zu samples\n", received, shed, n * pushes);
+            errors++;
+        }
+    }
+
+    if (stub.errors > 0)
+    {
+        fprintf(stderr, "receiver: %llu errors, %s\n", stub.errors.load(), stub.first_error.c_str());
+        errors++;
+    }
+
+    return errors == 0 ? 0 : 1;
+}
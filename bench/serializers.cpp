@@ -0,0 +1,241 @@
+/**
+ * @file serializers.cpp
+ * @brief Benchmarks the serializers, on synthetic stats records for a
+ * number of domains on the test:///default driver. Reports heap allocations
+ * per scrape, ns and bytes per sample, for each serializer, the series
+ * table, the custom::format path they replaced, the encoding of the series
+ * table's body in the other exposition formats, and an end-to-end scrape.
+ *
+ * usage: serializers [--domains=n] [--vcpus=n] [--nics=n] [--disks=n] [--iterations=n]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <format.hpp>
+#include <cache.hpp>
+#include <collector.hpp>
+#include <exposition.hpp>
+#include <formats.hpp>
+#include <serializers.hpp>
+#include <snapshot.hpp>
+#include <libvirt/libvirt.h>
+#include "synthetic.hpp"
+
+static std::atomic<unsigned long long> allocations{0};
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/**
+ * @brief The custom::format serializer, as it was, for comparison.
+ */
+static void format_metrics(std::string &out, cache::domain_cache &domains, size_t rc, virDomainStatsRecordPtr *stats)
+{
+    for (size_t j = 0; j < rc; j++)
+    {
+        virDomainStatsRecordPtr record = stats[j];
+        cache::domain_info_ptr info = domains.get(record->dom);
+        std::string netname;
+
+        for (int k = 0; k < record->nparams; k++)
+        {
+            std::vector<std::string> fields = custom::split(record->params[k].field);
+            if (fields[0] == "vcpu" && fields.size() == 3)
+            {
+                out.append(custom::format("# TYPE libvirt_%s_%s counter\n", fields[0].c_str(), fields[2].c_str()));
+                out.append(custom::format("libvirt_%s_%s{domain=\"%s\", vcpu=\"%s\" uuid=\"%s\" tenant=\"%s\"} %llu\n",
+                                          fields[0].c_str(), fields[2].c_str(), info->name.c_str(), fields[1].c_str(),
+                                          info->uuid.c_str(), info->tenant.c_str(), record->params[k].value.ul));
+            }
+            else if (fields[0] == "net" && fields.size() == 3 && fields[2] == "name")
+            {
+                netname = record->params[k].value.s;
+            }
+            else if (fields[0] == "net" && fields.size() == 4)
+            {
+                out.append(custom::format("# TYPE libvirt_%s_%s_%s counter\n", fields[0].c_str(), fields[3].c_str(), fields[2].c_str()));
+                out.append(custom::format("libvirt_%s_%s_%s{domain=\"%s\" interfaceid=\"%s\", name=\"%s\" uuid=\"%s\" tenant=\"%s\"} %llu\n",
+                                          fields[0].c_str(), fields[3].c_str(), fields[2].c_str(), info->name.c_str(), fields[1].c_str(),
+                                          netname.c_str(), info->uuid.c_str(), info->tenant.c_str(), record->params[k].value.ul));
+            }
+            else if (fields[0] == "block" && fields.size() == 4)
+            {
+                out.append(custom::format("# TYPE libvirt_%s_%s_%s counter\n", fields[0].c_str(), fields[3].c_str(), fields[2].c_str()));
+                out.append(custom::format("libvirt_%s_%s_%s{domain=\"%s\" blockid=\"%s\", uuid=\"%s\" tenant=\"%s\"} %llu\n",
+                                          fields[0].c_str(), fields[3].c_str(), fields[2].c_str(), info->name.c_str(), fields[1].c_str(),
+                                          info->uuid.c_str(), info->tenant.c_str(), record->params[k].value.ul));
+            }
+        }
+    }
+}
+
+static size_t samples(const std::string &body)
+{
+    size_t n = 0;
+    for (size_t pos = 0; pos < body.size(); pos = body.find('\n', pos) + 1)
+        if (body[pos] != '#')
+            n++;
+    return n;
+}
+
+template <typename Fn>
+static void run(const char *name, int iterations, Fn fn, size_t n = 0)
+{
+    std::string body;
+    fn(body); // warm up the cache and the buffer
+
+    unsigned long long allocs = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        body.clear();
+        fn(body);
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    allocs = allocations.load() - allocs;
+
+    // Binary formats are told how many samples they hold.
+    if (n == 0)
+        n = samples(body);
+    printf("%-16s %8zu samples %10.1f allocs/scrape %8.1f ns/sample %8.1f bytes/sample\n", name, n,
+           (double)allocs / iterations, ns / iterations / n, (double)body.size() / n);
+}
+
+int main(int argc, char **argv)
+{
+    synthetic::shape shape;
+    int iterations = 20;
+
+    static struct option long_options[] = {
+        {"domains", required_argument, 0, 'd'},
+        {"vcpus", required_argument, 0, 'v'},
+        {"nics", required_argument, 0, 'n'},
+        {"disks", required_argument, 0, 'b'},
+        {"iterations", required_argument, 0, 'i'},
+        {0, 0, 0, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "d:v:n:b:i:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            shape.domains = atoi(optarg);
+            break;
+        case 'v':
+            shape.vcpus = atoi(optarg);
+            break;
+        case 'n':
+            shape.nics = atoi(optarg);
+            break;
+        case 'b':
+            shape.disks = atoi(optarg);
+            break;
+        case 'i':
+            iterations = std::max(1, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--domains=n] [--vcpus=n] [--nics=n] [--disks=n] [--iterations=n]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char *uri = "test:///default";
+    virEventRegisterDefaultImpl();
+    virConnectPtr conn = virConnectOpen(uri);
+    if (conn == NULL)
+    {
+        fprintf(stderr, "Failed to connect to %s\n", uri);
+        return EXIT_FAILURE;
+    }
+
+    cache::domain_cache domains;
+    domains.register_events(conn);
+
+    {
+        synthetic::records records(conn, shape);
+        size_t rc = records.size();
+        virDomainStatsRecordPtr *stats = records.stats();
+
+        printf("%zu domains, %d vcpus, %d nics, %d disks, %zu params per domain\n", rc, shape.vcpus, shape.nics, shape.disks,
+               records.params_per_domain());
+
+        run("format", iterations, [&](std::string &body) { format_metrics(body, domains, rc, stats); });
+
+        exposition::families families;
+        auto each = [&](auto fn) {
+            return [&, fn](std::string &body) {
+                families.clear();
+                fn(families, domains, rc, stats);
+                families.render(body);
+            };
+        };
+        run("vcpu_metrics", iterations, each(serializer::vcpu_metrics));
+        run("network_metrics", iterations, each(serializer::network_metrics));
+        run("block_metrics", iterations, each(serializer::block_metrics));
+        run("domain_metrics", iterations, each(serializer::domain_metrics));
+
+        exposition::families cached;
+        serializer::series_table series(cached);
+        run("series_table", iterations, [&](std::string &body) {
+            cached.clear();
+            series.domain_metrics(domains, rc, stats);
+            cached.render(body);
+        });
+
+        // vCPU, interface and block counters summed per domain.
+        exposition::families summed;
+        serializer::series_table totals(summed);
+        serializer::aggregation policy;
+        policy.groups[(int)fields::group::vcpu] = true;
+        policy.groups[(int)fields::group::net] = true;
+        policy.groups[(int)fields::group::block] = true;
+        totals.aggregate(&policy);
+        run("aggregated", iterations, [&](std::string &body) {
+            summed.clear();
+            totals.domain_metrics(domains, rc, stats);
+            summed.render(body);
+        });
+
+        // The series table's body, encoded in the other exposition formats.
+        std::string text;
+        cached.render(text);
+        for (formats::format f : {formats::format::openmetrics, formats::format::protobuf})
+            run(formats::get(f).name, iterations, [&](std::string &body) { formats::get(f).encode(text, body); }, samples(text));
+
+        // End to end: list, stats from the driver, serialize and render, the response.
+        collector::options opts;
+        collector::engine engine(uri, 1, opts, domains);
+        run("scrape", iterations, [&](std::string &body) {
+            snapshot::snapshot_ptr snap = snapshot::collect(engine);
+            http::response rsp;
+            snapshot::render(snap, formats::format::text, compression::encoding::identity, "", rsp);
+            rsp.assemble(body);
+        });
+    }
+
+    virConnectClose(conn);
+
+    return 0;
+}
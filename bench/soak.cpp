@@ -0,0 +1,148 @@
+/**
+ * @file soak.cpp
+ * @brief Soak test of collection: runs many scrapes, list, stats,
+ * serialize, render and gzip, on the test:///default driver, while
+ * domains come and go, and reports the RSS along the way. Fails if the
+ * RSS keeps growing after the warm-up.
+ *
+ * usage: soak [--scrapes=n] [--domains=n] [--churn=n] [--shards=n]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <cache.hpp>
+#include <collector.hpp>
+#include <handles.hpp>
+#include <snapshot.hpp>
+#include <libvirt/libvirt.h>
+
+/**
+ * @brief Resident set size, in KiB.
+ *
+ * @return long
+ */
+static long rss_kib()
+{
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static handles::domain create(virConnectPtr conn, int i)
+{
+    std::string xml = "<domain type='test'><name>soak-" + std::to_string(i) +
+                      "</name><memory>1048576</memory><vcpu>2</vcpu><os><type>hvm</type></os></domain>";
+    return handles::domain(virDomainCreateXML(conn, xml.c_str(), 0));
+}
+
+int main(int argc, char **argv)
+{
+    int scrapes = 2000;
+    int ndomains = 20;
+    int churn = 100;
+    int shards = 1;
+
+    static struct option long_options[] = {
+        {"scrapes", required_argument, 0, 's'},
+        {"domains", required_argument, 0, 'd'},
+        {"churn", required_argument, 0, 'c'},
+        {"shards", required_argument, 0, 'n'},
+        {0, 0, 0, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "s:d:c:n:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            scrapes = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            ndomains = std::max(1, atoi(optarg));
+            break;
+        case 'c':
+            churn = atoi(optarg);
+            break;
+        case 'n':
+            shards = std::max(1, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--scrapes=n] [--domains=n] [--churn=n] [--shards=n]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char *uri = "test:///default";
+    virEventRegisterDefaultImpl();
+    virConnectPtr conn = virConnectOpen(uri);
+    if (conn == NULL)
+    {
+        fprintf(stderr, "Failed to connect to %s\n", uri);
+        return EXIT_FAILURE;
+    }
+
+    long baseline = 0;
+    long last = 0;
+    {
+        cache::domain_cache domains;
+        collector::options opts;
+        collector::engine engine(uri, shards, opts, domains);
+        domains.register_events(engine.primary());
+
+        std::vector<handles::domain> doms;
+        for (int i = 0; i < ndomains; i++)
+            doms.push_back(create(conn, i));
+
+        printf("%d scrapes of %d domains, replacing one every %d scrapes, over %d shards\n", scrapes, ndomains, churn, shards);
+
+        int next = ndomains;
+        for (int i = 1; i <= scrapes; i++)
+        {
+            // Replace the oldest domain.
+            if (churn > 0 && i % churn == 0)
+            {
+                size_t victim = (next - ndomains) % ndomains;
+                virDomainDestroy(doms[victim].get());
+                doms[victim] = create(conn, next++);
+            }
+
+            snapshot::snapshot_ptr snap = snapshot::collect(engine);
+            http::response rsp;
+            snapshot::render(snap, formats::format::text, compression::encoding::gzip, "", rsp);
+
+            if (i == scrapes / 10)
+                baseline = rss_kib();
+            if (i % (scrapes / 10 > 0 ? scrapes / 10 : 1) == 0)
+            {
+                last = rss_kib();
+                printf("%8d scrapes %8ld KiB rss %6zu domains %8zu bytes\n", i, last, (size_t)snap->result.domains, snap->body.size());
+            }
+        }
+
+        for (handles::domain &dom : doms)
+            virDomainDestroy(dom.get());
+    }
+
+    virConnectClose(conn);
+
+    // Growth after the warm-up, beyond allocator noise, is a leak.
+    long growth = last - baseline;
+    printf("rss growth after warm-up: %ld KiB\n", growth);
+    if (growth > 1024 + baseline / 10)
+    {
+        fprintf(stderr, "rss keeps growing\n");
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
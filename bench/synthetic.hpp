@@ -0,0 +1,160 @@
+#ifndef __SYNTHETIC_HPP__
+#define __SYNTHETIC_HPP__
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+#include <libvirt/libvirt.h>
+
+namespace synthetic
+{
+    /**
+     * @brief The shape of the generated stats.
+     */
+    struct shape
+    {
+        int domains = 500;
+        int vcpus = 4;
+        int nics = 1;
+        int disks = 1;
+    };
+
+    /**
+     * @brief Stats records, as virDomainListGetStats returns them for
+     * VCPU | INTERFACE | BLOCK, for domains created on a test:///default
+     * connection. The domains are destroyed with the records.
+     */
+    class records
+    {
+    public:
+        records(virConnectPtr conn, const shape &s) : s(s)
+        {
+            for (int i = 0; i < s.domains; i++)
+            {
+                std::string xml = "<domain type='test'><name>bench-" + std::to_string(i) +
+                                  "</name><memory>1048576</memory><vcpu>" + std::to_string(s.vcpus) +
+                                  "</vcpu><os><type>hvm</type></os></domain>";
+                virDomainPtr dom = virDomainCreateXML(conn, xml.c_str(), 0);
+                if (dom == NULL)
+                {
+                    fprintf(stderr, "Failed to create domain: %s\n", virGetLastErrorMessage());
+                    break;
+                }
+                doms.push_back(dom);
+            }
+
+            params.resize(doms.size());
+            recs.resize(doms.size());
+            for (size_t i = 0; i < doms.size(); i++)
+            {
+                generate(i, params[i]);
+                recs[i].dom = doms[i];
+                recs[i].params = params[i].data();
+                recs[i].nparams = params[i].size();
+                ptrs.push_back(&recs[i]);
+            }
+            ptrs.push_back(NULL);
+        }
+
+        records(const records &) = delete;
+        records &operator=(const records &) = delete;
+
+        ~records()
+        {
+            for (virDomainPtr dom : doms)
+            {
+                virDomainDestroy(dom);
+                virDomainFree(dom);
+            }
+        }
+
+        size_t size() const
+        {
+            return recs.size();
+        }
+
+        virDomainStatsRecordPtr *stats()
+        {
+            return ptrs.data();
+        }
+
+        /**
+         * @brief Typed parameters per domain.
+         *
+         * @return size_t
+         */
+        size_t params_per_domain() const
+        {
+            return params.empty() ? 0 : params[0].size();
+        }
+
+    private:
+        void add(std::vector<virTypedParameter> &v, const std::string &field, unsigned long long value)
+        {
+            virTypedParameter param = {};
+            snprintf(param.field, VIR_TYPED_PARAM_FIELD_LENGTH, "%s", field.c_str());
+            param.type = VIR_TYPED_PARAM_ULLONG;
+            param.value.ul = value;
+            v.push_back(param);
+        }
+
+        void add(std::vector<virTypedParameter> &v, const std::string &field, const std::string &value)
+        {
+            virTypedParameter param = {};
+            snprintf(param.field, VIR_TYPED_PARAM_FIELD_LENGTH, "%s", field.c_str());
+            param.type = VIR_TYPED_PARAM_STRING;
+            param.value.s = strings.emplace_back(value).data();
+            v.push_back(param);
+        }
+
+        /**
+         * @brief The parameters of domain i, in the order libvirt reports them.
+         * Values differ per domain and device, so they print at realistic widths.
+         */
+        void generate(size_t i, std::vector<virTypedParameter> &v)
+        {
+            unsigned long long base = 1000003ULL * (i + 1);
+
+            add(v, "vcpu.current", s.vcpus);
+            add(v, "vcpu.maximum", s.vcpus);
+            for (int c = 0; c < s.vcpus; c++)
+            {
+                std::string prefix = "vcpu." + std::to_string(c) + ".";
+                add(v, prefix + "state", 1);
+                add(v, prefix + "time", 123456789012ULL + base * (c + 1));
+                add(v, prefix + "wait", base / 7 + c);
+                add(v, prefix + "delay", base / 3 + c);
+            }
+
+            add(v, "net.count", s.nics);
+            for (int c = 0; c < s.nics; c++)
+            {
+                std::string prefix = "net." + std::to_string(c) + ".";
+                add(v, prefix + "name", "tap" + std::to_string(i) + "-" + std::to_string(c));
+                for (const char *f : {"rx.bytes", "rx.pkts", "rx.errs", "rx.drop", "tx.bytes", "tx.pkts", "tx.errs", "tx.drop"})
+                    add(v, prefix + f, base * 97 + c);
+            }
+
+            add(v, "block.count", s.disks);
+            for (int c = 0; c < s.disks; c++)
+            {
+                std::string prefix = "block." + std::to_string(c) + ".";
+                add(v, prefix + "name", std::string("vd") + (char)('a' + c % 26));
+                add(v, prefix + "path", "/var/lib/nova/instances/" + std::to_string(i) + "/disk");
+                for (const char *f : {"rd.reqs", "rd.bytes", "rd.times", "wr.reqs", "wr.bytes", "wr.times", "fl.reqs", "fl.times",
+                                      "allocation", "capacity", "physical"})
+                    add(v, prefix + f, base * 31 + c);
+            }
+        }
+
+        shape s;
+        std::vector<virDomainPtr> doms;
+        std::vector<std::vector<virTypedParameter>> params;
+        std::vector<virDomainStatsRecord> recs;
+        std::vector<virDomainStatsRecordPtr> ptrs;
+        std::deque<std::string> strings;
+    };
+}
+
+#endif
@@ -0,0 +1,216 @@
+/**
+ * @file targets.cpp
+ * @brief Collects several test:///default targets, as the exporter does
+ * with more than one uri. Checks that the first background collection of
+ * each is published before begin() returns, that the merged snapshot has
+ * every family once and every target's samples, labelled with its
+ * hypervisor, and that targets added with ?target= are refused past
+ * --max-targets and removed once idle. Reports the time to collect the
+ * targets at once, and one after the other.
+ *
+ * usage: targets [--targets=n] [--iterations=n]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <collector.hpp>
+#include <snapshot.hpp>
+#include <targets.hpp>
+#include <libvirt/libvirt.h>
+
+/**
+ * @brief Counts the samples of a family, and of each hypervisor.
+ */
+static size_t samples(std::string_view body, const std::string &family, std::set<std::string> &hypervisors)
+{
+    size_t n = 0;
+    for (size_t pos = body.find("\n" + family + "{"); pos != std::string_view::npos; pos = body.find("\n" + family + "{", pos + 1))
+    {
+        size_t label = body.find("hypervisor=\"", pos);
+        size_t end = body.find('\n', pos + 1);
+        if (label != std::string_view::npos && label < end)
+            hypervisors.insert(std::string(body.substr(label + 12, body.find('"', label + 12) - label - 12)));
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Whether every family of a body has one HELP line.
+ */
+static bool unique_families(std::string_view body)
+{
+    std::set<std::string_view> seen;
+    for (size_t pos = body.find("# HELP "); pos != std::string_view::npos; pos = body.find("# HELP ", pos + 1))
+    {
+        std::string_view name = body.substr(pos + 7, body.find(' ', pos + 7) - pos - 7);
+        if (!seen.insert(name).second)
+        {
+            fprintf(stderr, "family %.*s is there twice\n", (int)name.size(), name.data());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int ntargets = 4;
+    int iterations = 20;
+
+    static struct option long_options[] = {
+        {"targets", required_argument, 0, 't'},
+        {"iterations", required_argument, 0, 'i'},
+        {0, 0, 0, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "t:i:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            ntargets = std::max(2, atoi(optarg));
+            break;
+        case 'i':
+            iterations = std::max(1, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--targets=n] [--iterations=n]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    virEventRegisterDefaultImpl();
+    std::thread([]() -> void {
+        while (true)
+        {
+            if (virEventRunDefaultImpl() < 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }).detach();
+
+    collector::options opts;
+    int errors = 0;
+
+    // The first background collection of each target, before serving.
+    {
+        targets::settings s;
+        s.interval = 60;
+        targets::table table(opts, s);
+        std::vector<targets::target *> all;
+        for (int i = 0; i < ntargets; i++)
+            all.push_back(&table.add("host" + std::to_string(i), "test:///default", true));
+
+        auto start = std::chrono::steady_clock::now();
+        table.begin();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        size_t published = 0;
+        for (targets::target *t : all)
+            published += t->latest().load() && t->latest().load()->result.domains > 0;
+        printf("%-10s %4d targets %4zu published %10.2f ms\n", "begin", ntargets, published, ms);
+        if (published != (size_t)ntargets)
+        {
+            fprintf(stderr, "begin: %zu of %d targets published\n", published, ntargets);
+            errors++;
+        }
+    }
+
+    // Collected on request, at once as the exporter does, and one after the other.
+    {
+        targets::settings s;
+        targets::table table(opts, s);
+        for (int i = 0; i < ntargets; i++)
+            table.add("host" + std::to_string(i), "test:///default", true);
+        table.begin();
+
+        std::vector<std::shared_ptr<targets::target>> picked;
+        table.pick({}, picked);
+
+        std::vector<snapshot::snapshot_ptr> snaps(picked.size());
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+            for (const std::shared_ptr<targets::target> &t : picked)
+                t->latest().start(since, [t]() { return t->collect(); });
+            for (size_t j = 0; j < picked.size(); j++)
+            {
+                bool stale = false;
+                snaps[j] = picked[j]->latest().wait(since, std::chrono::milliseconds(0), stale);
+            }
+        }
+        double concurrent = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            for (const std::shared_ptr<targets::target> &t : picked)
+                t->collect();
+        }
+        double serial = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+        snapshot::snapshot_ptr merged = table.merge(snaps);
+        std::set<std::string> one, every;
+        size_t single = samples(snaps[0]->body, "libvirt_vcpu_time", one);
+        size_t total = samples(merged->body, "libvirt_vcpu_time", every);
+        printf("%-10s %4d targets %8zu samples %10.2f ms at once %10.2f ms one by one\n", "collect", ntargets, total, concurrent,
+               serial);
+
+        if (!unique_families(merged->body))
+            errors++;
+        if (single == 0 || total != single * ntargets || every.size() != (size_t)ntargets)
+        {
+            fprintf(stderr, "merge: %zu samples of %zu hypervisors, expected %zu of %d\n", total, every.size(), single * ntargets,
+                    ntargets);
+            errors++;
+        }
+    }
+
+    // Targets from requests: refused past the limit, and removed once idle.
+    {
+        targets::settings s;
+        s.allowed = {"test:///*"};
+        s.max_targets = 2;
+        s.idle = std::chrono::seconds(1);
+        targets::table table(opts, s);
+
+        auto refused = [&table](const std::string &uri) {
+            std::vector<std::shared_ptr<targets::target>> picked;
+            try
+            {
+                table.pick({uri}, picked);
+                return false;
+            }
+            catch (const std::invalid_argument &)
+            {
+                return true;
+            }
+        };
+
+        bool limited = !refused("test:///default?bench=1") && !refused("test:///default?bench=2") && refused("test:///default?bench=3");
+        bool nested = refused("test:///a/b");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        bool evicted = !refused("test:///default?bench=3");
+        printf("%-10s %4zu allowed %8s past it %8s under a path %8s once idle\n", "dynamic", s.max_targets,
+               limited ? "refused" : "added", nested ? "refused" : "added", evicted ? "removed" : "kept");
+
+        if (!limited || !nested || !evicted)
+        {
+            fprintf(stderr, "dynamic: targets past the limit, under a path, or idle were not handled\n");
+            errors++;
+        }
+    }
+
+    return errors == 0 ? 0 : 1;
+}
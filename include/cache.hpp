@@ -0,0 +1,233 @@
+#ifndef __CACHE_HPP__
+#define __CACHE_HPP__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <format.hpp>
+#include <libvirt/libvirt.h>
+
+namespace cache
+{
+    /**
+     * @brief The labels of a domain, that only change when the domain
+     * is (re)defined or its metadata is changed.
+     */
+    struct domain_info
+    {
+        std::string name;
+        std::string uuid;
+        std::string tenant;
+    };
+
+    using domain_info_ptr = std::shared_ptr<const domain_info>;
+
+    /**
+     * @brief Lets the cache be searched by string_view, without
+     * allocating a key string per lookup.
+     */
+    struct key_hash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view key) const
+        {
+            return std::hash<std::string_view>()(key);
+        }
+    };
+
+    /**
+     * @brief Domain metadata, keyed by domain uuid. Filled once per domain, and
+     * invalidated from libvirt lifecycle and metadata-change events, so steady-state
+     * scrapes make no per-domain metadata RPCs.
+     */
+    class domain_cache
+    {
+    public:
+        domain_cache() = default;
+        domain_cache(const domain_cache &) = delete;
+        domain_cache &operator=(const domain_cache &) = delete;
+
+        ~domain_cache()
+        {
+            deregister_events();
+        }
+
+        /**
+         * @brief Returns the labels of a domain, fetching them on a miss.
+         *
+         * @param dom the domain
+         * @return domain_info_ptr
+         */
+        domain_info_ptr get(virDomainPtr dom)
+        {
+            char uuid[VIR_UUID_STRING_BUFLEN] = {0};
+            virDomainGetUUIDString(dom, uuid);
+
+            unsigned long long generation;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = entries.find(std::string_view(uuid));
+                if (it != entries.end())
+                    return it->second;
+
+                generation = invalidations;
+            }
+
+            auto info = std::make_shared<domain_info>();
+            info->name = virDomainGetName(dom);
+            info->uuid = uuid;
+            info->tenant = custom::virDomainGetTenant(dom);
+            fetches++;
+            thread_fetches()++;
+
+            // Don't cache, what an event may have invalidated while we fetched,
+            // nor anything at all, if we don't get events.
+            std::lock_guard<std::mutex> guard(lock);
+            if (caching && generation == invalidations)
+                entries[info->uuid] = info;
+
+            return info;
+        }
+
+        /**
+         * @brief Drops a domain from the cache.
+         *
+         * @param dom the domain
+         */
+        void invalidate(virDomainPtr dom)
+        {
+            char uuid[VIR_UUID_STRING_BUFLEN] = {0};
+            virDomainGetUUIDString(dom, uuid);
+            forget(uuid);
+        }
+
+        /**
+         * @brief Drops a domain from the cache, by uuid, e.g when it is no
+         * longer listed, in case its lifecycle event was missed.
+         *
+         * @param uuid the domain uuid
+         */
+        void forget(std::string_view uuid)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(std::string_view(uuid));
+            if (it != entries.end())
+                entries.erase(it);
+            invalidations++;
+        }
+
+        /**
+         * @brief Drops all domains from the cache.
+         */
+        void clear()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            entries.clear();
+            invalidations++;
+        }
+
+        /**
+         * @brief Registers lifecycle and metadata-change callbacks on conn.
+         * Requires a running libvirt event loop.
+         *
+         * @param conn the libvirt connection
+         * @return int -1 on failure
+         */
+        int register_events(virConnectPtr conn)
+        {
+            deregister_events();
+
+            lifecycle_id = virConnectDomainEventRegisterAny(conn, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                                            VIR_DOMAIN_EVENT_CALLBACK(on_lifecycle), this, NULL);
+            metadata_id = virConnectDomainEventRegisterAny(conn, NULL, VIR_DOMAIN_EVENT_ID_METADATA_CHANGE,
+                                                           VIR_DOMAIN_EVENT_CALLBACK(on_metadata_change), this, NULL);
+            events_conn = conn;
+
+            // We can't trust what we have, if we miss events.
+            clear();
+
+            std::lock_guard<std::mutex> guard(lock);
+            caching = lifecycle_id >= 0 && metadata_id >= 0;
+            return caching ? 0 : -1;
+        }
+
+        /**
+         * @brief Number of metadata fetches (RPCs) since start.
+         *
+         * @return unsigned long long
+         */
+        unsigned long long rpcs() const
+        {
+            return fetches.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Number of metadata fetches (RPCs) made by the calling
+         * thread, e.g to account them to one collection shard.
+         *
+         * @return unsigned long long&
+         */
+        static unsigned long long &thread_fetches()
+        {
+            static thread_local unsigned long long count = 0;
+            return count;
+        }
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return entries.size();
+        }
+
+        /**
+         * @brief Stops caching and following the events, e.g before the
+         * connection is closed.
+         */
+        void deregister_events()
+        {
+            if (events_conn == NULL)
+                return;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                caching = false;
+            }
+
+            if (lifecycle_id >= 0)
+                virConnectDomainEventDeregisterAny(events_conn, lifecycle_id);
+            if (metadata_id >= 0)
+                virConnectDomainEventDeregisterAny(events_conn, metadata_id);
+
+            events_conn = NULL;
+            lifecycle_id = metadata_id = -1;
+        }
+
+    private:
+        static int on_lifecycle(virConnectPtr, virDomainPtr dom, int, int, void *opaque)
+        {
+            static_cast<domain_cache *>(opaque)->invalidate(dom);
+            return 0;
+        }
+
+        static void on_metadata_change(virConnectPtr, virDomainPtr dom, int, const char *, void *opaque)
+        {
+            static_cast<domain_cache *>(opaque)->invalidate(dom);
+        }
+
+        std::mutex lock;
+        std::unordered_map<std::string, domain_info_ptr, key_hash, std::equal_to<>> entries;
+        unsigned long long invalidations = 0;
+        bool caching = false;
+        std::atomic<unsigned long long> fetches{0};
+
+        virConnectPtr events_conn = NULL;
+        int lifecycle_id = -1;
+        int metadata_id = -1;
+    };
+}
+
+#endif
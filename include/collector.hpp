@@ -0,0 +1,609 @@
+#ifndef __COLLECTOR_HPP__
+#define __COLLECTOR_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <format.hpp>
+#include <cache.hpp>
+#include <exposition.hpp>
+#include <handles.hpp>
+#include <instrument.hpp>
+#include <live.hpp>
+#include <pool.hpp>
+#include <serializers.hpp>
+#include <libvirt/libvirt.h>
+
+namespace collector
+{
+
+    /**
+     * @brief Bookkeeping of a single collection.
+     */
+    struct result
+    {
+        int domains = 0;
+        size_t records = 0;
+        size_t rpcs = 0;
+        size_t samples = 0;
+        unsigned long long allocations = 0;
+        // Stats of the tiers that were refreshed.
+        unsigned int refreshed = 0;
+    };
+
+    /**
+     * @brief A stat group, by name.
+     */
+    struct group
+    {
+        const char *name;
+        unsigned int stats;
+    };
+
+    inline constexpr group groups[] = {
+        {"vcpu", VIR_DOMAIN_STATS_VCPU},
+        {"interface", VIR_DOMAIN_STATS_INTERFACE},
+        {"block", VIR_DOMAIN_STATS_BLOCK},
+        {"balloon", VIR_DOMAIN_STATS_BALLOON},
+        {"cpu_total", VIR_DOMAIN_STATS_CPU_TOTAL},
+    };
+
+    constexpr size_t GROUPS = std::size(groups);
+
+    static_assert(GROUPS == (size_t)fields::group::count, "a stat group per field group");
+
+    /**
+     * @brief What, and how, to collect on each scrape.
+     */
+    struct options
+    {
+        unsigned int stats = VIR_DOMAIN_STATS_VCPU | VIR_DOMAIN_STATS_INTERFACE | VIR_DOMAIN_STATS_BLOCK;
+        unsigned int flags = VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT;
+        // How often each group is refreshed, 0 on every collection.
+        std::chrono::seconds refresh[GROUPS] = {};
+        // Groups summed per domain, and the domains that keep their detail.
+        serializer::aggregation aggregate;
+        // Labels every sample as hypervisor, if not empty.
+        std::string hypervisor;
+        // Adds the rates of fields::rates, next to their counters.
+        bool rates = false;
+    };
+
+    /**
+     * @brief The index of a stat group in groups, by name.
+     *
+     * @param name the name, "net" and "memory" are taken as aliases
+     * @return size_t
+     */
+    inline size_t find_group(std::string name)
+    {
+        if (name == "net")
+            name = "interface";
+        if (name == "memory")
+            name = "balloon";
+
+        for (size_t g = 0; g < GROUPS; g++)
+        {
+            if (name == groups[g].name)
+                return g;
+        }
+
+        throw std::invalid_argument("unknown stat group: " + name);
+    }
+
+    /**
+     * @brief Parses a comma-separated list of stat groups,
+     * e.g "vcpu,interface,block" into virDomainStatsTypes.
+     *
+     * @param list the list
+     * @return unsigned int the or'ed stat types
+     */
+    inline unsigned int parse_stats(const std::string &list)
+    {
+        unsigned int stats = 0;
+
+        for (const std::string &name : custom::split(list, ","))
+            stats |= groups[find_group(name)].stats;
+
+        return stats;
+    }
+
+    /**
+     * @brief Parses a comma-separated list of refresh intervals per stat
+     * group, e.g "block=60,interface=15" into opts.refresh.
+     *
+     * @param list the list
+     * @param opts the options
+     */
+    inline void parse_refresh(const std::string &list, options &opts)
+    {
+        for (const std::string &item : custom::split(list, ","))
+        {
+            size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                throw std::invalid_argument("expected group=seconds: " + item);
+
+            unsigned long seconds;
+            if (!custom::parse_number(std::string_view(item).substr(eq + 1), seconds))
+                throw std::invalid_argument("not a number of seconds: " + item);
+            opts.refresh[find_group(item.substr(0, eq))] = std::chrono::seconds(seconds);
+        }
+    }
+
+    /**
+     * @brief Parses a comma-separated list of stat groups to sum per
+     * domain, e.g "vcpu,interface" into opts.aggregate. "devices" is taken
+     * for interface and block.
+     *
+     * @param list the list
+     * @param opts the options
+     */
+    inline void parse_aggregate(const std::string &list, options &opts)
+    {
+        for (const std::string &name : custom::split(list, ","))
+        {
+            if (name == "devices")
+            {
+                opts.aggregate.groups[(int)fields::group::net] = true;
+                opts.aggregate.groups[(int)fields::group::block] = true;
+                continue;
+            }
+
+            size_t g = find_group(name);
+            if (!fields::indexed[g])
+                throw std::invalid_argument("not per vCPU or device: " + name);
+            opts.aggregate.groups[g] = true;
+        }
+    }
+
+    /**
+     * @brief Which of shards a domain belongs to, by its uuid. Stable across
+     * connections and scrapes.
+     *
+     * @param dom the domain
+     * @param shards number of shards
+     * @return size_t
+     */
+    inline size_t shard_of(virDomainPtr dom, size_t shards)
+    {
+        unsigned char uuid[VIR_UUID_BUFLEN] = {0};
+        virDomainGetUUID(dom, uuid);
+
+        // FNV-1a
+        unsigned long long hash = 14695981039346656037ULL;
+        for (unsigned char byte : uuid)
+        {
+            hash ^= byte;
+            hash *= 1099511628211ULL;
+        }
+        return hash % shards;
+    }
+
+    /**
+     * @brief Stat groups that are refreshed together, with one
+     * virDomainListGetStats call, and their latest samples.
+     */
+    struct tier
+    {
+        exposition::families families;
+        serializer::series_table series{families};
+    };
+
+    /**
+     * @brief A libvirt connection, the domains collected over it, and
+     * their latest samples.
+     */
+    struct shard
+    {
+        virConnectPtr conn = NULL;
+        handles::registry registry;
+        // Samples of every collection, e.g the up gauge.
+        exposition::families families;
+        std::vector<tier> tiers;
+        result res;
+    };
+
+    /**
+     * @brief Collects the due stat groups for the active domains of a
+     * shard, with one virDomainListGetStats call per due tier, and adds
+     * their samples to the families of the tier. The tiers that are not
+     * due keep their samples.
+     *
+     * @param opts the options
+     * @param due the stats of each tier, 0 if not due
+     * @param domains the domain metadata cache
+     * @param part the shard
+     * @param set the active domains, from events, NULL to list them
+     * @param index this shard
+     * @param shards number of shards
+     * @return result
+     */
+    inline result collect(const options &opts, const unsigned int *due, cache::domain_cache &domains, shard &part,
+                          const live::domain_set *set = NULL, size_t index = 0, size_t shards = 1)
+    {
+        result res;
+        exposition::families &f = part.families;
+        unsigned long long metadata_rpcs = cache::domain_cache::thread_fetches();
+        unsigned long long allocations = instrument::thread_allocations();
+        f.clear();
+
+        // List, domains and take stats, but only if something is there.
+        // With events, the domains are known without listing them.
+        auto keep = [index, shards](virDomainPtr dom) {
+            return shards <= 1 || shard_of(dom, shards) == index;
+        };
+        instrument::timer listing(instrument::phase::list);
+        int rpcs = set != NULL && set->tracking() ? part.registry.sync(part.conn, *set, keep) : part.registry.refresh(part.conn, keep);
+        listing.stop();
+
+        res.rpcs += rpcs < 0 ? 1 : rpcs;
+        res.domains = rpcs < 0 ? 0 : part.registry.size();
+
+        // Don't keep the metadata of domains that are gone, events or not.
+        for (const std::string &uuid : part.registry.dropped())
+            domains.forget(uuid);
+
+        virDomainPtr *doms = part.registry.domains();
+
+        for (size_t t = 0; t < part.tiers.size(); t++)
+        {
+            if (due[t] == 0)
+            {
+                res.samples += part.tiers[t].families.samples();
+                continue;
+            }
+
+            part.tiers[t].families.clear();
+            res.refreshed |= due[t];
+            if (res.domains <= 0)
+                continue;
+
+            handles::stats_list stats;
+            instrument::timer getting(instrument::phase::stats);
+            int rc = virDomainListGetStats(doms, due[t], stats.out(), opts.flags);
+            getting.stop();
+            res.rpcs++;
+
+            if (rc > 0)
+            {
+                res.records += rc;
+                part.tiers[t].series.domain_metrics(domains, rc, stats.get());
+            }
+            res.samples += part.tiers[t].families.samples();
+        }
+
+        // Make "up
+        exposition::family &up = f.get("gauge", "Running domains.", "libvirt", "up");
+        for (int j = 0; j < res.domains; j++)
+        {
+            cache::domain_info_ptr info = domains.get(doms[j]);
+
+            f.add(up, info)
+                .label("domain", info->name)
+                .label("uuid", info->uuid)
+                .label("tenant", info->tenant)
+                .optional_label("hypervisor", opts.hypervisor)
+                .value(1);
+        }
+
+        // virDomainGetMetadata, on cache misses.
+        res.rpcs += cache::domain_cache::thread_fetches() - metadata_rpcs;
+
+        res.samples += f.samples();
+        res.allocations = instrument::thread_allocations() - allocations;
+        instrument::rpcs.add(res.rpcs);
+        instrument::samples.add(res.samples);
+
+        return res;
+    }
+
+    /**
+     * @brief Collects over a number of read-only connections in parallel. The
+     * domains are sharded across the connections by uuid, each shard is
+     * collected on a thread of its own into its own families, and the shards
+     * are rendered straight into the body.
+     *
+     * The stat groups are scheduled in tiers: groups with the same refresh
+     * interval are collected together, and the tiers are staggered across
+     * their intervals, so they don't all hit libvirtd at once. A collection
+     * takes the due tiers, the others are rendered from their last one.
+     */
+    class engine
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /**
+         * @brief Opens the connections.
+         *
+         * @param uri the libvirt uri
+         * @param shards number of connections, and threads
+         * @param opts the options
+         * @param domains the domain metadata cache
+         */
+        engine(const char *uri, size_t shards, const options &opts, cache::domain_cache &domains)
+            : opts(opts), domains(domains), parts(std::max<size_t>(1, shards)), workers(parts.size() > 1 ? parts.size() : 0)
+        {
+            // A tier per refresh interval, in the order of the groups.
+            for (size_t g = 0; g < GROUPS; g++)
+            {
+                if ((opts.stats & groups[g].stats) == 0)
+                    continue;
+
+                size_t t = 0;
+                while (t < schedule.size() && schedule[t].period != opts.refresh[g])
+                    t++;
+                if (t == schedule.size())
+                    schedule.push_back({0, opts.refresh[g], clock::time_point(), false});
+
+                schedule[t].stats |= groups[g].stats;
+            }
+
+            for (shard &part : parts)
+            {
+                part.tiers = std::vector<tier>(schedule.size());
+                for (tier &t : part.tiers)
+                {
+                    t.series.aggregate(&opts.aggregate);
+                    t.series.tag(opts.hypervisor);
+                    t.series.derive(opts.rates);
+                }
+                part.conn = virConnectOpenReadOnly(uri);
+                if (part.conn == NULL)
+                {
+                    close();
+                    throw std::runtime_error(std::string("Failed to connect to ") + uri);
+                }
+            }
+        }
+
+        engine(const engine &) = delete;
+        engine &operator=(const engine &) = delete;
+
+        ~engine()
+        {
+            close();
+        }
+
+        /**
+         * @brief The first connection, e.g to register events on.
+         *
+         * @return virConnectPtr
+         */
+        virConnectPtr primary() const
+        {
+            return parts[0].conn;
+        }
+
+        size_t shards() const
+        {
+            return parts.size();
+        }
+
+        /**
+         * @brief The hypervisor label of the samples, empty for none.
+         *
+         * @return const std::string&
+         */
+        const std::string &hypervisor() const
+        {
+            return opts.hypervisor;
+        }
+
+        /**
+         * @brief Takes the active domains from set, while it tracks them,
+         * instead of listing them on every collection.
+         *
+         * @param set the domain set, outlives the engine
+         */
+        void follow(const live::domain_set &set)
+        {
+            tracked = &set;
+        }
+
+        /**
+         * @brief Held while collecting and rendering, so that a collection
+         * isn't rendered half way.
+         *
+         * @return std::mutex&
+         */
+        std::mutex &exclusive()
+        {
+            return running;
+        }
+
+        /**
+         * @brief The size of the last body rendered from this engine, to
+         * size the next one. Used under exclusive().
+         *
+         * @return size_t&
+         */
+        size_t &last_size()
+        {
+            return rendered_size;
+        }
+
+        /**
+         * @brief Collects every shard, and the due tiers. Not to be called
+         * concurrently, see exclusive().
+         *
+         * @return result the sum of the shards
+         */
+        result collect()
+        {
+            clock::time_point now = clock::now();
+            std::vector<unsigned int> due(schedule.size());
+            for (size_t t = 0; t < schedule.size(); t++)
+            {
+                scheduled &s = schedule[t];
+                s.fresh = s.period.count() <= 0 || s.next == clock::time_point() || now >= s.next;
+                if (!s.fresh)
+                    continue;
+
+                due[t] = s.stats;
+                for (size_t g = 0; g < GROUPS; g++)
+                {
+                    if (s.stats & groups[g].stats)
+                        refreshed_at[g] = now;
+                }
+                s.next = next(t, now);
+            }
+
+            if (parts.size() == 1)
+            {
+                parts[0].res = collector::collect(opts, due.data(), domains, parts[0], tracked);
+                return parts[0].res;
+            }
+
+            std::vector<std::future<void>> done;
+            for (size_t i = 0; i < parts.size(); i++)
+            {
+                done.push_back(workers.submit([this, i, &due]() {
+                    shard &part = parts[i];
+                    part.res = collector::collect(opts, due.data(), domains, part, tracked, i, parts.size());
+                }));
+            }
+
+            result res;
+            for (size_t i = 0; i < parts.size(); i++)
+            {
+                done[i].get();
+                res.domains += parts[i].res.domains;
+                res.records += parts[i].res.records;
+                res.rpcs += parts[i].res.rpcs;
+                res.samples += parts[i].res.samples;
+                res.allocations += parts[i].res.allocations;
+                res.refreshed |= parts[i].res.refreshed;
+            }
+            return res;
+        }
+
+        /**
+         * @brief When the next tier is due.
+         *
+         * @return clock::time_point max, if none is scheduled
+         */
+        clock::time_point next_due() const
+        {
+            clock::time_point due = clock::time_point::max();
+            for (const scheduled &s : schedule)
+            {
+                if (s.period.count() > 0)
+                    due = std::min(due, s.next);
+            }
+            return due;
+        }
+
+        /**
+         * @brief When a stat group was last refreshed.
+         *
+         * @param g the group, an index into groups
+         * @return clock::time_point epoch, if the group is not collected
+         */
+        clock::time_point refreshed(size_t g) const
+        {
+            return refreshed_at[g];
+        }
+
+        /**
+         * @brief The families of the last collection, in the order they are rendered.
+         *
+         * @param sets the sets to append to
+         * @param fresh only the tiers the last collection refreshed, e.g
+         * to push them, rather than those kept from earlier ones
+         */
+        void families(std::vector<const exposition::families *> &sets, bool fresh = false) const
+        {
+            for (const shard &part : parts)
+            {
+                for (size_t t = 0; t < part.tiers.size(); t++)
+                {
+                    if (!fresh || schedule[t].fresh)
+                        sets.push_back(&part.tiers[t].families);
+                }
+            }
+            for (const shard &part : parts)
+                sets.push_back(&part.families);
+        }
+
+        /**
+         * @brief Renders the last collection.
+         *
+         * @param out the buffer to append to
+         * @param where where the families and samples went, if set
+         */
+        void render(std::string &out, exposition::layout *where = NULL) const
+        {
+            std::vector<const exposition::families *> sets;
+            families(sets);
+            exposition::render(sets.data(), sets.size(), out, where);
+        }
+
+    private:
+        struct scheduled
+        {
+            unsigned int stats = 0;
+            std::chrono::seconds period{0};
+            clock::time_point next;
+            // Refreshed by the last collection.
+            bool fresh = false;
+        };
+
+        /**
+         * @brief When tier t is due next, after a refresh at now. The first
+         * refresh is followed by one offset by the tier's share of its
+         * period, which staggers the tiers from then on.
+         */
+        clock::time_point next(size_t t, clock::time_point now) const
+        {
+            if (schedule[t].period.count() <= 0)
+                return now;
+
+            if (schedule[t].next == clock::time_point())
+            {
+                size_t periodic = 0, rank = 0;
+                for (size_t k = 0; k < schedule.size(); k++)
+                {
+                    if (schedule[k].period.count() > 0)
+                    {
+                        rank += k < t;
+                        periodic++;
+                    }
+                }
+                return now + schedule[t].period + schedule[t].period * rank / periodic;
+            }
+
+            // Keep the phase, unless we fell behind.
+            clock::time_point due = schedule[t].next + schedule[t].period;
+            return due > now ? due : now + schedule[t].period;
+        }
+
+        void close()
+        {
+            for (shard &part : parts)
+            {
+                part.registry.clear();
+                if (part.conn != NULL)
+                    virConnectClose(part.conn);
+                part.conn = NULL;
+            }
+        }
+
+        const options &opts;
+        cache::domain_cache &domains;
+        const live::domain_set *tracked = NULL;
+        std::vector<scheduled> schedule;
+        clock::time_point refreshed_at[GROUPS];
+        std::mutex running;
+        size_t rendered_size = 0;
+        std::vector<shard> parts;
+        pool::thread_pool workers;
+    };
+}
+
+#endif
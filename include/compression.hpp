@@ -0,0 +1,396 @@
+#ifndef __COMPRESSION_HPP__
+#define __COMPRESSION_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#include <http.hpp>
+
+namespace compression
+{
+    enum class encoding
+    {
+        identity,
+        gzip,
+        zstd
+    };
+
+    /**
+     * @brief The Content-Encoding name of an encoding.
+     *
+     * @param enc the encoding
+     * @return const char*
+     */
+    inline const char *name(encoding enc)
+    {
+        switch (enc)
+        {
+        case encoding::gzip:
+            return "gzip";
+        case encoding::zstd:
+            return "zstd";
+        default:
+            return "identity";
+        }
+    }
+
+    /**
+     * @brief Picks the encoding of a response, from the Accept-Encoding header.
+     * zstd is preferred over gzip, when built with it.
+     *
+     * @param accept_encoding the header value
+     * @return encoding
+     */
+    inline encoding negotiate(std::string_view accept_encoding)
+    {
+#ifdef WITH_ZSTD
+        if (http::accepts(accept_encoding, "zstd"))
+            return encoding::zstd;
+#endif
+        if (http::accepts(accept_encoding, "gzip"))
+            return encoding::gzip;
+
+        return encoding::identity;
+    }
+
+    /**
+     * @brief A gzip member, that is still open: the header and the
+     * deflated data, flushed to a byte boundary. More data can be appended
+     * with gzip_finish, without compressing the start again.
+     */
+    struct gzip_prefix
+    {
+        std::string data;
+        uLong crc = 0;
+        uLong size = 0;
+    };
+
+    inline void deflate_into(z_stream &zs, std::string_view in, int flush, std::string &out)
+    {
+        zs.next_in = (Bytef *)in.data();
+        zs.avail_in = in.size();
+
+        do
+        {
+            size_t used = out.size();
+            out.resize(used + deflateBound(&zs, zs.avail_in) + 64);
+            zs.next_out = (Bytef *)&out[used];
+            zs.avail_out = out.size() - used;
+
+            int ret = deflate(&zs, flush);
+            out.resize(out.size() - zs.avail_out);
+
+            if (ret == Z_STREAM_ERROR)
+                throw std::runtime_error("deflate failed");
+            if (flush == Z_FINISH && ret == Z_STREAM_END)
+                break;
+        } while (zs.avail_in > 0 || zs.avail_out == 0);
+    }
+
+    /**
+     * @brief Starts a gzip member with data, e.g the body of a snapshot.
+     *
+     * @param data the data
+     * @param level the compression level
+     * @return gzip_prefix
+     */
+    inline gzip_prefix gzip_begin(std::string_view data, int level = Z_DEFAULT_COMPRESSION)
+    {
+        gzip_prefix prefix;
+
+        // RFC 1952 header: magic, deflate, no flags, no mtime, no extra flags, unix.
+        static const char header[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+        prefix.data.assign(header, sizeof(header));
+
+        z_stream zs = {};
+        if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+
+        prefix.data.reserve(data.size() / 4);
+        deflate_into(zs, data, Z_SYNC_FLUSH, prefix.data);
+        deflateEnd(&zs);
+
+        prefix.crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data.data(), data.size());
+        prefix.size = data.size();
+        return prefix;
+    }
+
+    /**
+     * @brief Appends what completes a gzip member after its prefix: tail,
+     * e.g the per-request lines, deflated on its own as the last block,
+     * and the trailer. The prefix can then be sent as is, without a copy.
+     *
+     * @param prefix the open member
+     * @param tail the data to append
+     * @param out the buffer to append to
+     */
+    inline void gzip_close(const gzip_prefix &prefix, std::string_view tail, std::string &out)
+    {
+        out.reserve(out.size() + tail.size() + 64);
+
+        z_stream zs = {};
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+
+        deflate_into(zs, tail, Z_FINISH, out);
+        deflateEnd(&zs);
+
+        uLong crc = crc32_combine(prefix.crc, crc32(crc32(0L, Z_NULL, 0), (const Bytef *)tail.data(), tail.size()), tail.size());
+        uLong size = prefix.size + tail.size();
+
+        // RFC 1952 trailer: crc32 and size, little endian.
+        for (int i = 0; i < 4; i++)
+            out.push_back((char)((crc >> (8 * i)) & 0xff));
+        for (int i = 0; i < 4; i++)
+            out.push_back((char)((size >> (8 * i)) & 0xff));
+    }
+
+    /**
+     * @brief Completes a gzip member with tail, into one buffer.
+     *
+     * @param prefix the open member
+     * @param tail the data to append
+     * @param out the complete member
+     */
+    inline void gzip_finish(const gzip_prefix &prefix, std::string_view tail, std::string &out)
+    {
+        out.reserve(prefix.data.size() + tail.size() + 64);
+        out.assign(prefix.data);
+        gzip_close(prefix, tail, out);
+    }
+
+#ifdef WITH_ZSTD
+    /**
+     * @brief Appends data as a zstd frame. Frames can be concatenated.
+     *
+     * @param data the data
+     * @param out the buffer to append to
+     * @param level the compression level
+     */
+    inline void zstd_frame(std::string_view data, std::string &out, int level = 3)
+    {
+        size_t used = out.size();
+        out.resize(used + ZSTD_compressBound(data.size()));
+
+        size_t n = ZSTD_compress(&out[used], out.size() - used, data.data(), data.size(), level);
+        if (ZSTD_isError(n))
+            throw std::runtime_error(ZSTD_getErrorName(n));
+
+        out.resize(used + n);
+    }
+#endif
+
+    inline void snappy_literal(std::string_view data, std::string &out)
+    {
+        size_t n = data.size() - 1;
+        if (n < 60)
+            out.push_back((char)(n << 2));
+        else
+        {
+            int bytes = n < (1 << 8) ? 1 : n < (1 << 16) ? 2 : n < (1 << 24) ? 3 : 4;
+            out.push_back((char)((59 + bytes) << 2));
+            for (int b = 0; b < bytes; b++)
+                out.push_back((char)(n >> (8 * b)));
+        }
+        out.append(data);
+    }
+
+    inline void snappy_copy(size_t offset, size_t length, std::string &out)
+    {
+        // Copies of up to 64 bytes, with a 2-byte offset, or 4 to 11 bytes with an 11-bit one.
+        auto copy = [&out, offset](size_t n) {
+            if (n < 12 && offset < 2048)
+            {
+                out.push_back((char)(1 | ((n - 4) << 2) | ((offset >> 8) << 5)));
+                out.push_back((char)offset);
+            }
+            else
+            {
+                out.push_back((char)(2 | ((n - 1) << 2)));
+                out.push_back((char)offset);
+                out.push_back((char)(offset >> 8));
+            }
+        };
+
+        while (length >= 68)
+        {
+            copy(64);
+            length -= 64;
+        }
+        if (length > 64)
+        {
+            copy(60);
+            length -= 60;
+        }
+        copy(length);
+    }
+
+    /**
+     * @brief Appends data in the snappy block format, as Prometheus remote
+     * write expects it. Matches are found with a hash table of 4-byte
+     * sequences, in blocks of 64 KiB, as the reference implementation does.
+     *
+     * @param data the data
+     * @param out the buffer to append to
+     */
+    inline void snappy_compress(std::string_view data, std::string &out)
+    {
+        constexpr size_t BLOCK = 1 << 16;
+        constexpr int HASH_BITS = 14;
+
+        auto load = [](const char *p) {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        };
+        auto hash = [](uint32_t v) { return (v * 0x1e35a7bdU) >> (32 - HASH_BITS); };
+
+        out.reserve(out.size() + 32 + data.size() + data.size() / 6);
+
+        // The preamble, the uncompressed length as a varint.
+        for (uint64_t n = data.size(); ; n >>= 7)
+        {
+            if (n < 0x80)
+            {
+                out.push_back((char)n);
+                break;
+            }
+            out.push_back((char)(n | 0x80));
+        }
+
+        uint16_t table[1 << HASH_BITS];
+        for (size_t base = 0; base < data.size(); base += BLOCK)
+        {
+            std::string_view block = data.substr(base, BLOCK);
+            const char *in = block.data();
+            size_t emitted = 0;
+
+            // Too short to look for matches in.
+            if (block.size() >= 15)
+            {
+                memset(table, 0, sizeof(table));
+                size_t limit = block.size() - 4;
+                size_t pos = 1;
+                uint32_t skip = 32;
+
+                while (pos <= limit)
+                {
+                    uint32_t h = hash(load(in + pos));
+                    size_t candidate = table[h];
+                    table[h] = (uint16_t)pos;
+
+                    if (candidate >= pos || load(in + candidate) != load(in + pos))
+                    {
+                        // Step further, the longer nothing matched.
+                        pos += skip++ >> 5;
+                        continue;
+                    }
+                    skip = 32;
+
+                    size_t length = 4;
+                    while (pos + length < block.size() && in[candidate + length] == in[pos + length])
+                        length++;
+
+                    if (pos > emitted)
+                        snappy_literal(block.substr(emitted, pos - emitted), out);
+                    snappy_copy(pos - candidate, length, out);
+
+                    pos += length;
+                    emitted = pos;
+                    if (pos - 1 <= limit)
+                        table[hash(load(in + pos - 1))] = (uint16_t)(pos - 1);
+                }
+            }
+
+            if (emitted < block.size())
+                snappy_literal(block.substr(emitted), out);
+        }
+    }
+
+    /**
+     * @brief Decompresses a snappy block, e.g to check what was sent.
+     *
+     * @param data the compressed data
+     * @param out the buffer to append to
+     * @return bool false, if data is corrupt
+     */
+    inline bool snappy_uncompress(std::string_view data, std::string &out)
+    {
+        size_t pos = 0;
+        uint64_t length = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (pos >= data.size())
+                return false;
+            uint8_t b = data[pos++];
+            length |= (uint64_t)(b & 0x7f) << shift;
+            if (b < 0x80)
+                break;
+        }
+
+        size_t start = out.size();
+        out.reserve(start + length);
+        while (pos < data.size())
+        {
+            uint8_t tag = data[pos++];
+            size_t n, offset;
+            switch (tag & 3)
+            {
+            case 0:
+                n = tag >> 2;
+                if (n >= 60)
+                {
+                    int bytes = n - 59;
+                    if (pos + bytes > data.size())
+                        return false;
+                    n = 0;
+                    for (int b = 0; b < bytes; b++)
+                        n |= (size_t)(uint8_t)data[pos++] << (8 * b);
+                }
+                n++;
+                if (pos + n > data.size())
+                    return false;
+                out.append(data.substr(pos, n));
+                pos += n;
+                continue;
+            case 1:
+                if (pos + 1 > data.size())
+                    return false;
+                n = 4 + ((tag >> 2) & 7);
+                offset = ((size_t)(tag >> 5) << 8) | (uint8_t)data[pos++];
+                break;
+            case 2:
+                if (pos + 2 > data.size())
+                    return false;
+                n = 1 + (tag >> 2);
+                offset = (uint8_t)data[pos] | ((size_t)(uint8_t)data[pos + 1] << 8);
+                pos += 2;
+                break;
+            default:
+                if (pos + 4 > data.size())
+                    return false;
+                n = 1 + (tag >> 2);
+                offset = 0;
+                for (int b = 0; b < 4; b++)
+                    offset |= (size_t)(uint8_t)data[pos++] << (8 * b);
+                break;
+            }
+
+            // Copies may overlap what they append, byte by byte then.
+            if (offset == 0 || offset > out.size() - start)
+                return false;
+            for (size_t i = 0; i < n; i++)
+                out.push_back(out[out.size() - offset]);
+        }
+
+        return out.size() - start == length;
+    }
+}
+
+#endif
@@ -0,0 +1,684 @@
+#ifndef __EXPOSITION_HPP__
+#define __EXPOSITION_HPP__
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace cache
+{
+    struct domain_info;
+}
+
+namespace exposition
+{
+    /**
+     * @brief Appends a label value, escaped as the text format requires.
+     *
+     * @param buf the buffer
+     * @param value the value
+     */
+    inline void append_escaped(std::string &buf, std::string_view value)
+    {
+        size_t start = 0;
+        for (size_t i = 0; i < value.size(); i++)
+        {
+            char c = value[i];
+            if (c != '\\' && c != '"' && c != '\n')
+                continue;
+
+            buf.append(value.substr(start, i - start));
+            buf.push_back('\\');
+            buf.push_back(c == '\n' ? 'n' : c);
+            start = i + 1;
+        }
+        buf.append(value.substr(start));
+    }
+
+    /**
+     * @brief Appends a number, with std::to_chars.
+     *
+     * @param buf the buffer
+     * @param value the value
+     */
+    template <typename T>
+    inline void append_number(std::string &buf, T value)
+    {
+        char digits[32];
+        std::to_chars_result res = std::to_chars(digits, digits + sizeof(digits), value);
+        buf.append(digits, res.ptr - digits);
+    }
+
+    /**
+     * @brief Appends a sample value. Integral values are written
+     * as integers, e.g counters in ns, everything else in the shortest form.
+     *
+     * @param buf the buffer
+     * @param value the value
+     */
+    inline void append_number(std::string &buf, double value)
+    {
+        char digits[32];
+        std::to_chars_result res;
+
+        if (value == std::floor(value) && std::fabs(value) < 1e18)
+            res = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed);
+        else
+            res = std::to_chars(digits, digits + sizeof(digits), value);
+
+        buf.append(digits, res.ptr - digits);
+    }
+
+    /**
+     * @brief Appends a label, to a label set, e.g {a="1" => {a="1",b="2"
+     *
+     * @param buf the buffer
+     * @param first the first label of the set
+     * @param key the label name
+     * @param value the label value
+     */
+    inline void append_label(std::string &buf, bool first, std::string_view key, std::string_view value)
+    {
+        buf.push_back(first ? '{' : ',');
+        buf.append(key);
+        buf.append("=\"");
+        append_escaped(buf, value);
+        buf.push_back('"');
+    }
+
+    inline void append_label(std::string &buf, bool first, std::string_view key, unsigned long long value)
+    {
+        buf.push_back(first ? '{' : ',');
+        buf.append(key);
+        buf.append("=\"");
+        append_number(buf, value);
+        buf.push_back('"');
+    }
+    inline void append_label(std::string &buf, bool first, std::string_view key, double value)
+    {
+        buf.push_back(first ? '{' : ',');
+        buf.append(key);
+        buf.append("=\"");
+        append_number(buf, value);
+        buf.push_back('"');
+    }
+
+    /**
+     * @brief Streams prometheus text exposition straight into a growable
+     * buffer. Names, labels and numbers are appended in place, so once the
+     * buffer has grown to the size of a scrape, writing a sample does not
+     * allocate.
+     *
+     * w.metric("libvirt", "vcpu", "time").label("domain", name).label("vcpu", "0").value(42);
+     *
+     * => libvirt_vcpu_time{domain="name",vcpu="0"} 42
+     */
+    class writer
+    {
+    public:
+        explicit writer(std::string &buf) : buf(buf)
+        {
+        }
+
+        /**
+         * @brief Writes the # HELP line, of the metric named by the parts.
+         *
+         * @param help the help text
+         * @param parts the name, joined by '_'
+         * @return writer&
+         */
+        template <typename... Parts>
+        writer &help(std::string_view help, const Parts &...parts)
+        {
+            buf.append("# HELP ");
+            name(parts...);
+            buf.push_back(' ');
+            buf.append(help);
+            buf.push_back('\n');
+            return *this;
+        }
+
+        /**
+         * @brief Writes the # TYPE line, of the metric named by the parts.
+         *
+         * @param type e.g counter or gauge
+         * @param parts the name, joined by '_'
+         * @return writer&
+         */
+        template <typename... Parts>
+        writer &type(std::string_view type, const Parts &...parts)
+        {
+            buf.append("# TYPE ");
+            name(parts...);
+            buf.push_back(' ');
+            buf.append(type);
+            buf.push_back('\n');
+            return *this;
+        }
+
+        /**
+         * @brief Starts a sample, of the metric named by the parts.
+         *
+         * @param parts the name, joined by '_'
+         * @return writer&
+         */
+        template <typename... Parts>
+        writer &metric(const Parts &...parts)
+        {
+            name(parts...);
+            labels = 0;
+            return *this;
+        }
+
+        /**
+         * @brief Adds a label to the current sample. The value is escaped.
+         *
+         * @param key the label name
+         * @param value the label value
+         * @return writer&
+         */
+        template <typename T>
+        writer &label(std::string_view key, const T &value)
+        {
+            append_label(buf, labels++ == 0, key, value);
+            return *this;
+        }
+
+        /**
+         * @brief Adds a label, unless its value is empty, e.g the hypervisor
+         * of a sample, which is only there with more than one target.
+         *
+         * @param key the label name
+         * @param value the label value
+         * @return writer&
+         */
+        writer &optional_label(std::string_view key, std::string_view value)
+        {
+            if (!value.empty())
+                append_label(buf, labels++ == 0, key, value);
+            return *this;
+        }
+
+        /**
+         * @brief Ends the current sample with its value.
+         *
+         * @param value the value
+         * @return writer&
+         */
+        template <typename T>
+        writer &value(T value)
+        {
+            if (labels > 0)
+                buf.push_back('}');
+
+            buf.push_back(' ');
+            append_number(buf, value);
+            buf.push_back('\n');
+            return *this;
+        }
+
+        /**
+         * @brief Appends raw text, e.g a comment.
+         *
+         * @param text the text
+         * @return writer&
+         */
+        writer &raw(std::string_view text)
+        {
+            buf.append(text);
+            return *this;
+        }
+
+    private:
+        template <typename Part, typename... Parts>
+        void name(const Part &part, const Parts &...parts)
+        {
+            buf.append(std::string_view(part));
+            ((buf.push_back('_'), buf.append(std::string_view(parts))), ...);
+        }
+
+        std::string &buf;
+        int labels = 0;
+    };
+
+    /**
+     * @brief A metric family, and the samples collected for it in this
+     * scrape, as a structure of arrays: the rendered label sets back to
+     * back in one buffer, their end offsets, the values, and the domain
+     * of each sample, NULL for none.
+     */
+    struct family
+    {
+        std::string name;
+        std::string help;
+        std::string_view type;
+
+        std::string labels;
+        std::vector<size_t> ends;
+        std::vector<double> values;
+        std::vector<const cache::domain_info *> owners;
+
+        size_t size() const
+        {
+            return values.size();
+        }
+
+        std::string_view label_set(size_t i) const
+        {
+            size_t start = i == 0 ? 0 : ends[i - 1];
+            return std::string_view(labels).substr(start, ends[i] - start);
+        }
+
+        void clear()
+        {
+            labels.clear();
+            ends.clear();
+            values.clear();
+            owners.clear();
+        }
+    };
+
+    /**
+     * @brief Where the families of a rendered body are, and the samples of
+     * each domain, so that it can be cut by domain without parsing it.
+     * Offsets are into the body.
+     */
+    struct layout
+    {
+        // The # HELP and # TYPE lines of a family.
+        struct header
+        {
+            size_t start;
+            size_t end;
+        };
+
+        // Consecutive samples of one family and domain.
+        struct run
+        {
+            size_t header;
+            const cache::domain_info *owner;
+            size_t start;
+            size_t end;
+        };
+
+        std::vector<header> headers;
+        std::vector<run> runs;
+    };
+
+    /**
+     * @brief Builds one sample of a family.
+     *
+     * families.add(fam, info).label("domain", name).value(42);
+     */
+    class sample
+    {
+    public:
+        explicit sample(family &fam, const cache::domain_info *owner = NULL) : fam(fam), owner(owner)
+        {
+        }
+
+        template <typename T>
+        sample &label(std::string_view key, const T &value)
+        {
+            append_label(fam.labels, labels++ == 0, key, value);
+            return *this;
+        }
+
+        /**
+         * @brief Adds a label, unless its value is empty.
+         *
+         * @param key the label name
+         * @param value the label value
+         * @return sample&
+         */
+        sample &optional_label(std::string_view key, std::string_view value)
+        {
+            if (!value.empty())
+                append_label(fam.labels, labels++ == 0, key, value);
+            return *this;
+        }
+
+        void value(double value)
+        {
+            if (labels > 0)
+                fam.labels.push_back('}');
+
+            fam.ends.push_back(fam.labels.size());
+            fam.values.push_back(value);
+            fam.owners.push_back(owner);
+        }
+
+    private:
+        family &fam;
+        const cache::domain_info *owner;
+        int labels = 0;
+    };
+
+    class families;
+
+    inline void render(const families *const *sets, size_t count, std::string &out, layout *where = NULL);
+
+    /**
+     * @brief Collects samples per metric family, during the pass over the
+     * stats records, and renders each family contiguously with a single
+     * # HELP and # TYPE line. Families, and the capacity of their arrays,
+     * are kept between scrapes.
+     */
+    class families
+    {
+    public:
+        /**
+         * @brief Returns the family named by the parts, creating it on first use.
+         *
+         * @param type e.g counter or gauge
+         * @param help the help text, used if the family is created
+         * @param parts the name, joined by '_'
+         * @return family&
+         */
+        template <typename Part, typename... Parts>
+        family &get(std::string_view type, std::string_view help, const Part &part, const Parts &...parts)
+        {
+            scratch.assign(std::string_view(part));
+            ((scratch.push_back('_'), scratch.append(std::string_view(parts))), ...);
+
+            auto it = index.find(scratch);
+            if (it != index.end())
+                return all[it->second];
+
+            index.emplace(scratch, all.size());
+            family &fam = all.emplace_back();
+            fam.name = scratch;
+            fam.help = help;
+            fam.type = type;
+            return fam;
+        }
+
+        /**
+         * @brief Starts a sample of fam.
+         *
+         * @param fam the family
+         * @return sample
+         */
+        sample add(family &fam)
+        {
+            return sample(fam);
+        }
+
+        /**
+         * @brief Starts a sample of fam, of a domain, which is held until
+         * the samples are cleared.
+         *
+         * @param fam the family
+         * @param owner the domain
+         * @return sample
+         */
+        sample add(family &fam, const std::shared_ptr<const cache::domain_info> &owner)
+        {
+            if (held.empty() || held.back() != owner)
+                held.push_back(owner);
+            return sample(fam, owner.get());
+        }
+
+        /**
+         * @brief Drops the samples, but keeps the families and capacity.
+         */
+        void clear()
+        {
+            for (family &fam : all)
+                fam.clear();
+            held.clear();
+        }
+
+        /**
+         * @brief Number of samples.
+         *
+         * @return size_t
+         */
+        size_t samples() const
+        {
+            size_t n = 0;
+            for (const family &fam : all)
+                n += fam.size();
+            return n;
+        }
+
+        /**
+         * @brief Looks up a family by name.
+         *
+         * @param name the name
+         * @return const family* or NULL
+         */
+        const family *find(std::string_view name) const
+        {
+            auto it = index.find(name);
+            return it == index.end() ? NULL : &all[it->second];
+        }
+
+        /**
+         * @brief All families, in order of first appearance.
+         *
+         * @return const std::deque<family>&
+         */
+        const std::deque<family> &list() const
+        {
+            return all;
+        }
+
+        /**
+         * @brief Renders all families with samples, in order of first appearance.
+         *
+         * @param out the buffer to append to
+         * @param where where the families and samples went, if set
+         */
+        void render(std::string &out, layout *where = NULL) const
+        {
+            const families *self = this;
+            exposition::render(&self, 1, out, where);
+        }
+
+    private:
+        std::deque<family> all;
+        std::map<std::string, size_t, std::less<>> index;
+        std::string scratch;
+        // The domains of the samples, while they are rendered.
+        std::vector<std::shared_ptr<const cache::domain_info>> held;
+    };
+
+    /**
+     * @brief Appends the samples of a family, without its header.
+     *
+     * @param fam the family
+     * @param out the buffer to append to
+     * @param where where the samples of each domain went, if set, after the family's header
+     */
+    inline void render_samples(const family &fam, std::string &out, layout *where = NULL)
+    {
+        for (size_t i = 0; i < fam.size(); i++)
+        {
+            size_t start = out.size();
+            out.append(fam.name);
+            out.append(fam.label_set(i));
+            out.push_back(' ');
+            append_number(out, fam.values[i]);
+            out.push_back('\n');
+
+            if (where == NULL)
+                continue;
+            const cache::domain_info *owner = i < fam.owners.size() ? fam.owners[i] : NULL;
+            if (!where->runs.empty() && where->runs.back().header == where->headers.size() - 1 &&
+                where->runs.back().owner == owner && where->runs.back().end == start)
+                where->runs.back().end = out.size();
+            else
+                where->runs.push_back({where->headers.size() - 1, owner, start, out.size()});
+        }
+    }
+
+    /**
+     * @brief Renders several sets of families, e.g one per collection shard,
+     * straight from their arrays into out. A family in more than one set is
+     * written once: one header, then the samples of every set.
+     *
+     * @param sets the sets
+     * @param count number of sets
+     * @param out the buffer to append to
+     * @param where where the families and samples went, if set
+     */
+    inline void render(const families *const *sets, size_t count, std::string &out, layout *where)
+    {
+        writer w(out);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            for (const family &fam : sets[i]->list())
+            {
+                // Written along with an earlier set.
+                bool written = false;
+                for (size_t k = 0; k < i && !written; k++)
+                {
+                    const family *other = sets[k]->find(fam.name);
+                    written = other != NULL && other->size() > 0;
+                }
+
+                if (written || fam.size() == 0)
+                    continue;
+
+                size_t start = out.size();
+                w.help(fam.help, fam.name);
+                w.type(fam.type, fam.name);
+                if (where != NULL)
+                    where->headers.push_back({start, out.size()});
+                render_samples(fam, out, where);
+
+                for (size_t k = i + 1; k < count; k++)
+                {
+                    const family *other = sets[k]->find(fam.name);
+                    if (other != NULL)
+                        render_samples(*other, out, where);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief A label of a parsed sample. The name points into the parsed
+     * line, the value is unescaped.
+     */
+    struct label
+    {
+        std::string_view name;
+        std::string value;
+    };
+
+    /**
+     * @brief Parses a label set, e.g {domain="a",vcpu="0"}, from after
+     * its '{' to past its '}'. Label values are unescaped.
+     *
+     * @param text the text the label set is in
+     * @param pos where its labels start, then where the label set ends
+     * @param labels the labels, reused from label set to label set
+     * @param n the number of labels
+     * @return bool false, if the label set is malformed
+     */
+    inline bool parse_labels(std::string_view text, size_t &pos, std::vector<label> &labels, size_t &n)
+    {
+        while (pos < text.size() && text[pos] != '}')
+        {
+            if (text[pos] == ',' || text[pos] == ' ')
+            {
+                pos++;
+                continue;
+            }
+
+            size_t eq = text.find("=\"", pos);
+            if (eq == std::string_view::npos)
+                return false;
+
+            if (n == labels.size())
+                labels.emplace_back();
+            label &l = labels[n++];
+            l.name = text.substr(pos, eq - pos);
+            l.value.clear();
+
+            // Copied a run at a time, up to the closing quote or an escape.
+            pos = eq + 2;
+            while (true)
+            {
+                const char *quote = (const char *)memchr(text.data() + pos, '"', text.size() - pos);
+                if (quote == NULL)
+                    return false;
+                const char *escape = (const char *)memchr(text.data() + pos, '\\', quote - text.data() - pos);
+                size_t special = (escape != NULL ? escape : quote) - text.data();
+                if (special + 1 >= text.size())
+                    return false;
+
+                l.value.append(text.substr(pos, special - pos));
+                pos = special + 1;
+                if (text[special] == '"')
+                    break;
+
+                l.value.push_back(text[pos] == 'n' ? '\n' : text[pos]);
+                pos++;
+            }
+        }
+        pos++;
+        return true;
+    }
+
+    /**
+     * @brief Parses a sample line of the text format, e.g
+     * libvirt_vcpu_time{domain="a",vcpu="0"} 1.5e+09, as the encoders of
+     * other formats read it back. Label values are unescaped.
+     *
+     * @param line the line, without '\n'
+     * @param name the metric name
+     * @param labels the labels, reused from line to line
+     * @param n the number of labels
+     * @param value the value, as written
+     * @return bool false, for comments and malformed lines
+     */
+    inline bool parse_sample(std::string_view line, std::string_view &name, std::vector<label> &labels, size_t &n,
+                             std::string_view &value)
+    {
+        n = 0;
+        if (line.empty() || line[0] == '#')
+            return false;
+
+        size_t pos = 0;
+        while (pos < line.size() && line[pos] != '{' && line[pos] != ' ')
+            pos++;
+        if (pos == 0 || pos == line.size())
+            return false;
+        name = line.substr(0, pos);
+
+        if (line[pos] == '{' && !parse_labels(line, ++pos, labels, n))
+            return false;
+
+        while (pos < line.size() && line[pos] == ' ')
+            pos++;
+        value = line.substr(pos, line.find(' ', pos) - pos);
+        return !value.empty();
+    }
+
+    /**
+     * @brief Converts the value of a sample, as written, including +Inf, -Inf and NaN.
+     *
+     * @param text the value
+     * @param value the converted value
+     * @return bool false, if it is not a number
+     */
+    inline bool parse_value(std::string_view text, double &value)
+    {
+        if (!text.empty() && text[0] == '+')
+            text.remove_prefix(1);
+        return std::from_chars(text.data(), text.data() + text.size(), value).ec == std::errc();
+    }
+}
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef __FIELDS_HPP__
+#define __FIELDS_HPP__
+
+#include <charconv>
+#include <iterator>
+#include <string_view>
+#include <system_error>
+#include <libvirt/libvirt.h>
+
+namespace fields
+{
+    /**
+     * @brief The stat group, a field belongs to.
+     */
+    enum class group
+    {
+        vcpu,
+        net,
+        block,
+        balloon,
+        cpu,
+        count
+    };
+
+    /**
+     * @brief Fields that are not a sample, but a label of the samples
+     * that follow, e.g the name of an interface.
+     */
+    enum class slot
+    {
+        none,
+        netname
+    };
+
+    /**
+     * @brief A known typed parameter, e.g <group>.<index>.<name>, and the
+     * metric family it is a sample of.
+     */
+    struct spec
+    {
+        group g;
+        std::string_view name;
+        std::string_view family;
+        std::string_view type;
+        slot label;
+        // Help of the field, if the help of its group doesn't fit it.
+        std::string_view help = "";
+    };
+
+    inline constexpr std::string_view groups[] = {"vcpu", "net", "block", "balloon", "cpu"};
+
+    // Whether the fields of a group are per device, e.g vcpu.<index>.time, or per domain, e.g cpu.time.
+    inline constexpr bool indexed[] = {true, true, true, false, false};
+
+    inline constexpr std::string_view help[] = {
+        "vCPU statistics, from the libvirt vcpu.<num>.* stats fields.",
+        "Interface statistics, from the libvirt net.<num>.* stats fields.",
+        "Block device statistics, from the libvirt block.<num>.* stats fields.",
+        "Memory balloon statistics, in KiB, from the libvirt balloon.* stats fields.",
+        "Total CPU time of the domain, in nanoseconds, from the libvirt cpu.* stats fields.",
+    };
+
+    // Help of the fields of a group, summed per domain.
+    inline constexpr std::string_view totals_help[] = {
+        "vCPU statistics summed over the vCPUs of a domain, from the libvirt vcpu.<num>.* stats fields.",
+        "Interface statistics summed over the interfaces of a domain, from the libvirt net.<num>.* stats fields.",
+        "Block device statistics summed over the block devices of a domain, from the libvirt block.<num>.* stats fields.",
+        "",
+        "",
+    };
+
+    inline constexpr std::string_view fault_help = "Memory balloon page faults, from the libvirt balloon.major_fault and balloon.minor_fault stats fields.";
+
+    inline constexpr spec table[] = {
+        {group::vcpu, "state", "libvirt_vcpu_state", "gauge", slot::none},
+        {group::vcpu, "time", "libvirt_vcpu_time", "counter", slot::none},
+        {group::vcpu, "wait", "libvirt_vcpu_wait", "counter", slot::none},
+        {group::vcpu, "delay", "libvirt_vcpu_delay", "counter", slot::none},
+
+        {group::net, "name", "", "", slot::netname},
+        {group::net, "rx.bytes", "libvirt_net_bytes_rx", "counter", slot::none},
+        {group::net, "rx.pkts", "libvirt_net_pkts_rx", "counter", slot::none},
+        {group::net, "rx.errs", "libvirt_net_errs_rx", "counter", slot::none},
+        {group::net, "rx.drop", "libvirt_net_drop_rx", "counter", slot::none},
+        {group::net, "tx.bytes", "libvirt_net_bytes_tx", "counter", slot::none},
+        {group::net, "tx.pkts", "libvirt_net_pkts_tx", "counter", slot::none},
+        {group::net, "tx.errs", "libvirt_net_errs_tx", "counter", slot::none},
+        {group::net, "tx.drop", "libvirt_net_drop_tx", "counter", slot::none},
+
+        {group::block, "rd.reqs", "libvirt_block_reqs_rd", "counter", slot::none},
+        {group::block, "rd.bytes", "libvirt_block_bytes_rd", "counter", slot::none},
+        {group::block, "rd.times", "libvirt_block_times_rd", "counter", slot::none},
+        {group::block, "wr.reqs", "libvirt_block_reqs_wr", "counter", slot::none},
+        {group::block, "wr.bytes", "libvirt_block_bytes_wr", "counter", slot::none},
+        {group::block, "wr.times", "libvirt_block_times_wr", "counter", slot::none},
+        {group::block, "fl.reqs", "libvirt_block_reqs_fl", "counter", slot::none},
+        {group::block, "fl.times", "libvirt_block_times_fl", "counter", slot::none},
+
+        {group::balloon, "current", "libvirt_balloon_current", "gauge", slot::none},
+        {group::balloon, "maximum", "libvirt_balloon_maximum", "gauge", slot::none},
+        {group::balloon, "swap_in", "libvirt_balloon_swap_in", "counter", slot::none},
+        {group::balloon, "swap_out", "libvirt_balloon_swap_out", "counter", slot::none},
+        {group::balloon, "major_fault", "libvirt_balloon_major_fault", "counter", slot::none, fault_help},
+        {group::balloon, "minor_fault", "libvirt_balloon_minor_fault", "counter", slot::none, fault_help},
+        {group::balloon, "unused", "libvirt_balloon_unused", "gauge", slot::none},
+        {group::balloon, "available", "libvirt_balloon_available", "gauge", slot::none},
+        {group::balloon, "usable", "libvirt_balloon_usable", "gauge", slot::none},
+        {group::balloon, "disk_caches", "libvirt_balloon_disk_caches", "gauge", slot::none},
+        {group::balloon, "rss", "libvirt_balloon_rss", "gauge", slot::none},
+
+        {group::cpu, "time", "libvirt_cpu_time", "counter", slot::none},
+        {group::cpu, "user", "libvirt_cpu_user", "counter", slot::none},
+        {group::cpu, "system", "libvirt_cpu_system", "counter", slot::none},
+    };
+
+    constexpr size_t COUNT = std::size(table);
+
+    /**
+     * @brief A per-second rate of a counter field, derived by the exporter
+     * from two collections, e.g so that dashboards don't rate() every series.
+     */
+    struct derived
+    {
+        group g;
+        std::string_view name;
+        std::string_view family;
+        std::string_view help;
+        // Multiplies the rate, e.g nanoseconds into seconds.
+        double scale;
+    };
+
+    inline constexpr derived rates[] = {
+        {group::vcpu, "time", "libvirt_vcpu_utilization_ratio", "Share of the time the vCPU ran, from the rate of vcpu.<num>.time.", 1e-9},
+        {group::net, "rx.bytes", "libvirt_net_bytes_rx_per_second", "Bytes received per second, from the rate of net.<num>.rx.bytes.", 1},
+        {group::net, "tx.bytes", "libvirt_net_bytes_tx_per_second", "Bytes sent per second, from the rate of net.<num>.tx.bytes.", 1},
+        {group::block, "rd.reqs", "libvirt_block_reqs_rd_per_second", "Read requests per second, from the rate of block.<num>.rd.reqs.", 1},
+        {group::block, "wr.reqs", "libvirt_block_reqs_wr_per_second", "Write requests per second, from the rate of block.<num>.wr.reqs.", 1},
+        {group::block, "rd.bytes", "libvirt_block_bytes_rd_per_second", "Bytes read per second, from the rate of block.<num>.rd.bytes.", 1},
+        {group::block, "wr.bytes", "libvirt_block_bytes_wr_per_second", "Bytes written per second, from the rate of block.<num>.wr.bytes.", 1},
+    };
+
+    static_assert(std::size(groups) == (size_t)group::count && std::size(help) == (size_t)group::count &&
+                      std::size(totals_help) == (size_t)group::count &&
+                      std::size(indexed) == (size_t)group::count,
+                  "a name and help text per group");
+
+    /**
+     * @brief A typed parameter, matched against the table.
+     */
+    struct parsed
+    {
+        int id = -1;
+        unsigned long long index = 0;
+
+        const spec &operator*() const
+        {
+            return table[id];
+        }
+
+        const spec *operator->() const
+        {
+            return &table[id];
+        }
+    };
+
+    /**
+     * @brief Matches a field name, e.g net.0.rx.bytes or balloon.rss, against
+     * the table. The index is parsed in place, nothing is allocated.
+     *
+     * @param name the field name
+     * @return parsed id -1, if not a known field
+     */
+    inline parsed parse(std::string_view name)
+    {
+        parsed res;
+
+        size_t dot = name.find('.');
+        if (dot == std::string_view::npos)
+            return res;
+
+        std::string_view prefix = name.substr(0, dot);
+        int g = 0;
+        while (g < (int)group::count && groups[g] != prefix)
+            g++;
+        if (g == (int)group::count)
+            return res;
+
+        const char *last = name.data() + name.size();
+        const char *start = name.data() + dot + 1;
+        if (indexed[g])
+        {
+            std::from_chars_result num = std::from_chars(start, last, res.index);
+            if (num.ec != std::errc() || num.ptr == last || *num.ptr != '.')
+                return res;
+            start = num.ptr + 1;
+        }
+
+        std::string_view rest(start, last - start);
+        for (size_t i = 0; i < COUNT; i++)
+        {
+            if ((int)table[i].g == g && table[i].name == rest)
+            {
+                res.id = i;
+                break;
+            }
+        }
+
+        return res;
+    }
+
+    /**
+     * @brief The value of a typed parameter, read by its type.
+     *
+     * @param param the parameter
+     * @return double 0, for strings
+     */
+    inline double value(const virTypedParameter &param)
+    {
+        switch (param.type)
+        {
+        case VIR_TYPED_PARAM_INT:
+            return param.value.i;
+        case VIR_TYPED_PARAM_UINT:
+            return param.value.ui;
+        case VIR_TYPED_PARAM_LLONG:
+            return param.value.l;
+        case VIR_TYPED_PARAM_ULLONG:
+            return param.value.ul;
+        case VIR_TYPED_PARAM_DOUBLE:
+            return param.value.d;
+        case VIR_TYPED_PARAM_BOOLEAN:
+            return param.value.b ? 1 : 0;
+        default:
+            return 0;
+        }
+    }
+
+    /**
+     * @brief The rate derived from a field, if any.
+     *
+     * @param field the field
+     * @return const derived* NULL, if none
+     */
+    inline const derived *rate_of(const parsed &field)
+    {
+        for (const derived &d : rates)
+        {
+            if (d.g == field->g && d.name == field->name)
+                return &d;
+        }
+        return NULL;
+    }
+}
+
+#endif
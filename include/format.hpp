@@ -1,10 +1,16 @@
 #ifndef __FORMAT_HPP__
 #define __FORMAT_HPP__
 
+#include <charconv>
+#include <cstdio>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <system_error>
 #include <vector>
+#include <handles.hpp>
+#include <http.hpp>
 #include <libvirt/libvirt.h>
 
 namespace custom
@@ -24,21 +30,79 @@ namespace custom
         return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
     }
 
+    /**
+     * @brief The status line and headers of a response, for a body that is
+     * sent after them, e.g from buffers of its own.
+     *
+     * @param response the status
+     * @param length the length of the body
+     * @param version
+     * @param keep_alive
+     * @param type the Content-Type, of metrics see formats::encoders
+     * @param encoding the Content-Encoding, if any
+     * @return std::string
+     */
+    inline std::string generate_head(int response, size_t length, std::string_view version = "HTTP/1.1", bool keep_alive = false,
+                                     std::string_view type = "text/plain; charset=utf-8", std::string_view encoding = "")
+    {
+        char number[24];
+        std::string head;
+        head.reserve(160 + type.size());
+
+        head.append(version);
+        head.append(number, snprintf(number, sizeof(number), " %d ", response));
+        head.append(http::reason(response));
+        head.append("\r\nContent-Length: ");
+        head.append(number, snprintf(number, sizeof(number), "%zu", length));
+        head.append("\r\nContent-Type: ");
+        head.append(type);
+        if (!encoding.empty())
+        {
+            head.append("\r\nContent-Encoding: ");
+            head.append(encoding);
+        }
+        head.append("\r\nVary: Accept, Accept-Encoding\r\nConnection: ");
+        head.append(keep_alive ? "keep-alive" : "close");
+        head.append("\r\n\r\n");
+        return head;
+    }
+
     /**
      * @brief Helper to generate response
      *
      * @param reply
      * @param response
      * @param version
+     * @param keep_alive
+     * @param type the Content-Type, of metrics see formats::encoders
+     * @param encoding the Content-Encoding, if any
      * @return std::string
      */
 
-    inline std::string generate_prometheus(std::string reply, int response = 200, std::string version = "HTTP/1.0")
+    inline std::string generate_prometheus(std::string_view reply, int response = 200, std::string_view version = "HTTP/1.1",
+                                           bool keep_alive = false, std::string_view type = "text/plain; charset=utf-8",
+                                           std::string_view encoding = "")
+    {
+        std::string output = generate_head(response, reply.size(), version, keep_alive, type, encoding);
+
+        // The body may be binary, e.g gzip.
+        output.append(reply);
+        return output;
+    }
+
+    /**
+     * @brief Parses a whole string as a number, e.g an option value.
+     *
+     * @param text the string
+     * @param value the number
+     * @return bool false if it is not one, or out of range
+     */
+    template <typename T>
+    inline bool parse_number(std::string_view text, T &value)
     {
-        std::string type = "text/plain; version=0.0.4";
-        std::string status = "200 OK";
-        return custom::format("%s %s\r\nContent-Length: %d\r\nContent-Type: %s\r\n\r\n%s", version.c_str(),
-                              status.c_str(), reply.length(), type.c_str(), reply.c_str());
+        const char *end = text.data() + text.size();
+        auto [ptr, ec] = std::from_chars(text.data(), end, value);
+        return !text.empty() && ec == std::errc() && ptr == end;
     }
 
     inline std::vector<std::string> split(const std::string &s, std::string delimiter = ".")
@@ -60,19 +124,97 @@ namespace custom
         return res;
     }
 
-    inline int virDomainGetTenant(virDomainPtr domain, char *buf)
+    /**
+     * @brief Finds the first element with the given local name (any
+     * namespace prefix) and returns its content, between the start- and
+     * end-tag.
+     *
+     * @param xml the document
+     * @param name the local name of the element
+     * @return std::string_view empty, if not found
+     */
+    inline std::string_view xml_element(std::string_view xml, std::string_view name)
     {
-        // Get metadata,
-        const char *domain_meta_xml = virDomainGetMetadata(domain,
-                                                           virDomainMetadataType::VIR_DOMAIN_METADATA_ELEMENT,
-                                                           "http://portfolio.org/virtualization/instance",
-                                                           virDomainModificationImpact::VIR_DOMAIN_AFFECT_CURRENT);
-        if (domain_meta_xml != NULL) {
-            strncpy(buf, &domain_meta_xml[32], 36); // TODO: horrible.
-            return 1;
+        size_t pos = 0;
+
+        while ((pos = xml.find('<', pos)) != std::string_view::npos)
+        {
+            size_t tag_start = pos + 1;
+            size_t tag_end = xml.find_first_of(" \t\r\n/>", tag_start);
+            if (tag_end == std::string_view::npos)
+                break;
+
+            std::string_view tag = xml.substr(tag_start, tag_end - tag_start);
+            size_t colon = tag.find(':');
+            std::string_view local = colon == std::string_view::npos ? tag : tag.substr(colon + 1);
+
+            size_t close = xml.find('>', tag_end);
+            if (close == std::string_view::npos)
+                break;
+
+            if (local == name && xml[tag_start] != '/' && xml[tag_start] != '?' && xml[tag_start] != '!')
+            {
+                // <empty/>
+                if (xml[close - 1] == '/')
+                    return std::string_view();
+
+                std::string end_tag = "</" + std::string(tag) + ">";
+                size_t content_end = xml.find(end_tag, close + 1);
+                if (content_end == std::string_view::npos)
+                    return std::string_view();
+
+                return xml.substr(close + 1, content_end - close - 1);
+            }
+
+            pos = close + 1;
         }
 
-        return 0;
+        return std::string_view();
+    }
+
+    /**
+     * @brief Extracts the tenant uuid from the instance metadata
+     *
+     * <instance>
+     *   <tenant>
+     *     <uuid>43dc0cf8-809b-4adb-9bea-a9abb5f3d90e</uuid>
+     *   </tenant>
+     * </instance>
+     *
+     * @param xml the metadata element
+     * @return std::string empty, if there is no tenant
+     */
+    inline std::string parse_tenant(std::string_view xml)
+    {
+        std::string_view uuid = xml_element(xml_element(xml, "tenant"), "uuid");
+
+        size_t first = uuid.find_first_not_of(" \t\r\n");
+        if (first == std::string_view::npos)
+            return std::string();
+
+        size_t last = uuid.find_last_not_of(" \t\r\n");
+        return std::string(uuid.substr(first, last - first + 1));
+    }
+
+    /**
+     * @brief Fetches the tenant of a domain, from the
+     * http://portfolio.org/virtualization/instance metadata element.
+     * This is a libvirt RPC.
+     *
+     * @param domain the domain
+     * @return std::string empty, if there is no tenant
+     */
+    inline std::string virDomainGetTenant(virDomainPtr domain)
+    {
+        // Get metadata,
+        handles::c_string domain_meta_xml(virDomainGetMetadata(domain,
+                                                               virDomainMetadataType::VIR_DOMAIN_METADATA_ELEMENT,
+                                                               "http://portfolio.org/virtualization/instance",
+                                                               virDomainModificationImpact::VIR_DOMAIN_AFFECT_CURRENT));
+        if (domain_meta_xml == NULL)
+            return std::string();
+
+        return parse_tenant(domain_meta_xml.get());
     }
 
 }
@@ -0,0 +1,445 @@
+#ifndef __FORMATS_HPP__
+#define __FORMATS_HPP__
+
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <strings.h>
+#include <vector>
+#include <exposition.hpp>
+#include <http.hpp>
+#include <protobuf.hpp>
+
+namespace formats
+{
+    /**
+     * @brief The exposition formats a response can be encoded in. Bodies
+     * are rendered in the text format, and encoded from it.
+     */
+    enum class format
+    {
+        text,
+        openmetrics,
+        protobuf
+    };
+
+    /**
+     * @brief Encodes a body in the text format, appending to out. A body
+     * may be encoded in parts, e.g a snapshot and the per-request tail.
+     */
+    using encode_fn = void (*)(std::string_view text, std::string &out);
+
+    inline void text(std::string_view text, std::string &out)
+    {
+        out.append(text);
+    }
+
+    inline bool starts_with(std::string_view s, std::string_view prefix)
+    {
+        return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    inline bool ends_with(std::string_view s, std::string_view suffix)
+    {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    /**
+     * @brief Splits a # HELP or # TYPE line into the metric name, and the rest.
+     *
+     * @param line the line
+     * @param keyword HELP or TYPE
+     * @param name the metric name
+     * @param rest the help text, or the type
+     * @return bool false, for any other line
+     */
+    inline bool comment(std::string_view line, std::string_view keyword, std::string_view &name, std::string_view &rest)
+    {
+        if (!starts_with(line, "# ") || !starts_with(line.substr(2), keyword) || line.size() < 3 + keyword.size() ||
+            line[2 + keyword.size()] != ' ')
+            return false;
+
+        line.remove_prefix(3 + keyword.size());
+        size_t space = line.find(' ');
+        name = line.substr(0, space);
+        rest = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+        return true;
+    }
+
+    /**
+     * @brief OpenMetrics text 1.0.0: counter samples end in _total, and their
+     * family names do not, untyped is unknown, and only # HELP and # TYPE
+     * comments are kept. The # EOF is the trailer of the format.
+     */
+    inline void openmetrics(std::string_view text, std::string &out)
+    {
+        out.reserve(out.size() + text.size() + text.size() / 16);
+
+        // The family whose samples are renamed, with _total.
+        std::string_view counter;
+        std::string_view help_name, help;
+
+        auto write_help = [&out, &help](std::string_view family) -> void {
+            out.append("# HELP ");
+            out.append(family);
+            out.push_back(' ');
+            // The text format escapes \ and newlines in help, OpenMetrics quotes too.
+            for (char c : help)
+            {
+                if (c == '"')
+                    out.push_back('\\');
+                out.push_back(c);
+            }
+            out.push_back('\n');
+        };
+
+        while (!text.empty())
+        {
+            size_t eol = text.find('\n');
+            std::string_view line = text.substr(0, eol);
+            text = eol == std::string_view::npos ? std::string_view() : text.substr(eol + 1);
+
+            std::string_view name, rest;
+            if (comment(line, "HELP", name, rest))
+            {
+                // Written with the # TYPE that follows, which may rename the family.
+                help_name = name;
+                help = rest;
+                continue;
+            }
+
+            // A # HELP without a # TYPE.
+            if (!help_name.empty() && (!comment(line, "TYPE", name, rest) || name != help_name))
+            {
+                write_help(help_name);
+                help_name = std::string_view();
+            }
+
+            if (comment(line, "TYPE", name, rest))
+            {
+                counter = rest == "counter" && !ends_with(name, "_total") ? name : std::string_view();
+                std::string_view family = rest == "counter" && ends_with(name, "_total") ? name.substr(0, name.size() - 6) : name;
+
+                if (!help_name.empty())
+                    write_help(family);
+                help_name = std::string_view();
+
+                out.append("# TYPE ");
+                out.append(family);
+                out.push_back(' ');
+                out.append(rest == "untyped" ? std::string_view("unknown") : rest);
+                out.push_back('\n');
+                continue;
+            }
+
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            size_t end = line.find_first_of("{ ");
+            if (!counter.empty() && line.substr(0, end) == counter)
+            {
+                out.append(counter);
+                out.append("_total");
+                out.append(line.substr(end));
+            }
+            else
+                out.append(line);
+            out.push_back('\n');
+        }
+    }
+
+    /**
+     * @brief Appends a Metric: its labels, and the message with its value.
+     *
+     * @param out the buffer to append to
+     * @param labels the labels
+     * @param n the number of labels
+     * @param field the field of the value, Metric.gauge = 2, counter = 3, untyped = 5, histogram = 7
+     * @param value the message with the value
+     */
+    inline void append_metric(std::string &out, const std::vector<exposition::label> &labels, size_t n, int field,
+                              std::string_view value)
+    {
+        // MetricFamily.metric = 4, Metric.label = 1, LabelPair.name = 1, LabelPair.value = 2.
+        auto pair_size = [](const exposition::label &l) {
+            return protobuf::length_size(l.name.size()) + protobuf::length_size(l.value.size());
+        };
+
+        size_t size = protobuf::length_size(value.size());
+        for (size_t i = 0; i < n; i++)
+            size += protobuf::length_size(pair_size(labels[i]));
+
+        protobuf::append_length(out, 4, size);
+        for (size_t i = 0; i < n; i++)
+        {
+            protobuf::append_length(out, 1, pair_size(labels[i]));
+            protobuf::append_bytes(out, 1, labels[i].name);
+            protobuf::append_bytes(out, 2, labels[i].value);
+        }
+        protobuf::append_bytes(out, field, value);
+    }
+
+    /**
+     * @brief The delimited protobuf format of io.prometheus.client: a
+     * varint length, then a MetricFamily, for each family. The samples of a
+     * histogram, its _bucket, _sum and _count, become one Metric per label
+     * set, as they are written one label set after the other.
+     */
+    inline void delimited(std::string_view text, std::string &out)
+    {
+        // MetricFamily.type: COUNTER = 0, GAUGE = 1, UNTYPED = 3, HISTOGRAM = 4.
+        enum
+        {
+            COUNTER = 0,
+            GAUGE = 1,
+            UNTYPED = 3,
+            HISTOGRAM = 4
+        };
+        auto type_of = [](std::string_view type) -> int {
+            return type == "counter" ? COUNTER : type == "gauge" ? GAUGE : type == "histogram" ? HISTOGRAM : UNTYPED;
+        };
+
+        std::string family_name, help;
+        int type = UNTYPED;
+        std::string metrics;
+        std::string value;
+        std::vector<exposition::label> labels;
+
+        // The histogram being read: its labels, without le, and its buckets and count so far.
+        std::vector<exposition::label> histogram_labels;
+        size_t histogram_n = 0;
+        std::string buckets;
+        double sum = 0;
+        bool open = false;
+
+        // Histogram.sample_count = 1, sample_sum = 2, bucket = 3.
+        auto close_histogram = [&]() -> void {
+            if (!open)
+                return;
+            value.assign(buckets);
+            protobuf::append_double(value, 2, sum);
+            append_metric(metrics, histogram_labels, histogram_n, 7, value);
+            buckets.clear();
+            sum = 0;
+            open = false;
+        };
+
+        // MetricFamily.name = 1, help = 2, type = 3.
+        auto finish = [&]() -> void {
+            close_histogram();
+
+            // Prometheus takes no family without metrics.
+            if (!metrics.empty())
+            {
+                size_t size = protobuf::length_size(family_name.size()) + 2 + metrics.size();
+                if (!help.empty())
+                    size += protobuf::length_size(help.size());
+
+                protobuf::append_varint(out, size);
+                protobuf::append_bytes(out, 1, family_name);
+                if (!help.empty())
+                    protobuf::append_bytes(out, 2, help);
+                protobuf::append_tag(out, 3, protobuf::wire::varint);
+                protobuf::append_varint(out, type);
+                out.append(metrics);
+            }
+
+            family_name.clear();
+            help.clear();
+            metrics.clear();
+            type = UNTYPED;
+        };
+
+        while (!text.empty())
+        {
+            size_t eol = text.find('\n');
+            std::string_view line = text.substr(0, eol);
+            text = eol == std::string_view::npos ? std::string_view() : text.substr(eol + 1);
+
+            std::string_view name, rest;
+            if (comment(line, "HELP", name, rest) || comment(line, "TYPE", name, rest))
+            {
+                if (name != family_name)
+                {
+                    finish();
+                    family_name.assign(name);
+                }
+
+                if (line[2] == 'T')
+                    type = type_of(rest);
+                else
+                {
+                    // Unescaped, \\ and \n.
+                    for (size_t i = 0; i < rest.size(); i++)
+                    {
+                        if (rest[i] == '\\' && i + 1 < rest.size())
+                            help.push_back(rest[++i] == 'n' ? '\n' : rest[i]);
+                        else
+                            help.push_back(rest[i]);
+                    }
+                }
+                continue;
+            }
+
+            size_t n;
+            std::string_view value_text;
+            double v;
+            if (!exposition::parse_sample(line, name, labels, n, value_text) || !exposition::parse_value(value_text, v))
+                continue;
+
+            if (type == HISTOGRAM && name.size() > family_name.size() && starts_with(name, family_name))
+            {
+                std::string_view suffix = name.substr(family_name.size());
+
+                // The label set, without le, tells where the next histogram starts.
+                double le = 0;
+                size_t kept = 0;
+                for (size_t i = 0; i < n; i++)
+                {
+                    if (labels[i].name == "le")
+                        exposition::parse_value(labels[i].value, le);
+                    else if (kept++ != i)
+                        std::swap(labels[kept - 1], labels[i]);
+                }
+
+                bool same = open && kept == histogram_n;
+                for (size_t i = 0; same && i < kept; i++)
+                    same = labels[i].name == histogram_labels[i].name && labels[i].value == histogram_labels[i].value;
+                if (!same)
+                {
+                    close_histogram();
+                    histogram_labels.resize(std::max(histogram_labels.size(), kept));
+                    for (size_t i = 0; i < kept; i++)
+                        histogram_labels[i] = labels[i];
+                    histogram_n = kept;
+                    open = true;
+                }
+
+                // Bucket.cumulative_count = 1, upper_bound = 2. +Inf is the count.
+                if (suffix == "_bucket" && le != std::numeric_limits<double>::infinity())
+                {
+                    protobuf::append_length(buckets, 3, 1 + protobuf::varint_size((uint64_t)v) + 9);
+                    protobuf::append_tag(buckets, 1, protobuf::wire::varint);
+                    protobuf::append_varint(buckets, (uint64_t)v);
+                    protobuf::append_double(buckets, 2, le);
+                }
+                else if (suffix == "_sum")
+                    sum = v;
+                else if (suffix == "_count")
+                {
+                    protobuf::append_tag(buckets, 1, protobuf::wire::varint);
+                    protobuf::append_varint(buckets, (uint64_t)v);
+                }
+                continue;
+            }
+
+            // A sample without a header of its own.
+            if (name != family_name)
+            {
+                finish();
+                family_name.assign(name);
+            }
+
+            value.clear();
+            protobuf::append_double(value, 1, v);
+            append_metric(metrics, labels, n, type == COUNTER ? 3 : type == GAUGE ? 2 : 5, value);
+        }
+
+        finish();
+    }
+
+    /**
+     * @brief An encoder, and what a response in its format is sent as.
+     */
+    struct encoder
+    {
+        const char *name;
+        const char *content_type;
+        encode_fn encode;
+        // Appended once, after the last part of a body.
+        const char *trailer;
+    };
+
+    // Indexed by format.
+    inline const encoder encoders[] = {
+        {"text", "text/plain; version=0.0.4; charset=utf-8", text, ""},
+        {"openmetrics", "application/openmetrics-text; version=1.0.0; charset=utf-8", openmetrics, "# EOF\n"},
+        {"protobuf", "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited",
+         delimited, ""},
+    };
+
+    constexpr size_t FORMATS = sizeof(encoders) / sizeof(encoders[0]);
+
+    inline const encoder &get(format f)
+    {
+        return encoders[(int)f];
+    }
+
+    /**
+     * @brief Picks the format of a response, from the Accept header: the
+     * one with the highest q, the first listed of those. Without one that
+     * is supported, it is the text format.
+     *
+     * @param accept the header value, e.g as Prometheus sends it
+     * application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited;q=0.7,
+     * application/openmetrics-text;version=1.0.0;q=0.5,text/plain;version=0.0.4;q=0.3
+     * @return format
+     */
+    inline format negotiate(std::string_view accept)
+    {
+        format best = format::text;
+        double best_q = 0;
+
+        while (!accept.empty())
+        {
+            size_t comma = accept.find(',');
+            std::string_view item = accept.substr(0, comma);
+            accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+            size_t semicolon = item.find(';');
+            std::string_view type = http::trim(item.substr(0, semicolon));
+
+            double q = 1;
+            bool metric_family = false;
+            bool delimited = false;
+            while (semicolon != std::string_view::npos)
+            {
+                item.remove_prefix(semicolon + 1);
+                semicolon = item.find(';');
+                std::string_view param = http::trim(item.substr(0, semicolon));
+
+                if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                    exposition::parse_value(param.substr(2), q);
+                else if (param == "proto=io.prometheus.client.MetricFamily")
+                    metric_family = true;
+                else if (param == "encoding=delimited")
+                    delimited = true;
+            }
+
+            auto is = [&type](const char *name) {
+                return type.size() == strlen(name) && strncasecmp(type.data(), name, type.size()) == 0;
+            };
+
+            format f;
+            if (is("application/vnd.google.protobuf") && metric_family && delimited)
+                f = format::protobuf;
+            else if (is("application/openmetrics-text"))
+                f = format::openmetrics;
+            else if (is("text/plain") || is("text/*") || is("*/*"))
+                f = format::text;
+            else
+                continue;
+
+            if (q > best_q)
+            {
+                best = f;
+                best_q = q;
+            }
+        }
+
+        return best;
+    }
+}
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef __HANDLES_HPP__
+#define __HANDLES_HPP__
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <libvirt/libvirt.h>
+
+namespace handles
+{
+    /**
+     * @brief A string libvirt allocated, and the caller frees, e.g metadata.
+     */
+    struct free_deleter
+    {
+        void operator()(char *s) const
+        {
+            free(s);
+        }
+    };
+
+    using c_string = std::unique_ptr<char, free_deleter>;
+
+    /**
+     * @brief Owns a reference to a domain, released with virDomainFree.
+     */
+    class domain
+    {
+    public:
+        domain() = default;
+
+        explicit domain(virDomainPtr ptr) : ptr(ptr)
+        {
+        }
+
+        domain(domain &&other) noexcept : ptr(std::exchange(other.ptr, nullptr))
+        {
+        }
+
+        domain &operator=(domain &&other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                ptr = std::exchange(other.ptr, nullptr);
+            }
+            return *this;
+        }
+
+        domain(const domain &) = delete;
+        domain &operator=(const domain &) = delete;
+
+        ~domain()
+        {
+            reset();
+        }
+
+        virDomainPtr get() const
+        {
+            return ptr;
+        }
+
+        explicit operator bool() const
+        {
+            return ptr != nullptr;
+        }
+
+        void reset()
+        {
+            if (ptr != nullptr)
+                virDomainFree(ptr);
+            ptr = nullptr;
+        }
+
+    private:
+        virDomainPtr ptr = nullptr;
+    };
+
+    /**
+     * @brief Owns the records of a stats call, released with
+     * virDomainStatsRecordListFree.
+     *
+     * handles::stats_list stats;
+     * int rc = virDomainListGetStats(doms, types, stats.out(), flags);
+     */
+    class stats_list
+    {
+    public:
+        stats_list() = default;
+        stats_list(const stats_list &) = delete;
+        stats_list &operator=(const stats_list &) = delete;
+
+        ~stats_list()
+        {
+            reset();
+        }
+
+        virDomainStatsRecordPtr *get() const
+        {
+            return records;
+        }
+
+        /**
+         * @brief Where a stats call stores the records. Releases the current ones.
+         *
+         * @return virDomainStatsRecordPtr**
+         */
+        virDomainStatsRecordPtr **out()
+        {
+            reset();
+            return &records;
+        }
+
+        void reset()
+        {
+            if (records != NULL)
+                virDomainStatsRecordListFree(records);
+            records = NULL;
+        }
+
+    private:
+        virDomainStatsRecordPtr *records = NULL;
+    };
+
+    /**
+     * @brief The active domains of a connection, keyed by uuid. Handles are
+     * kept across scrapes: each refresh lists the active domains, one RPC,
+     * or syncs with a set that follows events, and only looks up domains it
+     * has not seen before.
+     */
+    class registry
+    {
+    public:
+        registry() = default;
+        registry(const registry &) = delete;
+        registry &operator=(const registry &) = delete;
+
+        /**
+         * @brief Brings the registry up to date with the connection. The
+         * listing returns the handles, so there is nothing to look up.
+         *
+         * @param conn the libvirt connection
+         * @param keep whether to keep a new domain, e.g if it is in our shard
+         * @return int number of RPCs made, -1 if listing failed
+         */
+        template <typename Keep>
+        int refresh(virConnectPtr conn, Keep keep)
+        {
+            virDomainPtr *doms = NULL;
+            int n = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_RUNNING);
+            if (n < 0)
+                return -1;
+
+            generation++;
+            for (int i = 0; i < n; i++)
+            {
+                domain dom(doms[i]);
+                char uuid[VIR_UUID_STRING_BUFLEN] = {0};
+                virDomainGetUUIDString(dom.get(), uuid);
+                adopt(uuid, std::move(dom), keep);
+            }
+            free(doms);
+
+            drop();
+            return 1;
+        }
+
+        /**
+         * @brief Brings the registry up to date with a set of active domain
+         * uuids, e.g a live::domain_set, instead of listing them. Nothing is
+         * done, while the set is unchanged, other than retrying the lookups
+         * that failed; then only new uuids are looked up.
+         *
+         * @param conn the libvirt connection
+         * @param set the set, with uuids(since, out)
+         * @param keep whether to keep a new domain, e.g if it is in our shard
+         * @return int number of RPCs made
+         */
+        template <typename Set, typename Keep>
+        int sync(virConnectPtr conn, const Set &set, Keep keep)
+        {
+            unsigned long long version = set.uuids(synced, uuids);
+            gone.clear();
+
+            int rpcs = 0;
+            if (version == synced)
+            {
+                if (pending.empty())
+                    return 0;
+
+                // A domain whose lookup failed would be missed, until the set changes.
+                std::vector<std::string> failed;
+                failed.swap(pending);
+                for (const std::string &uuid : failed)
+                    rpcs += look_up(conn, uuid, keep);
+                drop();
+                return rpcs;
+            }
+            synced = version;
+            pending.clear();
+            generation++;
+            for (const std::string &uuid : uuids)
+            {
+                auto k = by_uuid.find(uuid);
+                if (k != by_uuid.end())
+                {
+                    k->second.seen = generation;
+                    continue;
+                }
+
+                auto other = skipped.find(uuid);
+                if (other != skipped.end())
+                {
+                    other->second = generation;
+                    continue;
+                }
+
+                rpcs += look_up(conn, uuid, keep);
+            }
+
+            drop();
+            return rpcs;
+        }
+
+        /**
+         * @brief The kept domains, NULL terminated, as virDomainListGetStats takes them.
+         *
+         * @return virDomainPtr*
+         */
+        virDomainPtr *domains()
+        {
+            return list.data();
+        }
+
+        size_t size() const
+        {
+            return by_uuid.size();
+        }
+
+        /**
+         * @brief The uuids of the kept domains, the last refresh dropped.
+         *
+         * @return const std::vector<std::string>&
+         */
+        const std::vector<std::string> &dropped() const
+        {
+            return gone;
+        }
+
+        /**
+         * @brief Releases all handles, e.g before the connection is closed.
+         */
+        void clear()
+        {
+            by_uuid.clear();
+            skipped.clear();
+            pending.clear();
+            gone.clear();
+            synced = 0;
+            list.assign(1, NULL);
+        }
+
+    private:
+        struct kept
+        {
+            unsigned int id = 0;
+            domain dom;
+            unsigned long long seen = 0;
+        };
+
+        /**
+         * @brief Marks a listed domain as seen, and keeps its handle if it
+         * is new to us, and ours to keep.
+         */
+        template <typename Keep>
+        void adopt(const std::string &uuid, domain dom, Keep keep)
+        {
+            auto k = by_uuid.find(uuid);
+            if (k != by_uuid.end())
+            {
+                // A restarted domain has a new id, and the handle to match.
+                unsigned int id = virDomainGetID(dom.get());
+                if (id != k->second.id)
+                {
+                    k->second.id = id;
+                    k->second.dom = std::move(dom);
+                }
+                k->second.seen = generation;
+                return;
+            }
+
+            auto other = skipped.find(uuid);
+            if (other != skipped.end())
+            {
+                other->second = generation;
+                return;
+            }
+
+            if (!keep(dom.get()))
+            {
+                skipped[uuid] = generation;
+                return;
+            }
+
+            kept &added = by_uuid[uuid];
+            added.id = virDomainGetID(dom.get());
+            added.dom = std::move(dom);
+            added.seen = generation;
+        }
+
+        /**
+         * @brief Looks up a domain by uuid, and adopts it. If the lookup
+         * fails, it is retried on the next sync.
+         *
+         * @return int number of RPCs made
+         */
+        template <typename Keep>
+        int look_up(virConnectPtr conn, const std::string &uuid, Keep keep)
+        {
+            domain dom(virDomainLookupByUUIDString(conn, uuid.c_str()));
+            if (dom)
+                adopt(uuid, std::move(dom), keep);
+            else
+                pending.push_back(uuid);
+            return 1;
+        }
+
+        /**
+         * @brief Drops the domains, the last listing did not see, and
+         * rebuilds the list of handles.
+         */
+        void drop()
+        {
+            gone.clear();
+            for (auto it = by_uuid.begin(); it != by_uuid.end();)
+            {
+                if (it->second.seen != generation)
+                {
+                    gone.push_back(it->first);
+                    it = by_uuid.erase(it);
+                }
+                else
+                    ++it;
+            }
+            for (auto it = skipped.begin(); it != skipped.end();)
+            {
+                if (it->second != generation)
+                    it = skipped.erase(it);
+                else
+                    ++it;
+            }
+
+            list.clear();
+            for (const auto &entry : by_uuid)
+                list.push_back(entry.second.dom.get());
+            list.push_back(NULL);
+        }
+
+        std::unordered_map<std::string, kept> by_uuid;
+        std::unordered_map<std::string, unsigned long long> skipped;
+        std::vector<std::string> uuids;
+        std::vector<std::string> pending;
+        std::vector<std::string> gone;
+        std::vector<virDomainPtr> list = {NULL};
+        unsigned long long generation = 0;
+        unsigned long long synced = 0;
+    };
+}
+
+#endif
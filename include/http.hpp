@@ -0,0 +1,293 @@
+#ifndef __HTTP_HPP__
+#define __HTTP_HPP__
+
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <strings.h>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+// The most of a request that is buffered, head and body.
+#define MAX_REQUEST 65536
+
+namespace http
+{
+    /**
+     * @brief A parsed request. The views point into the connection's
+     * input buffer, and are only valid while the request is handled.
+     */
+    struct request
+    {
+        std::string_view method;
+        std::string_view target;
+        std::string_view path;
+        std::string_view query;
+        std::string_view version;
+        std::vector<std::pair<std::string_view, std::string_view>> headers;
+        bool keep_alive = false;
+        std::chrono::steady_clock::time_point received;
+
+        /**
+         * @brief Looks up a header, case-insensitive.
+         *
+         * @param name the header name
+         * @return std::string_view empty, if not present
+         */
+        std::string_view header(std::string_view name) const
+        {
+            for (const auto &h : headers)
+            {
+                if (h.first.size() == name.size() && strncasecmp(h.first.data(), name.data(), name.size()) == 0)
+                    return h.second;
+            }
+            return std::string_view();
+        }
+    };
+
+    /**
+     * @brief A buffer that is sent as is, and may be shared by any number
+     * of responses, e.g the body of a snapshot. It is kept alive until it
+     * is sent.
+     */
+    using buffer = std::shared_ptr<const std::string>;
+
+    /**
+     * @brief What a handler answers. The body is the shared buffers, in
+     * order, then what the response owns.
+     */
+    struct response
+    {
+        int status = 200;
+        std::string content_type = "text/plain; charset=utf-8";
+        std::string content_encoding;
+        std::vector<buffer> shared;
+        std::string body;
+
+        /**
+         * @brief The length of the body.
+         *
+         * @return size_t
+         */
+        size_t size() const
+        {
+            size_t size = body.size();
+            for (const buffer &b : shared)
+                size += b->size();
+            return size;
+        }
+
+        /**
+         * @brief Copies the body into one buffer, e.g for a benchmark.
+         *
+         * @param out the body
+         */
+        void assemble(std::string &out) const
+        {
+            out.clear();
+            out.reserve(size());
+            for (const buffer &b : shared)
+                out.append(*b);
+            out.append(body);
+        }
+    };
+
+    /**
+     * @brief Result of parsing the head of a request.
+     */
+    enum class parse_result
+    {
+        complete,
+        incomplete,
+        invalid
+    };
+
+    inline std::string_view trim(std::string_view s)
+    {
+        size_t first = s.find_first_not_of(" \t");
+        if (first == std::string_view::npos)
+            return std::string_view();
+        size_t last = s.find_last_not_of(" \t");
+        return s.substr(first, last - first + 1);
+    }
+
+    /**
+     * @brief Case-insensitive search of a token, in a comma-separated header value.
+     *
+     * @param value e.g "keep-alive, Upgrade"
+     * @param token e.g "keep-alive"
+     * @return true if present
+     */
+    inline bool has_token(std::string_view value, std::string_view token)
+    {
+        while (!value.empty())
+        {
+            size_t comma = value.find(',');
+            std::string_view item = trim(value.substr(0, comma));
+
+            // drop parameters, e.g gzip;q=1.0
+            size_t semicolon = item.find(';');
+            item = trim(item.substr(0, semicolon));
+
+            if (item.size() == token.size() && strncasecmp(item.data(), token.data(), token.size()) == 0)
+                return true;
+
+            if (comma == std::string_view::npos)
+                break;
+            value.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+
+    /**
+     * @brief Whether a list like Accept-Encoding accepts token, i.e lists it,
+     * or "*", without q=0.
+     *
+     * @param value e.g "gzip;q=1.0, identity; q=0.5, *;q=0"
+     * @param token e.g "gzip"
+     * @return true if accepted
+     */
+    inline bool accepts(std::string_view value, std::string_view token)
+    {
+        int wildcard = -1;
+
+        while (!value.empty())
+        {
+            size_t comma = value.find(',');
+            std::string_view item = trim(value.substr(0, comma));
+
+            size_t semicolon = item.find(';');
+            std::string_view name = trim(item.substr(0, semicolon));
+
+            bool zero = false;
+            if (semicolon != std::string_view::npos)
+            {
+                std::string_view param = trim(item.substr(semicolon + 1));
+                if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                    zero = param.substr(2).find_first_not_of("0.") == std::string_view::npos;
+            }
+
+            if (name.size() == token.size() && strncasecmp(name.data(), token.data(), token.size()) == 0)
+                return !zero;
+            if (name == "*")
+                wildcard = !zero;
+
+            if (comma == std::string_view::npos)
+                break;
+            value.remove_prefix(comma + 1);
+        }
+
+        return wildcard == 1;
+    }
+
+    /**
+     * @brief Parses the head of a request, from the start of buf.
+     *
+     * @param buf the received bytes
+     * @param req the request to fill in
+     * @param consumed the length of the request, if complete
+     * @return parse_result invalid also for a body past MAX_REQUEST, or a chunked one
+     */
+    inline parse_result parse(std::string_view buf, request &req, size_t &consumed)
+    {
+        size_t end = buf.find("\r\n\r\n");
+        if (end == std::string_view::npos)
+            return parse_result::incomplete;
+
+        std::string_view head = buf.substr(0, end);
+        consumed = end + 4;
+
+        // request-line, e.g GET /metrics HTTP/1.1
+        size_t eol = head.find("\r\n");
+        std::string_view line = head.substr(0, eol);
+
+        size_t sp1 = line.find(' ');
+        size_t sp2 = line.rfind(' ');
+        if (sp1 == std::string_view::npos || sp1 == sp2)
+            return parse_result::invalid;
+
+        req.method = line.substr(0, sp1);
+        req.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        req.version = line.substr(sp2 + 1);
+        if (req.target.empty() || req.version.substr(0, 5) != "HTTP/")
+            return parse_result::invalid;
+
+        size_t question = req.target.find('?');
+        req.path = req.target.substr(0, question);
+        req.query = question == std::string_view::npos ? std::string_view() : req.target.substr(question + 1);
+
+        // headers
+        req.headers.clear();
+        while (eol != std::string_view::npos)
+        {
+            size_t start = eol + 2;
+            eol = head.find("\r\n", start);
+            std::string_view header = head.substr(start, eol == std::string_view::npos ? std::string_view::npos : eol - start);
+
+            size_t colon = header.find(':');
+            if (colon == std::string_view::npos)
+                return parse_result::invalid;
+
+            req.headers.emplace_back(header.substr(0, colon), trim(header.substr(colon + 1)));
+        }
+
+        // We don't take bodies, but skip them to stay in sync. A chunked
+        // body can't be skipped without decoding it, and is refused.
+        if (!req.header("Transfer-Encoding").empty())
+            return parse_result::invalid;
+
+        std::string_view length = req.header("Content-Length");
+        if (!length.empty())
+        {
+            size_t body = 0;
+            std::from_chars_result res = std::from_chars(length.data(), length.data() + length.size(), body);
+            if (res.ec != std::errc() || res.ptr != length.data() + length.size() || body > MAX_REQUEST)
+                return parse_result::invalid;
+            if (buf.size() - consumed < body)
+                return parse_result::incomplete;
+            consumed += body;
+        }
+
+        std::string_view connection = req.header("Connection");
+        if (req.version == "HTTP/1.0")
+            req.keep_alive = has_token(connection, "keep-alive");
+        else
+            req.keep_alive = !has_token(connection, "close");
+
+        assert(consumed > 0);
+        return parse_result::complete;
+    }
+
+    /**
+     * @brief The reason phrase of a status code.
+     *
+     * @param status the status code
+     * @return const char*
+     */
+    inline const char *reason(int status)
+    {
+        switch (status)
+        {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Internal Server Error";
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef __INSTRUMENT_HPP__
+#define __INSTRUMENT_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <time.h>
+#include <exposition.hpp>
+
+namespace instrument
+{
+    /**
+     * @brief Nanoseconds on CLOCK_MONOTONIC. Not CLOCK_MONOTONIC_COARSE: it
+     * only advances once a tick (1-4ms), longer than most of the phases
+     * timed here, while CLOCK_MONOTONIC is read from the vDSO in a few ns.
+     *
+     * @return uint64_t
+     */
+    inline uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    /**
+     * @brief Number of stripes, that threads spread their updates over.
+     */
+    constexpr size_t STRIPES = 16;
+
+    /**
+     * @brief The stripe of the calling thread, assigned round-robin on first use.
+     *
+     * @return size_t
+     */
+    inline size_t stripe()
+    {
+        static std::atomic<size_t> next{0};
+        thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+        return mine;
+    }
+
+    /**
+     * @brief A counter, striped over cache lines so threads don't contend
+     * on updates. Reading sums the stripes.
+     */
+    class counter
+    {
+    public:
+        void add(uint64_t n)
+        {
+            cells[stripe()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t load() const
+        {
+            uint64_t sum = 0;
+            for (const cell &c : cells)
+                sum += c.value.load(std::memory_order_relaxed);
+            return sum;
+        }
+
+    private:
+        struct alignas(64) cell
+        {
+            std::atomic<uint64_t> value{0};
+        };
+
+        cell cells[STRIPES];
+    };
+
+    /**
+     * @brief Upper bounds of the histogram buckets, in ns: 1us to 16s in steps of 4.
+     */
+    inline constexpr uint64_t bounds[] = {
+        1000ULL, 4000ULL, 16000ULL, 64000ULL, 256000ULL, 1000000ULL, 4000000ULL,
+        16000000ULL, 64000000ULL, 256000000ULL, 1000000000ULL, 4000000000ULL, 16000000000ULL};
+
+    constexpr size_t BUCKETS = sizeof(bounds) / sizeof(bounds[0]);
+
+    /**
+     * @brief A latency histogram, striped like counter. Observing is two
+     * relaxed atomic adds, on the calling thread's own cache lines.
+     */
+    class histogram
+    {
+    public:
+        void observe(uint64_t ns)
+        {
+            size_t b = 0;
+            while (b < BUCKETS && ns > bounds[b])
+                b++;
+
+            cell &c = cells[stripe()];
+            c.buckets[b].fetch_add(1, std::memory_order_relaxed);
+            c.sum.fetch_add(ns, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Writes the _bucket, _sum and _count samples, with label.
+         *
+         * @param w the writer
+         * @param name the metric name
+         * @param key the label name
+         * @param value the label value
+         */
+        void render(exposition::writer &w, std::string_view name, std::string_view key, std::string_view value) const
+        {
+            uint64_t counts[BUCKETS + 1] = {0};
+            uint64_t sum = 0;
+            for (const cell &c : cells)
+            {
+                for (size_t b = 0; b <= BUCKETS; b++)
+                    counts[b] += c.buckets[b].load(std::memory_order_relaxed);
+                sum += c.sum.load(std::memory_order_relaxed);
+            }
+
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < BUCKETS; b++)
+            {
+                cumulative += counts[b];
+                w.metric(name, "bucket").label(key, value).label("le", bounds[b] / 1e9).value(cumulative);
+            }
+            cumulative += counts[BUCKETS];
+            w.metric(name, "bucket").label(key, value).label("le", std::string_view("+Inf")).value(cumulative);
+            w.metric(name, "sum").label(key, value).value(sum / 1e9);
+            w.metric(name, "count").label(key, value).value(cumulative);
+        }
+
+    private:
+        struct alignas(64) cell
+        {
+            std::atomic<uint64_t> buckets[BUCKETS + 1] = {};
+            std::atomic<uint64_t> sum{0};
+        };
+
+        cell cells[STRIPES];
+    };
+
+    /**
+     * @brief The timed phases of a scrape.
+     */
+    enum class phase
+    {
+        list,
+        stats,
+        serialize_vcpu,
+        serialize_net,
+        serialize_block,
+        serialize_balloon,
+        serialize_cpu,
+        render,
+        response,
+        send,
+        count
+    };
+
+    inline const char *name(phase p)
+    {
+        switch (p)
+        {
+        case phase::list:
+            return "list";
+        case phase::stats:
+            return "stats";
+        case phase::serialize_vcpu:
+            return "serialize_vcpu";
+        case phase::serialize_net:
+            return "serialize_net";
+        case phase::serialize_block:
+            return "serialize_block";
+        case phase::serialize_balloon:
+            return "serialize_balloon";
+        case phase::serialize_cpu:
+            return "serialize_cpu";
+        case phase::render:
+            return "render";
+        case phase::response:
+            return "response";
+        default:
+            return "send";
+        }
+    }
+
+    inline histogram phases[(size_t)phase::count];
+
+    inline counter rpcs;
+    inline counter sent_bytes;
+    inline counter samples;
+
+    /**
+     * @brief Records the time spent in a phase.
+     *
+     * @param p the phase
+     * @param ns the time, in ns
+     */
+    inline void observe(phase p, uint64_t ns)
+    {
+        phases[(size_t)p].observe(ns);
+    }
+
+    /**
+     * @brief Times a phase, from construction until stop, or the end of the scope.
+     */
+    class timer
+    {
+    public:
+        explicit timer(phase p) : p(p), start(now())
+        {
+        }
+
+        ~timer()
+        {
+            stop();
+        }
+
+        void stop()
+        {
+            if (running)
+                observe(p, now() - start);
+            running = false;
+        }
+
+    private:
+        phase p;
+        uint64_t start;
+        bool running = true;
+    };
+
+    /**
+     * @brief Heap allocations made by the calling thread. Counted by the
+     * program's operator new when built with COUNT_ALLOCATIONS (make
+     * ALLOCATIONS=1); stays 0 otherwise.
+     *
+     * @return unsigned long long&
+     */
+    inline unsigned long long &thread_allocations()
+    {
+        thread_local unsigned long long allocations = 0;
+        return allocations;
+    }
+
+    /**
+     * @brief Writes the phase histograms and the counters.
+     *
+     * @param w the writer
+     */
+    inline void render(exposition::writer &w)
+    {
+        w.help("Time spent in each phase of collecting and serving scrapes.", "libvirt", "exporter_phase_seconds");
+        w.type("histogram", "libvirt", "exporter_phase_seconds");
+        for (size_t p = 0; p < (size_t)phase::count; p++)
+            phases[p].render(w, "libvirt_exporter_phase_seconds", "phase", name((phase)p));
+
+        w.help("libvirt RPCs made by collections.", "libvirt", "exporter_rpcs_total");
+        w.type("counter", "libvirt", "exporter_rpcs_total");
+        w.metric("libvirt", "exporter_rpcs_total").value(rpcs.load());
+        w.help("Bytes of responses written to sockets.", "libvirt", "exporter_sent_bytes_total");
+        w.type("counter", "libvirt", "exporter_sent_bytes_total");
+        w.metric("libvirt", "exporter_sent_bytes_total").value(sent_bytes.load());
+        w.help("Samples emitted by collections.", "libvirt", "exporter_samples_total");
+        w.type("counter", "libvirt", "exporter_samples_total");
+        w.metric("libvirt", "exporter_samples_total").value(samples.load());
+    }
+}
+
+#endif
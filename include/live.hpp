@@ -0,0 +1,246 @@
+#ifndef __LIVE_HPP__
+#define __LIVE_HPP__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include <cache.hpp>
+#include <exposition.hpp>
+#include <libvirt/libvirt.h>
+
+namespace live
+{
+    /**
+     * @brief The uuids of the running domains, kept up to date from libvirt
+     * lifecycle events, so a scrape doesn't have to list the domains. A
+     * periodic resync lists them anyway, as a safety net against missed
+     * events, and counts what the events got wrong as drift.
+     */
+    class domain_set
+    {
+    public:
+        domain_set() = default;
+        domain_set(const domain_set &) = delete;
+        domain_set &operator=(const domain_set &) = delete;
+
+        ~domain_set()
+        {
+            deregister_events();
+        }
+
+        /**
+         * @brief Registers a lifecycle callback on conn, and fills the set.
+         * Requires a running libvirt event loop.
+         *
+         * @param conn the libvirt connection
+         * @return int -1 on failure, the set is not tracked then
+         */
+        int register_events(virConnectPtr conn)
+        {
+            deregister_events();
+
+            lifecycle_id = virConnectDomainEventRegisterAny(conn, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                                            VIR_DOMAIN_EVENT_CALLBACK(on_lifecycle), this, NULL);
+            if (lifecycle_id < 0)
+                return -1;
+            events_conn = conn;
+
+            // Events from here on are applied, so the listing misses nothing.
+            if (resync(conn) < 0)
+            {
+                deregister_events();
+                return -1;
+            }
+
+            // What the first listing found is not drift.
+            drift.store(0, std::memory_order_relaxed);
+            tracked.store(true, std::memory_order_release);
+            return 0;
+        }
+
+        /**
+         * @brief Lists the running domains, and brings the set in line with
+         * them. Domains an event touched while listing are left as the event
+         * had them.
+         *
+         * @param conn the libvirt connection
+         * @return int domains added or removed, -1 if listing failed
+         */
+        int resync(virConnectPtr conn)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                touched.clear();
+                resyncing = true;
+            }
+
+            virDomainPtr *doms = NULL;
+            int n = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_RUNNING);
+
+            std::unordered_set<std::string, cache::key_hash, std::equal_to<>> listed;
+            for (int i = 0; i < n; i++)
+            {
+                char uuid[VIR_UUID_STRING_BUFLEN] = {0};
+                virDomainGetUUIDString(doms[i], uuid);
+                listed.insert(uuid);
+                virDomainFree(doms[i]);
+            }
+            free(doms);
+
+            std::lock_guard<std::mutex> guard(lock);
+            resyncing = false;
+            if (n < 0)
+                return -1;
+
+            int changed = 0;
+            for (const std::string &uuid : listed)
+            {
+                if (!touched.count(uuid) && active.insert(uuid).second)
+                    changed++;
+            }
+            for (auto it = active.begin(); it != active.end();)
+            {
+                if (!touched.count(*it) && !listed.count(*it))
+                {
+                    it = active.erase(it);
+                    changed++;
+                }
+                else
+                    ++it;
+            }
+
+            touched.clear();
+            if (changed > 0)
+                version++;
+            resyncs++;
+            drift.fetch_add(changed, std::memory_order_relaxed);
+            return changed;
+        }
+
+        /**
+         * @brief Whether the set follows the events, e.g whether it can be
+         * used instead of listing the domains.
+         *
+         * @return bool
+         */
+        bool tracking() const
+        {
+            return tracked.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief The uuids of the running domains, if the set changed since.
+         *
+         * @param since the version of the last copy
+         * @param out the uuids
+         * @return unsigned long long the version, since if unchanged, out is left alone then
+         */
+        unsigned long long uuids(unsigned long long since, std::vector<std::string> &out) const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (version == since)
+                return since;
+
+            out.assign(active.begin(), active.end());
+            return version;
+        }
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return active.size();
+        }
+
+        /**
+         * @brief Adds the metrics of the set.
+         *
+         * @param f the families to add to, shared by the sets of every target
+         * @param hypervisor the hypervisor label, empty for none
+         */
+        void render(exposition::families &f, std::string_view hypervisor = "") const
+        {
+            f.add(f.get("gauge", "Active domains, as followed from lifecycle events.", "libvirt", "exporter_domain_set_domains"))
+                .optional_label("hypervisor", hypervisor)
+                .value((unsigned long long)size());
+            f.add(f.get("counter", "Lifecycle events applied to the domain set.", "libvirt", "exporter_domain_set_events_total"))
+                .optional_label("hypervisor", hypervisor)
+                .value(events.load(std::memory_order_relaxed));
+            f.add(f.get("counter", "Full listings of the running domains, to resync the domain set.", "libvirt",
+                        "exporter_domain_set_resyncs_total"))
+                .optional_label("hypervisor", hypervisor)
+                .value(resyncs.load(std::memory_order_relaxed));
+            f.add(f.get("counter", "Domains a resync added to, or removed from the domain set, i.e events that were missed.",
+                        "libvirt", "exporter_domain_set_drift_total"))
+                .optional_label("hypervisor", hypervisor)
+                .value(drift.load(std::memory_order_relaxed));
+        }
+
+        /**
+         * @brief Stops following the events, e.g before the connection is closed.
+         */
+        void deregister_events()
+        {
+            tracked.store(false, std::memory_order_release);
+            if (events_conn != NULL && lifecycle_id >= 0)
+                virConnectDomainEventDeregisterAny(events_conn, lifecycle_id);
+
+            events_conn = NULL;
+            lifecycle_id = -1;
+        }
+
+    private:
+        static int on_lifecycle(virConnectPtr, virDomainPtr dom, int event, int, void *opaque)
+        {
+            char uuid[VIR_UUID_STRING_BUFLEN] = {0};
+            virDomainGetUUIDString(dom, uuid);
+
+            switch (event)
+            {
+            case VIR_DOMAIN_EVENT_STARTED:
+            case VIR_DOMAIN_EVENT_RESUMED:
+                static_cast<domain_set *>(opaque)->apply(uuid, true);
+                break;
+            case VIR_DOMAIN_EVENT_SUSPENDED:
+            case VIR_DOMAIN_EVENT_PMSUSPENDED:
+            case VIR_DOMAIN_EVENT_CRASHED:
+            case VIR_DOMAIN_EVENT_STOPPED:
+            case VIR_DOMAIN_EVENT_UNDEFINED:
+                static_cast<domain_set *>(opaque)->apply(uuid, false);
+                break;
+            default:
+                break;
+            }
+            return 0;
+        }
+
+        void apply(std::string_view uuid, bool up)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            bool changed = up ? active.emplace(uuid).second : active.erase(std::string(uuid)) > 0;
+            if (changed)
+                version++;
+            if (resyncing)
+                touched.emplace(uuid);
+            events.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        mutable std::mutex lock;
+        std::unordered_set<std::string, cache::key_hash, std::equal_to<>> active;
+        std::unordered_set<std::string, cache::key_hash, std::equal_to<>> touched;
+        bool resyncing = false;
+        unsigned long long version = 1;
+
+        std::atomic<bool> tracked{false};
+        std::atomic<unsigned long long> events{0};
+        std::atomic<unsigned long long> resyncs{0};
+        std::atomic<unsigned long long> drift{0};
+
+        virConnectPtr events_conn = NULL;
+        int lifecycle_id = -1;
+    };
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef __POOL_HPP__
+#define __POOL_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pool
+{
+    /**
+     * @brief A fixed number of threads, running submitted tasks in order.
+     */
+    class thread_pool
+    {
+    public:
+        explicit thread_pool(size_t threads)
+        {
+            for (size_t i = 0; i < threads; i++)
+                workers.emplace_back([this]() { run(); });
+        }
+
+        thread_pool(const thread_pool &) = delete;
+        thread_pool &operator=(const thread_pool &) = delete;
+
+        ~thread_pool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wakeup.notify_all();
+
+            for (std::thread &worker : workers)
+                worker.join();
+        }
+
+        /**
+         * @brief Queues a task.
+         *
+         * @param task the task
+         * @return std::future<void> ready, when the task has run
+         */
+        std::future<void> submit(std::function<void()> task)
+        {
+            std::packaged_task<void()> packaged(std::move(task));
+            std::future<void> done = packaged.get_future();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                tasks.push_back(std::move(packaged));
+            }
+            wakeup.notify_one();
+            return done;
+        }
+
+        size_t size() const
+        {
+            return workers.size();
+        }
+
+    private:
+        void run()
+        {
+            while (true)
+            {
+                std::packaged_task<void()> task;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wakeup.wait(guard, [this]() { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::deque<std::packaged_task<void()>> tasks;
+        std::mutex lock;
+        std::condition_variable wakeup;
+        bool stopping = false;
+    };
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef __PROTOBUF_HPP__
+#define __PROTOBUF_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace protobuf
+{
+    /**
+     * @brief How a field is encoded on the wire.
+     */
+    enum class wire
+    {
+        varint = 0,
+        fixed64 = 1,
+        length = 2,
+        fixed32 = 5
+    };
+
+    /**
+     * @brief The bytes a varint takes.
+     *
+     * @param n the value
+     * @return size_t
+     */
+    inline size_t varint_size(uint64_t n)
+    {
+        size_t size = 1;
+        while (n >= 0x80)
+        {
+            n >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    inline void append_varint(std::string &out, uint64_t n)
+    {
+        // One append, rather than a push_back per byte.
+        char buf[10];
+        size_t size = 0;
+        while (n >= 0x80)
+        {
+            buf[size++] = (char)(n | 0x80);
+            n >>= 7;
+        }
+        buf[size++] = (char)n;
+        out.append(buf, size);
+    }
+
+    inline void append_tag(std::string &out, int field, wire type)
+    {
+        append_varint(out, ((uint64_t)field << 3) | (uint64_t)type);
+    }
+
+    /**
+     * @brief The bytes a length-delimited field takes, with its tag, for a
+     * field number below 16.
+     *
+     * @param length the length of its content
+     * @return size_t
+     */
+    inline size_t length_size(size_t length)
+    {
+        return 1 + varint_size(length) + length;
+    }
+
+    /**
+     * @brief Starts a length-delimited field, e.g an embedded message, whose
+     * content is appended next.
+     *
+     * @param out the buffer to append to
+     * @param field the field number
+     * @param length the length of its content
+     */
+    inline void append_length(std::string &out, int field, size_t length)
+    {
+        append_tag(out, field, wire::length);
+        append_varint(out, length);
+    }
+
+    inline void append_bytes(std::string &out, int field, std::string_view value)
+    {
+        append_length(out, field, value.size());
+        out.append(value);
+    }
+
+    inline void append_double(std::string &out, int field, double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+
+        append_tag(out, field, wire::fixed64);
+        char buf[8];
+        for (int b = 0; b < 8; b++)
+            buf[b] = (char)(bits >> (8 * b));
+        out.append(buf, sizeof(buf));
+    }
+
+    inline void append_int64(std::string &out, int field, int64_t value)
+    {
+        append_tag(out, field, wire::varint);
+        append_varint(out, (uint64_t)value);
+    }
+
+    /**
+     * @brief Reads the fields of a message, one at a time. Malformed input
+     * stops the reader, and is told by ok().
+     */
+    class reader
+    {
+    public:
+        reader(std::string_view data) : data(data)
+        {
+        }
+
+        /**
+         * @brief Moves to the next field, whose value is read next.
+         *
+         * @param field the field number
+         * @param type its wire type
+         * @return bool false at the end, or on malformed input
+         */
+        bool next(int &field, wire &type)
+        {
+            if (failed || pos >= data.size())
+                return false;
+
+            uint64_t key = varint();
+            field = (int)(key >> 3);
+            type = (wire)(key & 7);
+            return !failed && field > 0;
+        }
+
+        uint64_t varint()
+        {
+            uint64_t n = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                if (pos >= data.size())
+                    break;
+                uint8_t b = data[pos++];
+                n |= (uint64_t)(b & 0x7f) << shift;
+                if (b < 0x80)
+                    return n;
+            }
+            failed = true;
+            return 0;
+        }
+
+        std::string_view bytes()
+        {
+            uint64_t length = varint();
+            if (failed || length > data.size() - pos)
+            {
+                failed = true;
+                return std::string_view();
+            }
+            std::string_view value = data.substr(pos, length);
+            pos += length;
+            return value;
+        }
+
+        double fixed64()
+        {
+            if (data.size() - pos < 8)
+            {
+                failed = true;
+                return 0;
+            }
+
+            uint64_t bits = 0;
+            for (int b = 0; b < 8; b++)
+                bits |= (uint64_t)(uint8_t)data[pos++] << (8 * b);
+
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        /**
+         * @brief Skips the value of a field, that is not read.
+         *
+         * @param type its wire type
+         */
+        void skip(wire type)
+        {
+            switch (type)
+            {
+            case wire::varint:
+                varint();
+                break;
+            case wire::fixed64:
+                fixed64();
+                break;
+            case wire::length:
+                bytes();
+                break;
+            case wire::fixed32:
+                if (data.size() - pos < 4)
+                    failed = true;
+                else
+                    pos += 4;
+                break;
+            default:
+                failed = true;
+            }
+        }
+
+        bool ok() const
+        {
+            return !failed;
+        }
+
+    private:
+        std::string_view data;
+        size_t pos = 0;
+        bool failed = false;
+    };
+}
+
+#endif
@@ -0,0 +1,617 @@
+#ifndef __REMOTE_HPP__
+#define __REMOTE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <compression.hpp>
+#include <exposition.hpp>
+#include <http.hpp>
+#include <protobuf.hpp>
+#include <snapshot.hpp>
+
+// The largest chunk of a response that is read.
+#define MAX_CHUNK 1048576
+
+namespace remote
+{
+    /**
+     * @brief Where, and how, collections are pushed with the Prometheus
+     * remote write protocol.
+     */
+    struct options
+    {
+        // http://host[:port]/path of the receiver.
+        std::string url;
+        // Samples per request.
+        size_t batch = 2000;
+        // Requests held, while the receiver is slow or down. Past it, the oldest are shed.
+        size_t queue = 256;
+        // The wait before the first retry of a request, doubling up to max_backoff.
+        std::chrono::milliseconds backoff{100};
+        std::chrono::milliseconds max_backoff{30000};
+        // How long a request may take.
+        std::chrono::seconds timeout{10};
+    };
+
+    /**
+     * @brief A compressed WriteRequest, and the samples in it.
+     */
+    struct batch
+    {
+        std::string body;
+        size_t samples = 0;
+    };
+
+    /**
+     * @brief The labels of a sample of a family, with __name__, sorted by
+     * name as remote write requires.
+     *
+     * @param fam the family
+     * @param i the sample
+     * @param labels the labels, reused from sample to sample
+     * @param n the number of labels
+     * @return bool false, if the label set is malformed
+     */
+    inline bool labels_of(const exposition::family &fam, size_t i, std::vector<exposition::label> &labels, size_t &n)
+    {
+        std::string_view set = fam.label_set(i);
+        size_t pos = 1;
+        n = 0;
+        if (!set.empty() && !exposition::parse_labels(set, pos, labels, n))
+            return false;
+
+        if (n == labels.size())
+            labels.emplace_back();
+        exposition::label &l = labels[n++];
+        l.name = "__name__";
+        l.value.assign(fam.name);
+
+        std::sort(labels.begin(), labels.begin() + n,
+                  [](const exposition::label &a, const exposition::label &b) { return a.name < b.name; });
+        return true;
+    }
+
+    /**
+     * @brief Encodes the samples of sets of families as WriteRequests, a
+     * TimeSeries per sample, snappy-compressed in batches. The values are
+     * taken as they are, only the label sets are parsed.
+     *
+     * @param sets the sets, e.g the ones a snapshot was rendered from
+     * @param count number of sets
+     * @param timestamp the timestamp of the samples, in ms since the epoch
+     * @param per_batch samples per batch
+     * @param out the batches to append to
+     * @return size_t the samples
+     */
+    inline size_t encode(const exposition::families *const *sets, size_t count, int64_t timestamp, size_t per_batch,
+                         std::vector<batch> &out)
+    {
+        std::vector<exposition::label> labels;
+        std::string request;
+        size_t samples = 0;
+        size_t current = 0;
+
+        auto finish = [&out, &request, &current]() -> void {
+            batch &b = out.emplace_back();
+            compression::snappy_compress(request, b.body);
+            b.samples = current;
+            request.clear();
+            current = 0;
+        };
+
+        // Sample.value = 1, a double, and Sample.timestamp = 2, a varint.
+        size_t sample_size = 1 + 8 + 1 + protobuf::varint_size((uint64_t)timestamp);
+        for (size_t k = 0; k < count; k++)
+        {
+            for (const exposition::family &fam : sets[k]->list())
+            {
+                for (size_t i = 0; i < fam.size(); i++)
+                {
+                    size_t n;
+                    if (!labels_of(fam, i, labels, n))
+                        continue;
+
+                    // WriteRequest.timeseries = 1, TimeSeries.labels = 1, TimeSeries.samples = 2.
+                    size_t series_size = protobuf::length_size(sample_size);
+                    for (size_t j = 0; j < n; j++)
+                        series_size += protobuf::length_size(protobuf::length_size(labels[j].name.size()) +
+                                                             protobuf::length_size(labels[j].value.size()));
+
+                    protobuf::append_length(request, 1, series_size);
+                    for (size_t j = 0; j < n; j++)
+                    {
+                        protobuf::append_length(request, 1, protobuf::length_size(labels[j].name.size()) +
+                                                                protobuf::length_size(labels[j].value.size()));
+                        protobuf::append_bytes(request, 1, labels[j].name);
+                        protobuf::append_bytes(request, 2, labels[j].value);
+                    }
+                    protobuf::append_length(request, 2, sample_size);
+                    protobuf::append_double(request, 1, fam.values[i]);
+                    protobuf::append_int64(request, 2, timestamp);
+
+                    samples++;
+                    if (++current == per_batch)
+                        finish();
+                }
+            }
+        }
+
+        if (current > 0)
+            finish();
+        return samples;
+    }
+
+    /**
+     * @brief A keep-alive HTTP/1.1 client, that POSTs WriteRequests to a
+     * receiver. Plain http only.
+     */
+    class client
+    {
+    public:
+        /**
+         * @param url http://host[:port]/path
+         * @param timeout how long a request may take
+         * @throws std::invalid_argument for a url, that is not http://
+         */
+        client(const std::string &url, std::chrono::seconds timeout) : timeout(timeout)
+        {
+            if (url.compare(0, 7, "http://") != 0)
+                throw std::invalid_argument("not an http:// url: " + url);
+
+            size_t slash = url.find('/', 7);
+            std::string authority = url.substr(7, slash - 7);
+            path = slash == std::string::npos ? "/" : url.substr(slash);
+
+            size_t colon = authority.rfind(':');
+            if (colon != std::string::npos && authority.find(']', colon) == std::string::npos)
+            {
+                host = authority.substr(0, colon);
+                port = authority.substr(colon + 1);
+            }
+            else
+            {
+                host = authority;
+                port = "80";
+            }
+            if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+                host = host.substr(1, host.size() - 2);
+            if (host.empty())
+                throw std::invalid_argument("no host in url: " + url);
+
+            header = "POST " + path + " HTTP/1.1\r\nHost: " + authority +
+                     "\r\nUser-Agent: libvirt-prometheus-exporter\r\nContent-Encoding: snappy\r\n"
+                     "Content-Type: application/x-protobuf\r\nX-Prometheus-Remote-Write-Version: 0.1.0\r\n"
+                     "Content-Length: ";
+        }
+
+        client(const client &) = delete;
+        client &operator=(const client &) = delete;
+
+        ~client()
+        {
+            disconnect();
+        }
+
+        /**
+         * @brief POSTs a compressed WriteRequest, over the open connection,
+         * or a new one.
+         *
+         * @param body the body
+         * @return int the status, -1 if the receiver could not be reached
+         */
+        int post(const std::string &body)
+        {
+            if (fd < 0 && !connect())
+                return -1;
+
+            std::string request = header;
+            request.append(std::to_string(body.size()));
+            request.append("\r\n\r\n");
+
+            int status;
+            if (!send_all(request) || !send_all(body) || (status = receive()) < 0)
+            {
+                disconnect();
+                return -1;
+            }
+            return status;
+        }
+
+    private:
+        bool connect()
+        {
+            struct addrinfo hints = {};
+            struct addrinfo *addrs;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+
+            int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+            if (rc != 0)
+            {
+                fprintf(stderr, "remote write: %s: %s\n", host.c_str(), gai_strerror(rc));
+                return false;
+            }
+
+            struct timeval tv = {(time_t)timeout.count(), 0};
+            for (struct addrinfo *a = addrs; a != NULL && fd < 0; a = a->ai_next)
+            {
+                fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (fd < 0)
+                    continue;
+
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                // The head and the body go out in two sends, don't hold the body back.
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                if (::connect(fd, a->ai_addr, a->ai_addrlen) < 0)
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(addrs);
+
+            if (fd < 0)
+                fprintf(stderr, "remote write: failed to connect to %s:%s\n", host.c_str(), port.c_str());
+            return fd >= 0;
+        }
+
+        void disconnect()
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            in.clear();
+        }
+
+        bool send_all(std::string_view data)
+        {
+            while (!data.empty())
+            {
+                ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                data.remove_prefix(n);
+            }
+            return true;
+        }
+
+        bool fill()
+        {
+            char buffer[4096];
+            while (true)
+            {
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                in.append(buffer, n);
+                return true;
+            }
+        }
+
+        /**
+         * @brief Reads a response, and skips its body.
+         *
+         * @return int the status, -1 on error
+         */
+        int receive()
+        {
+            size_t end;
+            while ((end = in.find("\r\n\r\n")) == std::string::npos)
+            {
+                if (!fill())
+                    return -1;
+            }
+
+            std::string_view head(in.data(), end);
+            int status = -1;
+            if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0 ||
+                std::from_chars(head.data() + 9, head.data() + 12, status).ec != std::errc())
+                return -1;
+
+            long long length = -1;
+            bool chunked = false;
+            bool closing = false;
+            for (size_t pos = head.find("\r\n"); pos != std::string_view::npos;)
+            {
+                size_t eol = head.find("\r\n", pos + 2);
+                std::string_view line = head.substr(pos + 2, eol == std::string_view::npos ? std::string_view::npos : eol - pos - 2);
+                pos = eol;
+
+                size_t colon = line.find(':');
+                if (colon == std::string_view::npos)
+                    continue;
+                std::string_view name = line.substr(0, colon);
+                std::string_view value = http::trim(line.substr(colon + 1));
+
+                if (name.size() == 14 && strncasecmp(name.data(), "Content-Length", 14) == 0)
+                    std::from_chars(value.data(), value.data() + value.size(), length);
+                else if (name.size() == 17 && strncasecmp(name.data(), "Transfer-Encoding", 17) == 0)
+                    chunked = http::has_token(value, "chunked");
+                else if (name.size() == 10 && strncasecmp(name.data(), "Connection", 10) == 0)
+                    closing = http::has_token(value, "close");
+            }
+            in.erase(0, end + 4);
+
+            // No body, whatever the headers say.
+            if (status < 200 || status == 204 || status == 304)
+            {
+                chunked = false;
+                length = 0;
+            }
+
+            if (chunked)
+            {
+                // Chunk by chunk, up to the last one and its trailers.
+                while (true)
+                {
+                    size_t eol;
+                    while ((eol = in.find("\r\n")) == std::string::npos)
+                    {
+                        if (!fill())
+                            return -1;
+                    }
+
+                    // Receivers answer with little, if anything: a large chunk is garbage.
+                    size_t size = 0;
+                    std::from_chars_result res = std::from_chars(in.data(), in.data() + eol, size, 16);
+                    if (res.ptr == in.data() || size > MAX_CHUNK)
+                        return -1;
+
+                    if (size == 0)
+                    {
+                        while ((end = in.find("\r\n\r\n", eol)) == std::string::npos)
+                        {
+                            if (!fill())
+                                return -1;
+                        }
+                        in.erase(0, end + 4);
+                        break;
+                    }
+
+                    while (in.size() < eol + 2 + size + 2)
+                    {
+                        if (!fill())
+                            return -1;
+                    }
+                    in.erase(0, eol + 2 + size + 2);
+                }
+            }
+            else if (length >= 0)
+            {
+                while ((long long)in.size() < length)
+                {
+                    if (!fill())
+                        return -1;
+                }
+                in.erase(0, length);
+            }
+            else
+                closing = true;
+
+            if (closing)
+                disconnect();
+            return status;
+        }
+
+        std::string host;
+        std::string port;
+        std::string path;
+        std::string header;
+        std::chrono::seconds timeout;
+        int fd = -1;
+        std::string in;
+    };
+
+    /**
+     * @brief Pushes collections to a receiver, from a thread of its own.
+     * Collections are encoded into batches as they are pushed, and queued.
+     * A request that fails is retried, with backoff, before the batches
+     * after it. When the queue is full, the oldest batch is shed, so the
+     * receiver gets the latest samples, once it catches up. A receiver that
+     * rejects a batch, with a 4xx other than 429, gets it only once.
+     */
+    class writer
+    {
+    public:
+        /**
+         * @param opts the options
+         * @throws std::invalid_argument for a url, that is not http://
+         */
+        writer(const options &opts) : opts(opts), endpoint(opts.url, opts.timeout)
+        {
+            sender = std::thread([this]() { run(); });
+        }
+
+        writer(const writer &) = delete;
+        writer &operator=(const writer &) = delete;
+
+        ~writer()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            sender.join();
+        }
+
+        /**
+         * @brief Queues the samples of sets of families.
+         *
+         * @param sets the sets
+         * @param count number of sets
+         * @param collected when the samples were collected
+         */
+        void push(const exposition::families *const *sets, size_t count, std::chrono::system_clock::time_point collected)
+        {
+            int64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(collected.time_since_epoch()).count();
+
+            std::vector<batch> batches;
+            encode(sets, count, timestamp, std::max<size_t>(1, opts.batch), batches);
+            if (batches.empty())
+                return;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for (batch &b : batches)
+                {
+                    if (pending.size() >= std::max<size_t>(1, opts.queue))
+                    {
+                        shed_samples.fetch_add(pending.front().samples, std::memory_order_relaxed);
+                        pending.pop_front();
+                    }
+                    pending.push_back(std::move(b));
+                }
+            }
+            wake.notify_one();
+        }
+
+        /**
+         * @brief Queues the samples of a snapshot, from the families it was
+         * rendered from, at the time they were collected.
+         *
+         * @param snap the snapshot
+         * @param sets the families
+         * @param count number of sets
+         */
+        void push(const snapshot::snapshot &snap, const exposition::families *const *sets, size_t count)
+        {
+            push(sets, count, std::chrono::system_clock::now() -
+                                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - snap.collected));
+        }
+
+        /**
+         * @brief Waits until every queued batch is sent, or dropped.
+         *
+         * @param timeout how long to wait
+         * @return bool false, if the queue is not empty by then
+         */
+        bool drain(std::chrono::milliseconds timeout)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            return idle.wait_for(guard, timeout, [this]() { return pending.empty() && !sending; });
+        }
+
+        /**
+         * @brief Appends the writer's counters.
+         *
+         * @param f the families to add to
+         */
+        void render(exposition::families &f) const
+        {
+            size_t queued;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                queued = pending.size();
+            }
+
+            f.add(f.get("counter", "Samples sent with remote write.", "libvirt", "remote_write_samples_total"))
+                .value(samples.load(std::memory_order_relaxed));
+            f.add(f.get("counter", "Remote write requests, that the receiver accepted.", "libvirt", "remote_write_batches_total"))
+                .value(batches.load(std::memory_order_relaxed));
+            f.add(f.get("counter", "Remote write requests, that failed and were retried.", "libvirt", "remote_write_retries_total"))
+                .value(retries.load(std::memory_order_relaxed));
+
+            exposition::family &dropped = f.get("counter", "Samples dropped, as the queue was full, or the receiver rejected them.",
+                                                "libvirt", "remote_write_dropped_samples_total");
+            f.add(dropped).label("reason", "queue_full").value(shed_samples.load(std::memory_order_relaxed));
+            f.add(dropped).label("reason", "rejected").value(rejected_samples.load(std::memory_order_relaxed));
+
+            f.add(f.get("gauge", "Remote write requests, waiting to be sent.", "libvirt", "remote_write_queue_batches"))
+                .value((unsigned long long)queued);
+        }
+
+    private:
+        void run()
+        {
+            std::chrono::milliseconds backoff = opts.backoff;
+            std::unique_lock<std::mutex> guard(lock);
+
+            while (true)
+            {
+                wake.wait(guard, [this]() { return stopping || !pending.empty(); });
+                if (stopping)
+                    return;
+
+                batch b = std::move(pending.front());
+                pending.pop_front();
+                sending = true;
+
+                guard.unlock();
+                int status = endpoint.post(b.body);
+                guard.lock();
+                sending = false;
+
+                if (status >= 200 && status < 300)
+                {
+                    samples.fetch_add(b.samples, std::memory_order_relaxed);
+                    batches.fetch_add(1, std::memory_order_relaxed);
+                    backoff = opts.backoff;
+                }
+                else if (status >= 400 && status < 500 && status != 429)
+                {
+                    fprintf(stderr, "remote write: rejected with %d, dropping %zu samples\n", status, b.samples);
+                    rejected_samples.fetch_add(b.samples, std::memory_order_relaxed);
+                }
+                else
+                {
+                    // The batch goes back first in line, unless newer ones have filled the queue meanwhile.
+                    retries.fetch_add(1, std::memory_order_relaxed);
+                    if (pending.size() >= std::max<size_t>(1, opts.queue))
+                        shed_samples.fetch_add(b.samples, std::memory_order_relaxed);
+                    else
+                        pending.push_front(std::move(b));
+
+                    wake.wait_for(guard, backoff, [this]() { return stopping; });
+                    backoff = std::min(backoff * 2, opts.max_backoff);
+                }
+
+                if (pending.empty())
+                    idle.notify_all();
+            }
+        }
+
+        const options opts;
+        client endpoint;
+
+        mutable std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        std::deque<batch> pending;
+        bool sending = false;
+        bool stopping = false;
+
+        std::atomic<unsigned long long> samples{0};
+        std::atomic<unsigned long long> batches{0};
+        std::atomic<unsigned long long> retries{0};
+        std::atomic<unsigned long long> shed_samples{0};
+        std::atomic<unsigned long long> rejected_samples{0};
+
+        std::thread sender;
+    };
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef __SELECTION_HPP__
+#define __SELECTION_HPP__
+
+#include <fnmatch.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <collector.hpp>
+
+namespace selection
+{
+    /**
+     * @brief What a request asks for, from its query string, e.g
+     * /metrics?collect[]=vcpu&domain=instance-*&tenant=<uuid>.
+     */
+    struct filter
+    {
+        // Stat groups to respond with, 0 for all. The collection takes every group of --stats.
+        unsigned int stats = 0;
+        // Globs, matched against domain names and uuids.
+        std::vector<std::string> domains;
+        // Tenant uuids.
+        std::vector<std::string> tenants;
+        // Targets, by hypervisor name or uri, empty for the configured ones.
+        std::vector<std::string> targets;
+
+        /**
+         * @brief Whether the request asks for every sample of the targets.
+         *
+         * @return bool
+         */
+        bool empty() const
+        {
+            return stats == 0 && domains.empty() && tenants.empty();
+        }
+
+        /**
+         * @brief Whether a stat group is asked for.
+         *
+         * @param g the group, an index into collector::groups
+         * @return bool
+         */
+        bool wants(size_t g) const
+        {
+            return stats == 0 || (stats & collector::groups[g].stats) != 0;
+        }
+
+        /**
+         * @brief Whether a domain is asked for, by its globs.
+         *
+         * @param name the domain name
+         * @param uuid the domain uuid
+         * @return bool
+         */
+        bool wants(const std::string &name, const std::string &uuid) const
+        {
+            if (domains.empty())
+                return true;
+
+            for (const std::string &glob : domains)
+            {
+                if (fnmatch(glob.c_str(), name.c_str(), 0) == 0 || fnmatch(glob.c_str(), uuid.c_str(), 0) == 0)
+                    return true;
+            }
+            return false;
+        }
+    };
+
+    inline int hex(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    /**
+     * @brief Decodes a query string component, %XX and '+' for space.
+     *
+     * @param s the component
+     * @return std::string
+     */
+    inline std::string decode(std::string_view s)
+    {
+        std::string out;
+        out.reserve(s.size());
+
+        for (size_t i = 0; i < s.size(); i++)
+        {
+            if (s[i] == '+')
+                out.push_back(' ');
+            else if (s[i] == '%' && i + 2 < s.size() && hex(s[i + 1]) >= 0 && hex(s[i + 2]) >= 0)
+            {
+                out.push_back((char)(hex(s[i + 1]) * 16 + hex(s[i + 2])));
+                i += 2;
+            }
+            else
+                out.push_back(s[i]);
+        }
+
+        return out;
+    }
+
+    /**
+     * @brief Parses the query string of a request. Unknown parameters are ignored.
+     *
+     * collect[]=group  stat group, one of collector::groups, may be repeated
+     * domain=glob      domain name or uuid, may be repeated
+     * tenant=uuid      tenant, may be repeated
+     * target=uri       hypervisor name or libvirt uri, may be repeated
+     *
+     * @param query the query string, without '?'
+     * @return filter
+     * @throws std::invalid_argument for an unknown stat group
+     */
+    inline filter parse(std::string_view query)
+    {
+        filter f;
+
+        while (!query.empty())
+        {
+            size_t amp = query.find('&');
+            std::string_view pair = query.substr(0, amp);
+            query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+
+            size_t eq = pair.find('=');
+            if (eq == std::string_view::npos)
+                continue;
+
+            std::string key = decode(pair.substr(0, eq));
+            std::string value = decode(pair.substr(eq + 1));
+            if (value.empty())
+                continue;
+
+            if (key == "collect[]" || key == "collect")
+                f.stats |= collector::groups[collector::find_group(value)].stats;
+            else if (key == "domain")
+                f.domains.push_back(value);
+            else if (key == "tenant")
+                f.tenants.push_back(value);
+            else if (key == "target")
+                f.targets.push_back(value);
+        }
+
+        return f;
+    }
+}
+
+#endif
@@ -1,120 +1,792 @@
 #ifndef __VCPU_SERIALIZER_HPP__
 #define __VCPU_SERIALIZER_HPP__
 
+#include <cmath>
+#include <fnmatch.h>
 #include <iostream>
 #include <string>
 #include <string.h>
+#include <iterator>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
 #include <format.hpp>
+#include <cache.hpp>
+#include <exposition.hpp>
+#include <fields.hpp>
+#include <instrument.hpp>
 #include <vector>
 #include <libvirt/libvirt.h>
 
 namespace serializer
 {
-    inline void vcpu_metrics(std::string &out, size_t rc, virDomainStatsRecordPtr *stats)
+    /**
+     * @brief Labels shared by every sample of one domain record.
+     * Looked up once per record, not once per typed parameter.
+     */
+    struct domain_labels
     {
+        cache::domain_info_ptr info;
+        std::string_view netname;
+        // The target the domain runs on, empty with a single target.
+        std::string_view hypervisor;
+
+        domain_labels(cache::domain_cache &domains, virDomainPtr dom) : info(domains.get(dom))
+        {
+        }
+    };
+
+    /**
+     * @brief The families samples are added to, and the family of each
+     * known field, looked up once per pass instead of once per parameter.
+     */
+    struct context
+    {
+        exposition::families &f;
+        exposition::family *fams[fields::COUNT] = {};
+        exposition::family *sums[fields::COUNT] = {};
+
+        explicit context(exposition::families &f) : f(f)
+        {
+        }
+
+        exposition::family &family(const fields::parsed &field)
+        {
+            if (fams[field.id] == NULL)
+                fams[field.id] = &f.get(field->type, field->help.empty() ? fields::help[(int)field->g] : field->help, field->family);
+            return *fams[field.id];
+        }
+
+        /**
+         * @brief The family of a field summed per domain, e.g
+         * libvirt_vcpu_time => libvirt_domain_vcpu_time.
+         */
+        exposition::family &total(const fields::parsed &field)
+        {
+            if (sums[field.id] == NULL)
+                sums[field.id] = &f.get(field->type, fields::totals_help[(int)field->g], "libvirt_domain",
+                                        field->family.substr(field->family.find('_') + 1));
+            return *sums[field.id];
+        }
+    };
+
+    /**
+     * @brief Which groups are summed per domain, instead of a series per
+     * vCPU or device, and the domains that keep their series per vCPU or
+     * device as well.
+     */
+    struct aggregation
+    {
+        // Indexed by fields::group.
+        bool groups[(int)fields::group::count] = {};
+        // Globs, matched against domain names and uuids.
+        std::vector<std::string> domains;
+        // Tenant uuids.
+        std::vector<std::string> tenants;
+
+        /**
+         * @brief Whether a field is summed per domain. Only counters are,
+         * a sum of e.g vCPU states means nothing.
+         *
+         * @param field the field
+         * @return bool
+         */
+        bool sums(const fields::parsed &field) const
+        {
+            return groups[(int)field->g] && field->label == fields::slot::none && field->type == "counter";
+        }
+
+        /**
+         * @brief Whether a domain keeps its series per vCPU or device.
+         *
+         * @param info the domain
+         * @return bool
+         */
+        bool detail(const cache::domain_info &info) const
+        {
+            for (const std::string &tenant : tenants)
+            {
+                if (tenant == info.tenant)
+                    return true;
+            }
+            for (const std::string &glob : domains)
+            {
+                if (fnmatch(glob.c_str(), info.name.c_str(), 0) == 0 || fnmatch(glob.c_str(), info.uuid.c_str(), 0) == 0)
+                    return true;
+            }
+            return false;
+        }
+    };
+
+    /**
+     * @brief Sums n contiguous values. Four independent partial sums, so
+     * the adds don't wait on each other, and the compiler may keep them in
+     * vector registers without reassociating the floating point adds.
+     *
+     * @param v the values
+     * @param n number of values
+     * @return double
+     */
+    inline double sum(const double *v, size_t n)
+    {
+        double s[4] = {0, 0, 0, 0};
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            s[0] += v[i];
+            s[1] += v[i + 1];
+            s[2] += v[i + 2];
+            s[3] += v[i + 3];
+        }
+        for (; i < n; i++)
+            s[0] += v[i];
+
+        return (s[0] + s[1]) + (s[2] + s[3]);
+    }
+
+    /**
+     * @brief Per-second rates of n counters, from their values now and at
+     * the last collection. A counter that went down was reset, e.g by a
+     * domain restart, and counted up from zero since. Without branches, so
+     * the compiler may vectorize it.
+     *
+     * @param current the values now
+     * @param previous the values at the last collection
+     * @param scale multiplies each rate
+     * @param per_second one over the seconds in between
+     * @param out the rates
+     * @param n number of counters
+     */
+    inline void rates(const double *current, const double *previous, const double *scale, double per_second, double *out,
+                      size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            double delta = current[i] - previous[i];
+            out[i] = (delta < 0 ? current[i] : delta) * scale[i] * per_second;
+        }
+    }
+
+    inline void vcpu_metric(context &ctx, domain_labels &labels, const fields::parsed &field, const virTypedParameter &param)
+    {
+        // vcpu.<index>.<name> => vcpu_<name>
+        ctx.f.add(ctx.family(field), labels.info)
+            .label("domain", labels.info->name)
+            .label("vcpu", field.index)
+            .label("uuid", labels.info->uuid)
+            .label("tenant", labels.info->tenant)
+            .optional_label("hypervisor", labels.hypervisor)
+            .value(fields::value(param));
+    }
+
+    inline void network_metric(context &ctx, domain_labels &labels, const fields::parsed &field, const virTypedParameter &param)
+    {
+        // net.<index>.name, labels the samples that follow
+        if (field->label == fields::slot::netname)
+        {
+            labels.netname = param.type == VIR_TYPED_PARAM_STRING ? param.value.s : "";
+            return;
+        }
+
+        // net.<index>.<direction>.<name> => net_<name>_<direction>
+        ctx.f.add(ctx.family(field), labels.info)
+            .label("domain", labels.info->name)
+            .label("interfaceid", field.index)
+            .label("name", labels.netname)
+            .label("uuid", labels.info->uuid)
+            .label("tenant", labels.info->tenant)
+            .optional_label("hypervisor", labels.hypervisor)
+            .value(fields::value(param));
+    }
+
+    inline void block_metric(context &ctx, domain_labels &labels, const fields::parsed &field, const virTypedParameter &param)
+    {
+        // block.<index>.<direction>.<name> => block_<name>_<direction>
+        ctx.f.add(ctx.family(field), labels.info)
+            .label("domain", labels.info->name)
+            .label("blockid", field.index)
+            .label("uuid", labels.info->uuid)
+            .label("tenant", labels.info->tenant)
+            .optional_label("hypervisor", labels.hypervisor)
+            .value(fields::value(param));
+    }
+
+    inline void per_domain_metric(context &ctx, domain_labels &labels, const fields::parsed &field, const virTypedParameter &param)
+    {
+        // balloon.<name> => balloon_<name>, cpu.<name> => cpu_<name>
+        ctx.f.add(ctx.family(field), labels.info)
+            .label("domain", labels.info->name)
+            .label("uuid", labels.info->uuid)
+            .label("tenant", labels.info->tenant)
+            .optional_label("hypervisor", labels.hypervisor)
+            .value(fields::value(param));
+    }
+
+    inline void total_metric(context &ctx, domain_labels &labels, const fields::parsed &field, double value)
+    {
+        // <group>.<index>.<name>, summed over the indexes => domain_<group>_<name>
+        ctx.f.add(ctx.total(field), labels.info)
+            .label("domain", labels.info->name)
+            .label("uuid", labels.info->uuid)
+            .label("tenant", labels.info->tenant)
+            .optional_label("hypervisor", labels.hypervisor)
+            .value(value);
+    }
+
+    /**
+     * @brief The serializer of a field, by its group.
+     */
+    inline void metric(context &ctx, domain_labels &labels, const fields::parsed &field, const virTypedParameter &param)
+    {
+        switch (field->g)
+        {
+        case fields::group::vcpu:
+            vcpu_metric(ctx, labels, field, param);
+            break;
+        case fields::group::net:
+            network_metric(ctx, labels, field, param);
+            break;
+        case fields::group::block:
+            block_metric(ctx, labels, field, param);
+            break;
+        case fields::group::balloon:
+        case fields::group::cpu:
+            per_domain_metric(ctx, labels, field, param);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Where the time spent serializing a group is observed.
+    inline constexpr instrument::phase phases[] = {instrument::phase::serialize_vcpu, instrument::phase::serialize_net,
+                                                   instrument::phase::serialize_block, instrument::phase::serialize_balloon,
+                                                   instrument::phase::serialize_cpu};
+
+    static_assert(std::size(phases) == (size_t)fields::group::count, "a phase per group");
+
+    /**
+     * @brief Runs the serializer of one group, over the known fields of that group.
+     */
+    template <typename Fn>
+    inline void group_metrics(fields::group g, Fn metric, exposition::families &f, cache::domain_cache &domains, size_t rc,
+                              virDomainStatsRecordPtr *stats)
+    {
+        context ctx(f);
+
         for (size_t j = 0; j < rc; j++)
         {
             virDomainStatsRecordPtr record = stats[j];
+            domain_labels labels(domains, record->dom);
 
             for (int k = 0; k < record->nparams; k++)
             {
+                fields::parsed field = fields::parse(record->params[k].field);
+                if (field.id >= 0 && field->g == g)
+                    metric(ctx, labels, field, record->params[k]);
+            }
+        }
+    }
 
-                char tenantuuid[4096] = {0};
-                custom::virDomainGetTenant(record->dom, &tenantuuid[0]);
+    inline void vcpu_metrics(exposition::families &f, cache::domain_cache &domains, size_t rc, virDomainStatsRecordPtr *stats)
+    {
+        group_metrics(fields::group::vcpu, vcpu_metric, f, domains, rc, stats);
+    }
 
-                char uuid[4096] = {0};
-                virDomainGetUUIDString(record->dom, uuid);
+    inline void network_metrics(exposition::families &f, cache::domain_cache &domains, size_t rc, virDomainStatsRecordPtr *stats)
+    {
+        group_metrics(fields::group::net, network_metric, f, domains, rc, stats);
+    }
+
+    inline void block_metrics(exposition::families &f, cache::domain_cache &domains, size_t rc, virDomainStatsRecordPtr *stats)
+    {
+        group_metrics(fields::group::block, block_metric, f, domains, rc, stats);
+    }
+
+    /**
+     * @brief Dispatches the typed parameters of a combined stats call
+     * (e.g VCPU | INTERFACE | BLOCK | BALLOON | CPU_TOTAL) to the matching
+     * serializer, in a single pass over the records.
+     *
+     * @param f the metric families to add samples to
+     * @param domains the domain metadata cache
+     * @param rc number of records
+     * @param stats the records
+     */
+    inline void domain_metrics(exposition::families &f, cache::domain_cache &domains, size_t rc, virDomainStatsRecordPtr *stats)
+    {
+        context ctx(f);
 
-                // <instance>
-                // <tenant>
-                // <uuid>43dc0cf8-809b-4adb-9bea-a9abb5f3d90e</uuid>
-                // </tenant>
-                // </instance>
+        // Time spent per group, clocked when the group changes, not per parameter.
+        uint64_t spent[(int)fields::group::count] = {0};
 
-                // input is vcpu, id, param
-                std::vector<std::string> fields = custom::split(record->params[k].field);
-                if (fields.size() == 3)
+        for (size_t j = 0; j < rc; j++)
+        {
+            virDomainStatsRecordPtr record = stats[j];
+            domain_labels labels(domains, record->dom);
+
+            int group = -1;
+            uint64_t mark = instrument::now();
+
+            for (int k = 0; k < record->nparams; k++)
+            {
+                fields::parsed field = fields::parse(record->params[k].field);
+                if (field.id < 0)
+                    continue;
+
+                if ((int)field->g != group)
                 {
-                    out.append(custom::format("# TYPE libvirt_%s_%s counter\n", fields[0].c_str(), fields[2].c_str()));
-                    out.append(custom::format("libvirt_%s_%s{domain=\"%s\", vcpu=\"%s\" uuid=\"%s\" tenant=\"%s\"} %llu\n",
-                                              fields[0].c_str(),
-                                              fields[2].c_str(),
-                                              virDomainGetName(record->dom),
-                                              fields[1].c_str(),
-                                              uuid,
-                                              tenantuuid,
-                                              record->params[k].value.ul));
+                    uint64_t t = instrument::now();
+                    if (group >= 0)
+                        spent[group] += t - mark;
+                    mark = t;
+                    group = (int)field->g;
                 }
+
+                metric(ctx, labels, field, record->params[k]);
             }
+
+            if (group >= 0)
+                spent[group] += instrument::now() - mark;
+        }
+
+        for (int g = 0; g < (int)fields::group::count; g++)
+        {
+            if (spent[g] > 0)
+                instrument::observe(phases[g], spent[g]);
         }
     }
 
-    inline void network_metrics(std::string &out, size_t rc, virDomainStatsRecordPtr *stats)
+    /**
+     * @brief The series of each domain, with their label sets rendered.
+     * A domain's entry holds the field names of its last record, the
+     * family of each sample and its label set, e.g
+     * {domain="a",vcpu="0",uuid="...",tenant="..."}. While the record has
+     * the same fields, and the domain the same metadata, a scrape only
+     * copies the label sets and appends the values. Entries are rebuilt
+     * when a domain's devices change, and dropped when it is gone.
+     *
+     * With an aggregation, the counters of the summed groups become one
+     * series per domain and field, e.g libvirt_domain_vcpu_time; an entry
+     * holds the indexes of the parameters of each sum next to each other,
+     * and a scrape gathers and sums their values.
+     *
+     * With rates, an entry also keeps the values of the counters rates are
+     * derived from, e.g vcpu.<num>.time, as of the last collection, in an
+     * array in the order of the rates, and a scrape adds the rate of each
+     * next to the counter, with the counter's label set. The values are
+     * carried over, by label set, when the entry is rebuilt.
+     */
+    class series_table
     {
-        for (size_t j = 0; j < rc; j++)
+    public:
+        explicit series_table(exposition::families &f) : f(f)
         {
-            virDomainStatsRecordPtr record = stats[j];
-            std::string netname;
+        }
 
-            char tenantuuid[4096] = {0};
-            custom::virDomainGetTenant(record->dom, &tenantuuid[0]);
+        series_table(const series_table &) = delete;
+        series_table &operator=(const series_table &) = delete;
 
-            char uuid[4096] = {0};
-            virDomainGetUUIDString(record->dom, uuid);
+        exposition::families &families()
+        {
+            return f;
+        }
 
-            for (int k = 0; k < record->nparams; k++)
+        /**
+         * @brief Sums the counters of some groups per domain, from the next
+         * scrape on.
+         *
+         * @param policy the aggregation, NULL for a series per vCPU and device
+         */
+        void aggregate(const aggregation *policy)
+        {
+            this->policy = policy;
+            entries.clear();
+        }
+
+        /**
+         * @brief Labels every sample with the hypervisor, from the next scrape on.
+         *
+         * @param hypervisor the label value, empty for none
+         */
+        void tag(std::string hypervisor)
+        {
+            this->hypervisor = std::move(hypervisor);
+            entries.clear();
+        }
+
+        /**
+         * @brief Derives the rates of fields::rates, from the next scrape on.
+         *
+         * @param derive whether to
+         */
+        void derive(bool derive)
+        {
+            deriving = derive;
+            entries.clear();
+        }
+
+        /**
+         * @brief Like domain_metrics, from the cached label sets where possible.
+         *
+         * @param domains the domain metadata cache
+         * @param rc number of records
+         * @param stats the records
+         */
+        void domain_metrics(cache::domain_cache &domains, size_t rc, virDomainStatsRecordPtr *stats)
+        {
+            context ctx(f);
+            uint64_t spent[(int)fields::group::count] = {0};
+            uint64_t stamp = instrument::now();
+            generation++;
+
+            for (size_t j = 0; j < rc; j++)
             {
+                virDomainStatsRecordPtr record = stats[j];
+                domain_labels labels(domains, record->dom);
+                labels.hypervisor = hypervisor;
+
+                entry &e = entries[labels.info->uuid];
+                e.seen = generation;
+
+                if (e.info != labels.info || !e.matches(record))
+                    rebuild(ctx, e, labels, record);
+                current.resize(e.rates.size());
 
-                // input is vcpu, id, param
-                std::vector<std::string> fields = custom::split(record->params[k].field);
-                if (fields.size() == 3)
+                int group = -1;
+                uint64_t mark = instrument::now();
+
+                for (const series &ser : e.samples)
                 {
-                    netname = record->params[k].value.s;
+                    if (ser.g != group)
+                    {
+                        uint64_t t = instrument::now();
+                        if (group >= 0)
+                            spent[group] += t - mark;
+                        mark = t;
+                        group = ser.g;
+                    }
+
+                    ser.fam->labels.append(e.labels, ser.start, ser.length);
+                    ser.fam->ends.push_back(ser.fam->labels.size());
+                    double value = fields::value(record->params[ser.param]);
+                    ser.fam->values.push_back(value);
+                    // The entry holds its domain, while the samples are rendered.
+                    ser.fam->owners.push_back(e.info.get());
+                    if (ser.rate >= 0)
+                        current[ser.rate] = value;
                 }
 
-                if (fields.size() == 4)
+                for (const total &tot : e.totals)
                 {
-                    out.append(custom::format("# TYPE libvirt_%s_%s_%s counter\n", fields[0].c_str(), fields[3].c_str(), fields[2].c_str()));
-                    out.append(custom::format("libvirt_%s_%s_%s{domain=\"%s\" interfaceid=\"%s\", name=\"%s\" uuid=\"%s\" tenant=\"%s\"} %llu\n",
-                                              fields[0].c_str(), fields[3].c_str(), fields[2].c_str(), // => net_bytes_rx
-                                              virDomainGetName(record->dom), fields[1].c_str(), netname.c_str(),
-                                              uuid,
-                                              tenantuuid,
-                                              record->params[k].value.ul));
+                    if (tot.g != group)
+                    {
+                        uint64_t t = instrument::now();
+                        if (group >= 0)
+                            spent[group] += t - mark;
+                        mark = t;
+                        group = tot.g;
+                    }
+
+                    // Gathered next to each other first, the parameters are 80 bytes apart.
+                    gathered.resize(tot.count);
+                    for (size_t i = 0; i < tot.count; i++)
+                        gathered[i] = fields::value(record->params[e.summed[tot.first + i]]);
+
+                    tot.fam->labels.append(e.labels, tot.start, tot.length);
+                    tot.fam->ends.push_back(tot.fam->labels.size());
+                    double value = sum(gathered.data(), tot.count);
+                    tot.fam->values.push_back(value);
+                    tot.fam->owners.push_back(e.info.get());
+                    if (tot.rate >= 0)
+                        current[tot.rate] = value;
                 }
+
+                if (!e.rates.empty())
+                    add_rates(e, stamp);
+
+                if (group >= 0)
+                    spent[group] += instrument::now() - mark;
+            }
+
+            for (int g = 0; g < (int)fields::group::count; g++)
+            {
+                if (spent[g] > 0)
+                    instrument::observe(phases[g], spent[g]);
+            }
+
+            // Drop the domains, that are gone.
+            for (auto it = entries.begin(); it != entries.end();)
+            {
+                if (it->second.seen != generation)
+                    it = entries.erase(it);
+                else
+                    ++it;
             }
         }
-    }
 
-    inline void block_metrics(std::string &out, size_t rc, virDomainStatsRecordPtr *stats)
-    {
-        for (size_t j = 0; j < rc; j++)
+        /**
+         * @brief Number of entries rebuilt since start.
+         *
+         * @return unsigned long long
+         */
+        unsigned long long rebuilds() const
         {
-            virDomainStatsRecordPtr record = stats[j];
-            char tenantuuid[4096] = {0};
-            custom::virDomainGetTenant(record->dom, &tenantuuid[0]);
+            return rebuilt;
+        }
+
+    private:
+        struct series
+        {
+            int param;
+            int g;
+            exposition::family *fam;
+            size_t start;
+            size_t length;
+            // Index into the entry's rates, -1 for none.
+            int rate;
+        };
+
+        struct total
+        {
+            int g;
+            exposition::family *fam;
+            size_t start;
+            size_t length;
+            // The parameters summed, summed[first, first + count).
+            size_t first;
+            size_t count;
+            int rate;
+        };
+
+        // A rate, with the label set of its counter.
+        struct rated
+        {
+            exposition::family *fam;
+            size_t start;
+            size_t length;
+        };
+
+        struct entry
+        {
+            cache::domain_info_ptr info;
+            // Field names, and the values of string fields, NUL terminated.
+            std::string signature;
+            std::string labels;
+            std::vector<series> samples;
+            std::vector<total> totals;
+            std::vector<int> summed;
+            std::vector<rated> rates;
+            std::vector<double> scale;
+            // Values of the counters at the last collection, and when, 0 for none yet.
+            std::vector<double> previous;
+            uint64_t sampled = 0;
+            unsigned long long seen = 0;
+
+            static void sign(std::string &out, const virTypedParameter &param)
+            {
+                out.append(param.field);
+                out.push_back('\0');
+                if (param.type == VIR_TYPED_PARAM_STRING)
+                {
+                    out.append(param.value.s ? param.value.s : "");
+                    out.push_back('\0');
+                }
+            }
+
+            bool matches(virDomainStatsRecordPtr record) const
+            {
+                size_t pos = 0;
+                for (int k = 0; k < record->nparams; k++)
+                {
+                    if (!match(pos, record->params[k].field))
+                        return false;
+                    if (record->params[k].type == VIR_TYPED_PARAM_STRING && !match(pos, record->params[k].value.s ? record->params[k].value.s : ""))
+                        return false;
+                }
+                return pos == signature.size();
+            }
+
+            bool match(size_t &pos, const char *s) const
+            {
+                size_t n = strlen(s) + 1;
+                if (signature.size() - pos < n || memcmp(signature.data() + pos, s, n) != 0)
+                    return false;
+                pos += n;
+                return true;
+            }
+        };
+
+        /**
+         * @brief Renders the label sets of a domain, from its record.
+         */
+        void rebuild(context &ctx, entry &e, domain_labels &labels, virDomainStatsRecordPtr record)
+        {
+            // The counters' last values, by the series of their rates, so a
+            // rebuild, e.g for a device that was added, doesn't lose them.
+            std::unordered_map<std::string, double> last;
+            uint64_t sampled = e.sampled;
+            if (sampled != 0)
+            {
+                for (size_t k = 0; k < e.rates.size(); k++)
+                    last.emplace(key(e, e.rates[k]), e.previous[k]);
+            }
+
+            e.info = labels.info;
+            e.signature.clear();
+            e.labels.clear();
+            e.samples.clear();
+            e.totals.clear();
+            e.summed.clear();
+            e.rates.clear();
+            e.scale.clear();
+            e.previous.clear();
+            e.sampled = 0;
+            rebuilt++;
+
+            // Scratch families, so the samples are rendered exactly as the serializers do.
+            scratch.clear();
+            context rendering(scratch);
 
-            char uuid[4096] = {0};
-            virDomainGetUUIDString(record->dom, uuid);
+            bool detail = policy == NULL || policy->detail(*labels.info);
+            // The parameters of each sum, by field.
+            std::vector<int> parts[fields::COUNT];
+            std::vector<fields::parsed> order;
 
             for (int k = 0; k < record->nparams; k++)
             {
-                // input is vcpu, id, param
-                std::vector<std::string> fields = custom::split(record->params[k].field);
-                if (fields.size() == 4)
+                const virTypedParameter &param = record->params[k];
+                entry::sign(e.signature, param);
+
+                fields::parsed field = fields::parse(param.field);
+                if (field.id < 0)
+                    continue;
+
+                if (policy != NULL && policy->sums(field))
                 {
-                    out.append(custom::format("# TYPE libvirt_%s_%s_%s counter\n", fields[0].c_str(), fields[3].c_str(), fields[2].c_str()));
-                    out.append(custom::format("libvirt_%s_%s_%s{domain=\"%s\" blockid=\"%s\", uuid=\"%s\" tenant=\"%s\"} %llu\n",
-                                              fields[0].c_str(), fields[3].c_str(), fields[2].c_str(), // => net_bytes_rx
-                                              virDomainGetName(record->dom), fields[1].c_str(), 
-                                              uuid,
-                                              tenantuuid,
-                                              record->params[k].value.ul));
+                    if (parts[field.id].empty())
+                        order.push_back(field);
+                    parts[field.id].push_back(k);
+
+                    if (!detail)
+                        continue;
                 }
+
+                exposition::family &out = rendering.family(field);
+                size_t before = out.labels.size();
+
+                metric(rendering, labels, field, param);
+
+                if (field->label != fields::slot::none)
+                    continue;
+
+                size_t start = e.labels.size(), length = out.labels.size() - before;
+                e.samples.push_back({k, (int)field->g, &ctx.family(field), start, length, rate(ctx, e, field, start, length, false)});
+                e.labels.append(out.labels, before, length);
+            }
+
+            for (const fields::parsed &field : order)
+            {
+                exposition::family &out = rendering.total(field);
+                size_t before = out.labels.size();
+
+                total_metric(rendering, labels, field, 0);
+
+                size_t start = e.labels.size(), length = out.labels.size() - before;
+                e.totals.push_back({(int)field->g, &ctx.total(field), start, length, e.summed.size(), parts[field.id].size(),
+                                    rate(ctx, e, field, start, length, true)});
+                e.labels.append(out.labels, before, length);
+                e.summed.insert(e.summed.end(), parts[field.id].begin(), parts[field.id].end());
+            }
+
+            // A series without a last value gets its rate from the next collection.
+            if (!last.empty())
+            {
+                e.previous.assign(e.rates.size(), std::numeric_limits<double>::quiet_NaN());
+                for (size_t k = 0; k < e.rates.size(); k++)
+                {
+                    auto it = last.find(key(e, e.rates[k]));
+                    if (it != last.end())
+                        e.previous[k] = it->second;
+                }
+                e.sampled = sampled;
             }
         }
-    }
 
+        /**
+         * @brief A rate's family and label set, as a key.
+         */
+        static std::string key(const entry &e, const rated &r)
+        {
+            std::string k((const char *)&r.fam, sizeof(r.fam));
+            k.append(e.labels, r.start, r.length);
+            return k;
+        }
+
+        /**
+         * @brief Adds the rate derived from a field, if any, with the label
+         * set of the field's series.
+         *
+         * @return int the index of the rate, -1 for none
+         */
+        int rate(context &ctx, entry &e, const fields::parsed &field, size_t start, size_t length, bool summed)
+        {
+            const fields::derived *d = deriving ? fields::rate_of(field) : NULL;
+            if (d == NULL)
+                return -1;
+
+            // e.g libvirt_vcpu_utilization_ratio, summed libvirt_domain_vcpu_utilization_ratio.
+            exposition::family &fam = summed ? ctx.f.get("gauge", d->help, "libvirt_domain", d->family.substr(d->family.find('_') + 1))
+                                             : ctx.f.get("gauge", d->help, d->family);
+            e.rates.push_back({&fam, start, length});
+            e.scale.push_back(d->scale);
+            return (int)e.rates.size() - 1;
+        }
+
+        /**
+         * @brief Adds the rates of an entry, from the values in current, and
+         * keeps these for the next collection. Nothing is added on the first
+         * collection of an entry.
+         */
+        void add_rates(entry &e, uint64_t stamp)
+        {
+            size_t n = e.rates.size();
+            if (e.sampled != 0 && stamp > e.sampled)
+            {
+                derived.resize(n);
+                rates(current.data(), e.previous.data(), e.scale.data(), 1e9 / (double)(stamp - e.sampled), derived.data(), n);
+
+                for (size_t k = 0; k < n; k++)
+                {
+                    if (std::isnan(derived[k]))
+                        continue;
+
+                    const rated &r = e.rates[k];
+                    r.fam->labels.append(e.labels, r.start, r.length);
+                    r.fam->ends.push_back(r.fam->labels.size());
+                    r.fam->values.push_back(derived[k]);
+                    r.fam->owners.push_back(e.info.get());
+                }
+            }
+
+            e.previous.assign(current.begin(), current.begin() + n);
+            e.sampled = stamp;
+        }
+
+        exposition::families &f;
+        exposition::families scratch;
+        const aggregation *policy = NULL;
+        std::string hypervisor;
+        bool deriving = false;
+        std::vector<double> gathered;
+        // Values of the counters rates are derived from, of the entry at hand, and their rates.
+        std::vector<double> current;
+        std::vector<double> derived;
+        std::unordered_map<std::string, entry> entries;
+        unsigned long long generation = 0;
+        unsigned long long rebuilt = 0;
+    };
 }
 
-#endif
\ No newline at end of file
+#endif
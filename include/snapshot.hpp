@@ -0,0 +1,661 @@
+#ifndef __SNAPSHOT_HPP__
+#define __SNAPSHOT_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <format.hpp>
+#include <compression.hpp>
+#include <cache.hpp>
+#include <collector.hpp>
+#include <exposition.hpp>
+#include <fields.hpp>
+#include <formats.hpp>
+#include <http.hpp>
+#include <instrument.hpp>
+#include <selection.hpp>
+#include <libvirt/libvirt.h>
+
+namespace snapshot
+{
+    /**
+     * @brief Where the samples of each domain are in a rendered body, as
+     * its renderer laid them out. A filtered response is cut from the
+     * body, by the domains it asks for, without parsing it.
+     */
+    class index
+    {
+    public:
+        /**
+         * @brief Indexes body, which must outlive the index. The labels of
+         * the domains are copied, once per domain.
+         *
+         * @param body the rendered body
+         * @param where where its renderer put the families, and the samples of each domain
+         */
+        index(std::string_view body, const exposition::layout &where) : body(body)
+        {
+            prefix = where.headers.empty() ? body.size() : where.headers[0].start;
+            for (const exposition::layout::header &h : where.headers)
+                families.push_back({h.start, h.end, group_of(name(h.start))});
+
+            std::unordered_map<const cache::domain_info *, size_t> known;
+            for (const exposition::layout::run &r : where.runs)
+            {
+                size_t d = npos;
+                if (r.owner != NULL)
+                {
+                    auto it = known.try_emplace(r.owner, domains.size());
+                    if (it.second)
+                        domains.push_back({r.owner->name, r.owner->uuid, r.owner->tenant});
+                    d = it.first->second;
+                }
+                ranges.push_back({r.header, d, r.start, r.end});
+            }
+        }
+
+        /**
+         * @brief Appends the bodies of several indexes to out, family by
+         * family: one header, then the samples of each in turn, and indexes
+         * the result. The comments before the first family are taken from
+         * the first. out must not change after.
+         *
+         * @param out the buffer to append to
+         * @param parts the indexes
+         */
+        index(std::string &out, const std::vector<const index *> &parts)
+        {
+            struct merged
+            {
+                const index *part;
+                size_t family;
+                // The samples, by index and range.
+                std::vector<std::pair<const index *, size_t>> ranges;
+            };
+
+            std::vector<merged> order;
+            std::unordered_map<std::string_view, size_t> by_name;
+            for (const index *part : parts)
+            {
+                std::vector<size_t> to(part->families.size());
+                for (size_t f = 0; f < part->families.size(); f++)
+                {
+                    auto it = by_name.try_emplace(part->name(part->families[f].start), order.size());
+                    if (it.second)
+                        order.push_back({part, f, {}});
+                    to[f] = it.first->second;
+                }
+                for (size_t r = 0; r < part->ranges.size(); r++)
+                    order[to[part->ranges[r].family]].ranges.emplace_back(part, r);
+            }
+
+            std::unordered_map<const index *, size_t> offset;
+            for (const index *part : parts)
+            {
+                offset[part] = domains.size();
+                domains.insert(domains.end(), part->domains.begin(), part->domains.end());
+            }
+
+            if (!parts.empty())
+                out.append(parts[0]->body, 0, parts[0]->prefix);
+            prefix = out.size();
+
+            for (const merged &m : order)
+            {
+                const family &header = m.part->families[m.family];
+                size_t start = out.size();
+                out.append(m.part->body, header.start, header.end - header.start);
+                families.push_back({start, out.size(), header.group});
+
+                for (const auto &[part, r] : m.ranges)
+                {
+                    const range &from = part->ranges[r];
+                    start = out.size();
+                    out.append(part->body, from.start, from.end - from.start);
+                    ranges.push_back({families.size() - 1, from.domain == npos ? npos : from.domain + offset[part], start, out.size()});
+                }
+            }
+            body = out;
+        }
+
+        /**
+         * @brief Renders the samples a filter asks for. The samples without
+         * a domain, e.g libvirt_scrape_rpcs, are rendered too, but those of
+         * a stat group, which aren't any one tenant's, not for a tenant.
+         *
+         * @param sel the filter
+         * @param out the buffer to append to
+         */
+        void render(const selection::filter &sel, std::string &out) const
+        {
+            std::vector<bool> wanted(domains.size());
+            for (size_t d = 0; d < domains.size(); d++)
+            {
+                wanted[d] = (sel.tenants.empty() || std::find(sel.tenants.begin(), sel.tenants.end(), domains[d].tenant) != sel.tenants.end()) &&
+                            sel.wants(domains[d].name, domains[d].uuid);
+            }
+
+            out.append(body, 0, prefix);
+            size_t fam = npos;
+            for (const range &r : ranges)
+            {
+                int g = families[r.family].group;
+                bool picked = r.domain != npos ? wanted[r.domain] && (g < 0 || sel.wants(g)) : g < 0 || (sel.tenants.empty() && sel.wants(g));
+                if (!picked)
+                    continue;
+
+                // With the header of each family.
+                if (r.family != fam)
+                {
+                    fam = r.family;
+                    out.append(body, families[fam].start, families[fam].end - families[fam].start);
+                }
+                out.append(body, r.start, r.end - r.start);
+            }
+        }
+
+    private:
+        static constexpr size_t npos = (size_t)-1;
+
+        struct family
+        {
+            size_t start;
+            size_t end;
+            int group;
+        };
+
+        // Consecutive samples of one family and domain.
+        struct range
+        {
+            size_t family;
+            size_t domain;
+            size_t start;
+            size_t end;
+        };
+
+        struct domain
+        {
+            std::string name;
+            std::string uuid;
+            std::string tenant;
+        };
+
+        /**
+         * @brief The name of the family whose # HELP line starts at pos.
+         */
+        std::string_view name(size_t pos) const
+        {
+            return body.substr(pos + 7, body.find(' ', pos + 7) - pos - 7);
+        }
+
+        /**
+         * @brief The group of a family, by name, and of its sums per domain.
+         *
+         * @param name the family name
+         * @return int -1, for a family of no group, e.g libvirt_up
+         */
+        static int group_of(std::string_view name)
+        {
+            static const std::unordered_map<std::string, int, cache::key_hash, std::equal_to<>> groups = []() {
+                std::unordered_map<std::string, int, cache::key_hash, std::equal_to<>> out;
+                for (const fields::spec &spec : fields::table)
+                {
+                    if (spec.family.empty())
+                        continue;
+                    out.emplace(spec.family, (int)spec.g);
+                    out.emplace("libvirt_domain_" + std::string(spec.family.substr(spec.family.find('_') + 1)), (int)spec.g);
+                }
+                for (const fields::derived &d : fields::rates)
+                {
+                    out.emplace(d.family, (int)d.g);
+                    out.emplace("libvirt_domain_" + std::string(d.family.substr(d.family.find('_') + 1)), (int)d.g);
+                }
+                return out;
+            }();
+
+            auto it = groups.find(name);
+            return it == groups.end() ? -1 : it->second;
+        }
+
+        std::string_view body;
+        // The comments before the first family.
+        size_t prefix = 0;
+        std::vector<family> families;
+        std::vector<domain> domains;
+        std::vector<range> ranges;
+    };
+
+    /**
+     * @brief A rendered, immutable collection. Once published it is
+     * never written to again, so any number of readers may share it.
+     */
+    struct snapshot
+    {
+        std::string body;
+        collector::result result;
+        std::chrono::steady_clock::time_point collected;
+        // When each stat group was last refreshed.
+        std::chrono::steady_clock::time_point refreshed[collector::GROUPS];
+        // Where the samples of each domain are in the body, from rendering it.
+        std::unique_ptr<const index> where;
+
+        /**
+         * @brief Age of the snapshot, in seconds.
+         *
+         * @return double
+         */
+        double age() const
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - collected).count();
+        }
+
+        /**
+         * @brief Age of the samples of a stat group, in seconds.
+         *
+         * @param g the group, an index into collector::groups
+         * @return double
+         */
+        double age(size_t g) const
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - refreshed[g]).count();
+        }
+
+        /**
+         * @brief The body, in a format. Encoded once, by the first request
+         * that asks for it, the text format is the body itself.
+         *
+         * @param f the format
+         * @return const std::string&
+         */
+        const std::string &encoded(formats::format f) const
+        {
+            if (f == formats::format::text)
+                return body;
+
+            std::call_once(encoded_once[(int)f], [this, f]() { formats::get(f).encode(body, encoded_body[(int)f]); });
+            return encoded_body[(int)f];
+        }
+
+        /**
+         * @brief The body, in a format, deflated into an open gzip member.
+         * Compressed once, by the first request that asks for it.
+         *
+         * @param f the format
+         * @return const compression::gzip_prefix&
+         */
+        const compression::gzip_prefix &gzip(formats::format f) const
+        {
+            std::call_once(gzip_once[(int)f], [this, f]() { gzip_body[(int)f] = compression::gzip_begin(encoded(f)); });
+            return gzip_body[(int)f];
+        }
+
+        /**
+         * @brief The index of the body, for filtered responses. A snapshot
+         * rendered without one, e.g of a target that is down, has nothing
+         * but comments.
+         *
+         * @return const index&
+         */
+        const index &indexed() const
+        {
+            if (where)
+                return *where;
+            std::call_once(index_once, [this]() { body_index = std::make_unique<index>(body, exposition::layout()); });
+            return *body_index;
+        }
+
+#ifdef WITH_ZSTD
+        /**
+         * @brief The body, in a format, as a zstd frame. Compressed once,
+         * by the first request that asks for it.
+         *
+         * @param f the format
+         * @return const std::string&
+         */
+        const std::string &zstd(formats::format f) const
+        {
+            std::call_once(zstd_once[(int)f], [this, f]() { compression::zstd_frame(encoded(f), zstd_body[(int)f]); });
+            return zstd_body[(int)f];
+        }
+#endif
+
+    private:
+        mutable std::once_flag encoded_once[formats::FORMATS];
+        mutable std::string encoded_body[formats::FORMATS];
+        mutable std::once_flag gzip_once[formats::FORMATS];
+        mutable compression::gzip_prefix gzip_body[formats::FORMATS];
+        mutable std::once_flag index_once;
+        mutable std::unique_ptr<index> body_index;
+#ifdef WITH_ZSTD
+        mutable std::once_flag zstd_once[formats::FORMATS];
+        mutable std::string zstd_body[formats::FORMATS];
+#endif
+    };
+
+    using snapshot_ptr = std::shared_ptr<const snapshot>;
+
+    /**
+     * @brief Called with a new snapshot, and the families of the samples
+     * it collected, while they are current, e.g to push them. Tiers kept
+     * from earlier collections are left out, as they were passed then.
+     */
+    using observer = std::function<void(const snapshot &, const exposition::families *const *, size_t)>;
+
+    /**
+     * @brief Collects and renders a new snapshot.
+     *
+     * @param engine the collection engine
+     * @param rendered called with the snapshot and its families, if set
+     * @return snapshot_ptr
+     */
+    inline snapshot_ptr collect(collector::engine &engine, const observer &rendered = nullptr)
+    {
+        std::lock_guard<std::mutex> guard(engine.exclusive());
+
+        // Size the body after the last one, so it doesn't grow while rendering.
+        auto snap = std::make_shared<snapshot>();
+        snap->body.reserve(engine.last_size());
+
+        exposition::writer w(snap->body);
+        w.raw("# prometheus data\n");
+        snap->result = engine.collect();
+
+        unsigned long long allocations = instrument::thread_allocations();
+        instrument::timer rendering(instrument::phase::render);
+        exposition::layout where;
+        engine.render(snap->body, &where);
+        rendering.stop();
+        snap->result.allocations += instrument::thread_allocations() - allocations;
+
+        exposition::families own;
+        own.add(own.get("gauge", "libvirt RPCs made by the collection.", "libvirt", "scrape_rpcs"))
+            .optional_label("hypervisor", engine.hypervisor())
+            .value(snap->result.rpcs);
+#ifdef COUNT_ALLOCATIONS
+        own.add(own.get("gauge", "Heap allocations made by the collection.", "libvirt", "scrape_allocations"))
+            .optional_label("hypervisor", engine.hypervisor())
+            .value(snap->result.allocations);
+#endif
+        own.render(snap->body, &where);
+        snap->where = std::make_unique<index>(snap->body, where);
+
+        engine.last_size() = snap->body.size();
+        snap->collected = std::chrono::steady_clock::now();
+        for (size_t g = 0; g < collector::GROUPS; g++)
+            snap->refreshed[g] = engine.refreshed(g);
+
+        if (rendered)
+        {
+            std::vector<const exposition::families *> sets;
+            engine.families(sets, true);
+            sets.push_back(&own);
+            rendered(*snap, sets.data(), sets.size());
+        }
+        return snap;
+    }
+
+    /**
+     * @brief Encodes the per-request tail of a response in a format, with
+     * the trailer of the format, as it comes last.
+     *
+     * @param f the format
+     * @param tail the tail, in the text format
+     * @return std::string
+     */
+    inline std::string encode_tail(formats::format f, std::string_view tail)
+    {
+        if (f == formats::format::text)
+            return std::string(tail);
+
+        std::string out;
+        formats::get(f).encode(tail, out);
+        out.append(formats::get(f).trailer);
+        return out;
+    }
+
+    /**
+     * @brief Renders a response body: the snapshot body followed by tail,
+     * in the given format and encoding. The snapshot's part is encoded, and
+     * compressed, only once, and is shared by the response rather than
+     * copied: it keeps the snapshot alive until it is sent.
+     *
+     * @param snap the snapshot
+     * @param f the format
+     * @param enc the content encoding
+     * @param tail per-request data, e.g the request counter, in the text format
+     * @param rsp the response, whose body is set
+     */
+    inline void render(const snapshot_ptr &snap, formats::format f, compression::encoding enc, std::string_view tail, http::response &rsp)
+    {
+        std::string encoded_tail = encode_tail(f, tail);
+        rsp.body.clear();
+
+        switch (enc)
+        {
+        case compression::encoding::gzip:
+            rsp.shared.emplace_back(snap, &snap->gzip(f).data);
+            compression::gzip_close(snap->gzip(f), encoded_tail, rsp.body);
+            break;
+#ifdef WITH_ZSTD
+        case compression::encoding::zstd:
+            rsp.shared.emplace_back(snap, &snap->zstd(f));
+            compression::zstd_frame(encoded_tail, rsp.body);
+            break;
+#endif
+        default:
+            rsp.shared.emplace_back(snap, &snap->encoded(f));
+            rsp.body = std::move(encoded_tail);
+            break;
+        }
+    }
+
+    /**
+     * @brief Renders a filtered response body: the samples of the snapshot
+     * the filter asks for, followed by tail, in the given format and encoding.
+     *
+     * @param snap the snapshot
+     * @param sel the filter
+     * @param f the format
+     * @param enc the content encoding
+     * @param tail per-request data, e.g the request counter, in the text format
+     * @param rsp the response, whose body is set
+     */
+    inline void render(const snapshot_ptr &snap, const selection::filter &sel, formats::format f, compression::encoding enc,
+                       std::string_view tail, http::response &rsp)
+    {
+        std::string body;
+        snap->indexed().render(sel, body);
+        if (f != formats::format::text)
+        {
+            std::string text;
+            text.swap(body);
+            formats::get(f).encode(text, body);
+        }
+        body.append(encode_tail(f, tail));
+
+        rsp.body.clear();
+        switch (enc)
+        {
+        case compression::encoding::gzip:
+            compression::gzip_finish(compression::gzip_begin(body), "", rsp.body);
+            break;
+#ifdef WITH_ZSTD
+        case compression::encoding::zstd:
+            compression::zstd_frame(body, rsp.body);
+            break;
+#endif
+        default:
+            rsp.body = std::move(body);
+            break;
+        }
+    }
+
+    /**
+     * @brief Merges the snapshots of several targets into one, family by
+     * family: one header, then the samples of each snapshot in turn, as
+     * their indexes lay them out. The comments, e.g # prometheus data, are
+     * taken from the first.
+     *
+     * @param parts the snapshots, NULL for a target without one
+     * @return snapshot_ptr NULL, if there is none
+     */
+    inline snapshot_ptr merge(const std::vector<snapshot_ptr> &parts)
+    {
+        auto snap = std::make_shared<snapshot>();
+        snap->collected = std::chrono::steady_clock::time_point::max();
+        std::fill(std::begin(snap->refreshed), std::end(snap->refreshed), std::chrono::steady_clock::time_point::max());
+        snap->result.refreshed = ~0u;
+
+        std::vector<const index *> indexes;
+        size_t size = 0;
+        for (const snapshot_ptr &part : parts)
+        {
+            if (!part)
+                continue;
+
+            indexes.push_back(&part->indexed());
+            size += part->body.size();
+            snap->result.domains += part->result.domains;
+            snap->result.records += part->result.records;
+            snap->result.rpcs += part->result.rpcs;
+            snap->result.samples += part->result.samples;
+            snap->result.allocations += part->result.allocations;
+            snap->result.refreshed &= part->result.refreshed;
+            snap->collected = std::min(snap->collected, part->collected);
+            for (size_t g = 0; g < collector::GROUPS; g++)
+                snap->refreshed[g] = std::min(snap->refreshed[g], part->refreshed[g]);
+        }
+
+        if (indexes.empty())
+            return NULL;
+
+        snap->body.reserve(size);
+        snap->where = std::make_unique<index>(snap->body, indexes);
+        return snap;
+    }
+
+    /**
+     * @brief Holds the latest snapshot. The collector publishes by
+     * swapping the pointer, readers take a reference to whatever is
+     * current (RCU-style); the old snapshot is freed by its last reader.
+     */
+    class store
+    {
+    public:
+        snapshot_ptr load() const
+        {
+#ifdef __cpp_lib_atomic_shared_ptr
+            return current.load(std::memory_order_acquire);
+#else
+            return std::atomic_load_explicit(&current, std::memory_order_acquire);
+#endif
+        }
+
+        /**
+         * @brief Returns a snapshot collected at or after since, collecting
+         * one if there is none. Only one collection runs at a time, requests
+         * that arrive while it runs wait for, and share, its result.
+         *
+         * The collection runs on a thread of its own. If it has not finished
+         * by the deadline, the last snapshot is returned and the collection
+         * keeps running, to publish when done (stale-while-revalidate).
+         *
+         * @param since the oldest acceptable collection
+         * @param deadline how long to wait, zero to wait until done
+         * @param collect makes a new snapshot
+         * @param stale set, if the deadline passed
+         * @return snapshot_ptr the snapshot, NULL if there is none yet
+         */
+        template <typename Fn>
+        snapshot_ptr refresh(std::chrono::steady_clock::time_point since, std::chrono::milliseconds deadline, Fn collect,
+                             bool &stale)
+        {
+            start(since, collect);
+            return wait(since, deadline, stale);
+        }
+
+        /**
+         * @brief Starts a collection, unless there is a snapshot collected at
+         * or after since, or a collection is running. Returns right away, so
+         * that the stores of several targets collect at the same time.
+         *
+         * @param since the oldest acceptable collection
+         * @param collect makes a new snapshot
+         */
+        template <typename Fn>
+        void start(std::chrono::steady_clock::time_point since, Fn collect)
+        {
+            std::lock_guard<std::mutex> guard(collecting);
+            if (fresh(since) || running)
+                return;
+
+            running = true;
+            std::thread([this, collect]() -> void {
+                snapshot_ptr snap = collect();
+                {
+                    std::lock_guard<std::mutex> guard(collecting);
+                    publish(snap);
+                    running = false;
+                }
+                published.notify_all();
+            }).detach();
+        }
+
+        /**
+         * @brief Waits for a snapshot collected at or after since, see start.
+         *
+         * @param since the oldest acceptable collection
+         * @param deadline how long after since to wait, zero to wait until done
+         * @param stale set, if the deadline passed
+         * @return snapshot_ptr the snapshot, NULL if there is none yet
+         */
+        snapshot_ptr wait(std::chrono::steady_clock::time_point since, std::chrono::milliseconds deadline, bool &stale)
+        {
+            std::unique_lock<std::mutex> guard(collecting);
+            stale = false;
+
+            if (deadline.count() <= 0)
+                published.wait(guard, [this, since]() { return fresh(since); });
+            else
+                stale = !published.wait_until(guard, since + deadline, [this, since]() { return fresh(since); });
+
+            return load();
+        }
+
+        void publish(snapshot_ptr snap)
+        {
+#ifdef __cpp_lib_atomic_shared_ptr
+            current.store(std::move(snap), std::memory_order_release);
+#else
+            std::atomic_store_explicit(&current, std::move(snap), std::memory_order_release);
+#endif
+        }
+
+    private:
+        bool fresh(std::chrono::steady_clock::time_point since) const
+        {
+            snapshot_ptr snap = load();
+            return snap && snap->collected >= since;
+        }
+
+        std::mutex collecting;
+        std::condition_variable published;
+        bool running = false;
+#ifdef __cpp_lib_atomic_shared_ptr
+        std::atomic<snapshot_ptr> current;
+#else
+        snapshot_ptr current;
+#endif
+    };
+}
+
+#endif
@@ -0,0 +1,588 @@
+#ifndef __TARGETS_HPP__
+#define __TARGETS_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fnmatch.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cache.hpp>
+#include <collector.hpp>
+#include <exposition.hpp>
+#include <live.hpp>
+#include <snapshot.hpp>
+#include <libvirt/libvirt.h>
+
+namespace targets
+{
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * @brief How the targets are connected to and collected, the same for
+     * each target. Each target keeps its own connections, retries and
+     * collections.
+     */
+    struct settings
+    {
+        // Connections per target, see collector::engine.
+        size_t shards = 1;
+        // Seconds between full listings of the active domains, 0 to list them on every collection.
+        unsigned int resync = 60;
+        // Seconds between background collections, 0 to collect on request.
+        unsigned int interval = 0;
+        // The longest wait between attempts to reconnect. The first retry is
+        // after a second, and the wait doubles from there.
+        std::chrono::seconds reconnect{60};
+        // Globs of the uris a request may ask for with ?target=, besides the configured ones.
+        std::vector<std::string> allowed;
+        // Targets requests may add, at most.
+        size_t max_targets = 16;
+        // Targets requests added are removed, once no request asked for them for this long.
+        std::chrono::seconds idle{600};
+        // Called with every background collection, and its families, as it is published, e.g to push it.
+        snapshot::observer published;
+    };
+
+    /**
+     * @brief The hypervisor label of a libvirt uri, its host, e.g
+     * qemu+ssh://root@host1:22/system => host1. A uri without a host, e.g
+     * qemu:///system, is its own label.
+     *
+     * @param uri the uri
+     * @return std::string
+     */
+    inline std::string hypervisor(const std::string &uri)
+    {
+        size_t scheme = uri.find("://");
+        if (scheme == std::string::npos)
+            return uri;
+
+        size_t start = scheme + 3;
+        std::string host = uri.substr(start, uri.find_first_of("/?", start) - start);
+
+        size_t at = host.rfind('@');
+        if (at != std::string::npos)
+            host.erase(0, at + 1);
+        if (!host.empty() && host[0] == '[')
+            host = host.substr(1, host.find(']') - 1);
+        else if (host.find(':') != std::string::npos)
+            host.erase(host.find(':'));
+
+        return host.empty() ? uri : host;
+    }
+
+    /**
+     * @brief Parses a target, [name=]uri, e.g host1=qemu+ssh://10.0.0.1/system.
+     * Without a name, the target is named after the host of the uri.
+     *
+     * @param spec the target
+     * @return std::pair<std::string, std::string> the name and uri
+     */
+    inline std::pair<std::string, std::string> parse(const std::string &spec)
+    {
+        size_t eq = spec.find('=');
+        if (eq != std::string::npos && eq < spec.find(':'))
+            return {spec.substr(0, eq), spec.substr(eq + 1)};
+
+        return {hypervisor(spec), spec};
+    }
+
+    /**
+     * @brief A hypervisor, collected over connections of its own. A
+     * connection that can't be opened, or that drops, is retried with
+     * exponential backoff; in the meantime, the collections of the target
+     * are empty.
+     */
+    class target
+    {
+    public:
+        /**
+         * @brief Sets up the target, without connecting.
+         *
+         * @param name the name, and hypervisor label
+         * @param uri the libvirt uri
+         * @param opts what to collect
+         * @param s the settings, outlive the target
+         * @param labelled whether the samples are labelled with the hypervisor
+         */
+        target(std::string name, std::string uri, const collector::options &opts, const settings &s, bool labelled)
+            : label(std::move(name)), address(std::move(uri)), opts(opts), s(s)
+        {
+            if (labelled)
+                this->opts.hypervisor = label;
+        }
+
+        target(const target &) = delete;
+        target &operator=(const target &) = delete;
+
+        ~target()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            disconnect();
+        }
+
+        const std::string &name() const
+        {
+            return label;
+        }
+
+        const std::string &uri() const
+        {
+            return address;
+        }
+
+        /**
+         * @brief The hypervisor label of the samples, empty for none.
+         *
+         * @return const std::string&
+         */
+        const std::string &hypervisor() const
+        {
+            return opts.hypervisor;
+        }
+
+        /**
+         * @brief The latest collection.
+         *
+         * @return snapshot::store&
+         */
+        snapshot::store &latest()
+        {
+            return store;
+        }
+
+        /**
+         * @brief Stops the threads of the target, e.g as it is removed.
+         */
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> guard(stopping);
+                stopped = true;
+            }
+            wakeup.notify_all();
+        }
+
+        /**
+         * @brief Sleeps, for the threads of the target, until the time, or
+         * until it is stopped.
+         *
+         * @param until the time
+         * @return bool false if stopped
+         */
+        bool sleep_until(clock::time_point until)
+        {
+            std::unique_lock<std::mutex> guard(stopping);
+            return !wakeup.wait_until(guard, until, [this]() { return stopped; });
+        }
+
+        /**
+         * @brief Opens the connections, unless they are open, or the next
+         * attempt is not due yet.
+         *
+         * @return bool whether connected
+         */
+        bool connect()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return reconnect();
+        }
+
+        bool connected() const
+        {
+            return up.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Collects a new snapshot, reconnecting first if due. The
+         * snapshot is empty, while the target is not connected.
+         *
+         * @param rendered called with the snapshot and its families, if set
+         * @return snapshot::snapshot_ptr
+         */
+        snapshot::snapshot_ptr collect(const snapshot::observer &rendered = nullptr)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            // Events stopped with the connection, so the cache can't be trusted.
+            if (engine && closed.load(std::memory_order_acquire))
+            {
+                fprintf(stderr, "%s: connection to %s closed\n", label.c_str(), address.c_str());
+                disconnect();
+            }
+
+            if (!reconnect())
+            {
+                auto snap = std::make_shared<snapshot::snapshot>();
+                snap->collected = clock::now();
+                return snap;
+            }
+
+            snapshot::snapshot_ptr snap = snapshot::collect(*engine, rendered);
+
+            // e.g libvirtd restarted, the next collection reconnects.
+            if (closed.load(std::memory_order_acquire) || virConnectIsAlive(engine->primary()) != 1)
+            {
+                fprintf(stderr, "%s: connection to %s lost\n", label.c_str(), address.c_str());
+                disconnect();
+                backoff(clock::now());
+            }
+            return snap;
+        }
+
+        /**
+         * @brief Lists the active domains, to resync the domain set.
+         */
+        void resync()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (engine && active.tracking() && active.resync(engine->primary()) < 0)
+                fprintf(stderr, "%s: failed to resync domains: %s\n", label.c_str(), virGetLastErrorMessage());
+        }
+
+        /**
+         * @brief When the next collection is due, in the background.
+         *
+         * @return clock::time_point
+         */
+        clock::time_point next_due()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return engine ? engine->next_due() : retry;
+        }
+
+        /**
+         * @brief Adds the metrics of the target.
+         *
+         * @param f the families to add to, shared by every target
+         */
+        void render(exposition::families &f) const
+        {
+            f.add(f.get("gauge", "Whether the connections to the target are open.", "libvirt", "target_up"))
+                .optional_label("hypervisor", opts.hypervisor)
+                .value(connected() ? 1 : 0);
+            f.add(f.get("counter", "Failed attempts to connect to the target.", "libvirt", "target_connect_failures_total"))
+                .optional_label("hypervisor", opts.hypervisor)
+                .value(failures.load(std::memory_order_relaxed));
+            active.render(f, opts.hypervisor);
+        }
+
+    private:
+        bool reconnect()
+        {
+            if (engine)
+                return true;
+
+            clock::time_point now = clock::now();
+            if (now < retry)
+                return false;
+
+            try
+            {
+                engine = std::make_unique<collector::engine>(address.c_str(), s.shards, opts, domains);
+            }
+            catch (const std::runtime_error &e)
+            {
+                failures++;
+                backoff(now);
+                fprintf(stderr, "%s: %s, retrying in %llds\n", label.c_str(), e.what(), (long long)wait.count());
+                return false;
+            }
+            wait = std::chrono::seconds(0);
+            up.store(true, std::memory_order_relaxed);
+
+            // The events are registered again, on the next connection.
+            closed.store(false, std::memory_order_release);
+            if (virConnectRegisterCloseCallback(engine->primary(), on_close, this, NULL) < 0)
+                fprintf(stderr, "%s: failed to register close callback: %s\n", label.c_str(), virGetLastErrorMessage());
+
+            // Domain events invalidate the metadata cache.
+            if (domains.register_events(engine->primary()) < 0)
+                fprintf(stderr, "%s: failed to register domain events, metadata is not cached: %s\n", label.c_str(),
+                        virGetLastErrorMessage());
+
+            // Domain events keep the set of active domains, so collections don't list them.
+            if (s.resync > 0)
+            {
+                if (active.register_events(engine->primary()) < 0)
+                    fprintf(stderr, "%s: failed to follow domain events, domains are listed on every collection: %s\n",
+                            label.c_str(), virGetLastErrorMessage());
+                else
+                    engine->follow(active);
+            }
+            return true;
+        }
+
+        /**
+         * @brief Called from the event loop, when the primary connection
+         * closes, e.g libvirtd restarted. The next collection reconnects,
+         * and registers the events on the new connection.
+         */
+        static void on_close(virConnectPtr, int, void *opaque)
+        {
+            ((target *)opaque)->closed.store(true, std::memory_order_release);
+        }
+
+        void disconnect()
+        {
+            // Deregistered, while the connection is still open.
+            if (engine)
+                virConnectUnregisterCloseCallback(engine->primary(), on_close);
+            active.deregister_events();
+            domains.deregister_events();
+            engine.reset();
+            up.store(false, std::memory_order_relaxed);
+        }
+
+        void backoff(clock::time_point now)
+        {
+            wait = std::clamp(wait * 2, std::chrono::seconds(1), std::max(s.reconnect, std::chrono::seconds(1)));
+            retry = now + wait;
+        }
+
+        std::string label;
+        std::string address;
+        collector::options opts;
+        const settings &s;
+
+        std::mutex lock;
+        cache::domain_cache domains;
+        live::domain_set active;
+        std::unique_ptr<collector::engine> engine;
+        snapshot::store store;
+
+        std::atomic<bool> up{false};
+        std::atomic<bool> closed{false};
+
+        std::mutex stopping;
+        std::condition_variable wakeup;
+        bool stopped = false;
+        std::atomic<unsigned long long> failures{0};
+        std::chrono::seconds wait{0};
+        clock::time_point retry;
+    };
+
+    /**
+     * @brief The targets: the configured ones, and those requests asked for
+     * with ?target=, if allowed. Each target gets a thread that resyncs its
+     * domain set, and with an interval, a thread that collects it in the
+     * background; a slow target holds up only its own threads. Targets
+     * added by requests are bounded in number, and removed once idle; a
+     * request holds on to the targets it picked, until it is done.
+     */
+    class table
+    {
+    public:
+        table(const collector::options &opts, const settings &s) : opts(opts), s(s)
+        {
+        }
+
+        ~table()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (entry &e : all)
+                e.t->stop();
+        }
+
+        /**
+         * @brief Adds a configured target. Its threads are started by begin().
+         *
+         * @param name the name, and hypervisor label
+         * @param uri the libvirt uri
+         * @param labelled whether the samples are labelled with the hypervisor
+         * @return target&
+         * @throws std::invalid_argument if the name is taken
+         */
+        target &add(const std::string &name, const std::string &uri, bool labelled)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (find(name) != all.end())
+                throw std::invalid_argument("duplicate target: " + name);
+
+            auto t = std::make_shared<target>(name, uri, opts, s, labelled);
+            all.push_back({t, false, clock::now()});
+            configured.push_back(t);
+            return *t;
+        }
+
+        /**
+         * @brief Starts the threads of the configured targets. Collected in
+         * the background, each is collected and published once first, all at
+         * once, so that the first scrapes get data.
+         */
+        void begin()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (s.interval > 0)
+            {
+                std::vector<std::thread> first;
+                for (const std::shared_ptr<target> &t : configured)
+                    first.emplace_back([&t, &s = s]() { collect(*t, s); });
+                for (std::thread &thread : first)
+                    thread.join();
+            }
+
+            for (const std::shared_ptr<target> &t : configured)
+                start(t);
+        }
+
+        /**
+         * @brief The targets a request asks for, by name or uri, the configured
+         * ones if none. A uri that is allowed is added on first use.
+         *
+         * @param wanted the names or uris
+         * @param out the targets
+         * @throws std::invalid_argument for a target that is neither known nor
+         * allowed, or past settings::max_targets
+         */
+        void pick(const std::vector<std::string> &wanted, std::vector<std::shared_ptr<target>> &out)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (wanted.empty())
+            {
+                out = configured;
+                return;
+            }
+
+            clock::time_point now = clock::now();
+            evict(now);
+
+            for (const std::string &name : wanted)
+            {
+                auto e = find(name);
+                if (e == all.end() && allowed(name))
+                {
+                    if (added >= s.max_targets)
+                        throw std::invalid_argument("too many targets: " + name);
+
+                    // Named after its host, unless that is taken.
+                    std::string label = hypervisor(name);
+                    auto t = std::make_shared<target>(find(label) == all.end() ? label : name, name, opts, s, true);
+                    all.push_back({t, true, now});
+                    added++;
+                    start(t);
+                    e = all.end() - 1;
+                }
+                if (e == all.end())
+                    throw std::invalid_argument("unknown target: " + name);
+
+                e->used = now;
+                if (std::find(out.begin(), out.end(), e->t) == out.end())
+                    out.push_back(e->t);
+            }
+        }
+
+        /**
+         * @brief The snapshots of several targets, merged. The last merge is
+         * kept, while its parts are current, e.g so that it is compressed once.
+         *
+         * @param parts the snapshots
+         * @return snapshot::snapshot_ptr
+         */
+        snapshot::snapshot_ptr merge(const std::vector<snapshot::snapshot_ptr> &parts)
+        {
+            std::lock_guard<std::mutex> guard(merging);
+            if (parts != merged_parts || !merged)
+            {
+                merged = snapshot::merge(parts);
+                merged_parts = parts;
+            }
+            return merged;
+        }
+
+    private:
+        struct entry
+        {
+            std::shared_ptr<target> t;
+            // Added by a request, rather than configured.
+            bool dynamic;
+            clock::time_point used;
+        };
+
+        std::deque<entry>::iterator find(const std::string &name)
+        {
+            return std::find_if(all.begin(), all.end(), [&name](const entry &e) { return e.t->name() == name || e.t->uri() == name; });
+        }
+
+        bool allowed(const std::string &uri) const
+        {
+            // A * doesn't match a /, so a glob admits hosts, not arbitrary paths.
+            for (const std::string &glob : s.allowed)
+            {
+                if (fnmatch(glob.c_str(), uri.c_str(), FNM_PATHNAME) == 0)
+                    return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief Removes the targets requests added, that no request asked
+         * for within settings::idle. Their threads stop, and the connections
+         * close with the last request that holds on to them.
+         */
+        void evict(clock::time_point now)
+        {
+            for (auto e = all.begin(); e != all.end();)
+            {
+                if (e->dynamic && now - e->used > s.idle)
+                {
+                    fprintf(stderr, "%s: idle, removed\n", e->t->name().c_str());
+                    e->t->stop();
+                    e = all.erase(e);
+                    added--;
+                }
+                else
+                    ++e;
+            }
+        }
+
+        static void collect(target &t, const settings &s)
+        {
+            t.latest().publish(t.collect(s.published));
+        }
+
+        void start(const std::shared_ptr<target> &t)
+        {
+            if (s.resync > 0)
+            {
+                std::thread([t, resync = s.resync]() -> void {
+                    while (t->sleep_until(clock::now() + std::chrono::seconds(resync)))
+                        t->resync();
+                }).detach();
+            }
+
+            // In the background, requests never wait for libvirt. The thread
+            // wakes up for each tier of stat groups, and at least every interval.
+            if (s.interval > 0)
+            {
+                std::thread([t, &s = s]() -> void {
+                    while (!t->latest().load() || t->sleep_until(std::min(t->next_due(), clock::now() + std::chrono::seconds(s.interval))))
+                        collect(*t, s);
+                }).detach();
+            }
+        }
+
+        const collector::options &opts;
+        const settings &s;
+
+        std::mutex lock;
+        std::deque<entry> all;
+        std::vector<std::shared_ptr<target>> configured;
+        size_t added = 0;
+
+        std::mutex merging;
+        std::vector<snapshot::snapshot_ptr> merged_parts;
+        snapshot::snapshot_ptr merged;
+    };
+}
+
+#endif
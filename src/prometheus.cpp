@@ -11,20 +11,48 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <new>
+#include <cstdlib>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
 #include <unistd.h>
+#include <time.h>
+#include <getopt.h>
 #include <format.hpp>
+#include <http.hpp>
+#include <compression.hpp>
+#include <exposition.hpp>
 #include <serializers.hpp>
+#include <collector.hpp>
+#include <cache.hpp>
+#include <snapshot.hpp>
+#include <instrument.hpp>
+#include <live.hpp>
+#include <selection.hpp>
+#include <targets.hpp>
+#include <remote.hpp>
 #include <libvirt/libvirt.h>
 
-#define MAX_EVENTS 10
-#define BACKLOG 10
+#define MAX_EVENTS 64
+#define BACKLOG 128
+#define IDLE_TIMEOUT 60
+#define DRAIN_TIMEOUT 10
+#define MAX_IOV 64
 
 /**
  * @brief setnonblocking
@@ -65,28 +93,219 @@ void setflags(int sock)
 }
 
 /**
- * @brief stream_server
- * This is an event-based, stack-based stream-server. It basically,
- * just spews any data onto a callable, with a FD-on it.
- * @param port the port to listen on
- * @param fnc the callback
- * @return int
+ * @brief server_options
+ * How many event loops serve the port, and how they are sized.
+ */
+struct server_options
+{
+    int workers = 1;
+    int backlog = BACKLOG;
+    int max_events = MAX_EVENTS;
+    size_t zerocopy = 0;
+};
+
+using handler = std::function<http::response(const http::request &)>;
+
+/**
+ * @brief connection
+ * The state of a client connection: what is received but not yet parsed,
+ * the buffers queued but not yet sent, and those lent to the kernel by
+ * MSG_ZEROCOPY sends, that are kept until it is done with them.
+ */
+struct connection
+{
+    std::string in;
+    std::deque<http::buffer> out;
+    size_t sent = 0;
+    std::deque<std::pair<uint32_t, http::buffer>> lent;
+    uint32_t sends = 0;
+    size_t zerocopy = 0;
+    bool closing = false;
+    bool writing = false;
+    bool draining = false;
+    time_t active = 0;
+};
+
+/**
+ * @brief queue
+ * Queues a buffer the connection owns, e.g the headers of a response.
+ *
+ * @param conn the connection
+ * @param data the buffer
+ */
+void queue(connection &conn, std::string &&data)
+{
+    if (!data.empty())
+        conn.out.push_back(std::make_shared<const std::string>(std::move(data)));
+}
+
+/**
+ * @brief queue
+ * Queues a response: its headers, then its body, without copying it. HEAD
+ * gets the headers, of what GET would get.
+ *
+ * @param conn the connection
+ * @param rsp the response
+ * @param keep_alive whether the connection is kept open
+ * @param head whether the request was a HEAD
  */
+void queue(connection &conn, http::response &rsp, bool keep_alive, bool head)
+{
+    queue(conn, custom::generate_head(rsp.status, rsp.size(), "HTTP/1.1", keep_alive, rsp.content_type, rsp.content_encoding));
+    if (head)
+        return;
+
+    for (http::buffer &b : rsp.shared)
+    {
+        if (!b->empty())
+            conn.out.push_back(std::move(b));
+    }
+    queue(conn, std::move(rsp.body));
+}
+
+/**
+ * @brief flush
+ * Sends as much of the queued output, as the socket takes, up to MAX_IOV
+ * buffers a call. Sends of at least conn.zerocopy bytes are MSG_ZEROCOPY,
+ * and their buffers are lent until the kernel completes them.
+ *
+ * @param fd the socket
+ * @param conn the connection
+ * @return int -1 on error, 0 if everything was sent, 1 if more is pending
+ */
+int flush(int fd, connection &conn)
+{
+    if (conn.out.empty())
+        return 0;
 
-int stream_server(int port, std::function<void(int)> fnc)
+    instrument::timer sending(instrument::phase::send);
+    bool copy = conn.zerocopy == 0;
+    while (!conn.out.empty())
+    {
+        struct iovec iov[MAX_IOV];
+        size_t count = 0, bytes = 0, skip = conn.sent;
+        for (const http::buffer &b : conn.out)
+        {
+            if (count == MAX_IOV)
+                break;
+            iov[count].iov_base = (void *)(b->data() + skip);
+            iov[count].iov_len = b->size() - skip;
+            bytes += iov[count++].iov_len;
+            skip = 0;
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        bool lending = !copy && bytes >= conn.zerocopy;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | (lending ? MSG_ZEROCOPY : 0));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            // Out of memory to pin pages for, so copy instead.
+            if (errno == ENOBUFS && lending)
+            {
+                copy = true;
+                continue;
+            }
+            return -1;
+        }
+        instrument::sent_bytes.add(n);
+
+        if (lending)
+        {
+            for (size_t i = 0; i < count; i++)
+                conn.lent.emplace_back(conn.sends, conn.out[i]);
+            conn.sends++;
+        }
+
+        size_t left = n;
+        while (left > 0)
+        {
+            size_t rest = conn.out.front()->size() - conn.sent;
+            if (left < rest)
+            {
+                conn.sent += left;
+                break;
+            }
+            left -= rest;
+            conn.out.pop_front();
+            conn.sent = 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief reap
+ * Reads the completions of MSG_ZEROCOPY sends from the error queue, and
+ * releases the buffers they were lent.
+ *
+ * @param fd the socket
+ * @param conn the connection
+ * @return bool false if the socket has a pending error
+ */
+bool reap(int fd, connection &conn)
 {
-    struct epoll_event ev, events[MAX_EVENTS];
-    int sockfd, epollfd, n;
+    while (true)
+    {
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+            break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            const struct sock_extended_err *err = (const struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                continue;
+
+            // Sends ee_info to ee_data are done, the counter may wrap.
+            uint32_t lo = err->ee_info, hi = err->ee_data;
+            conn.lent.erase(std::remove_if(conn.lent.begin(), conn.lent.end(),
+                                           [lo, hi](const std::pair<uint32_t, http::buffer> &l) { return l.first - lo <= hi - lo; }),
+                            conn.lent.end());
+        }
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+}
+
+/**
+ * @brief listen_socket
+ * Opens a non-blocking listening socket. SO_REUSEPORT is set before
+ * bind(), so every worker can bind its own socket to the same port, and
+ * the kernel spreads connections across them.
+ * @param port the port to listen on
+ * @param backlog the listen backlog
+ * @return int the socket
+ */
+int listen_socket(int port, int backlog)
+{
+    int sockfd;
     struct sockaddr_in serv_addr; /* my address information */
 
-    /* Code to set up listening socket, 'listen_sock',
-       (socket(), bind(), listen()) omitted. */
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
     {
         perror("socket");
         exit(1);
     }
 
+    setflags(sockfd);
+    setnonblocking(sockfd);
+
     serv_addr.sin_family = AF_INET;         /* host byte order */
     serv_addr.sin_port = htons(port);       /* short, network byte order */
     serv_addr.sin_addr.s_addr = INADDR_ANY; /* auto-fill with my IP */
@@ -98,14 +317,32 @@ int stream_server(int port, std::function<void(int)> fnc)
         exit(1);
     }
 
-    setflags(sockfd);
-
-    if (listen(sockfd, BACKLOG) == -1)
+    if (listen(sockfd, backlog) == -1)
     {
         perror("listen");
         exit(1);
     }
 
+    return sockfd;
+}
+
+/**
+ * @brief serve
+ * This is an event-based HTTP/1.1 event loop. Requests are parsed per
+ * connection, handed to the callable, and the responses are queued and
+ * written as the socket allows. Connections are kept alive, unless the
+ * client asks otherwise.
+ * @param sockfd the listening socket
+ * @param sopts the server options
+ * @param fnc the callback
+ */
+void serve(int sockfd, const server_options &sopts, const handler &fnc)
+{
+    struct epoll_event ev;
+    std::vector<struct epoll_event> events(sopts.max_events);
+    int epollfd, n;
+    std::unordered_map<int, connection> connections;
+
     /* epoll*/
     epollfd = epoll_create1(0);
     if (epollfd == -1)
@@ -122,51 +359,306 @@ int stream_server(int port, std::function<void(int)> fnc)
         exit(EXIT_FAILURE);
     }
 
+    // A connection with buffers lent to the kernel is closed, once it is done with them.
+    auto disconnect = [&connections](int fd) -> void {
+        auto it = connections.find(fd);
+        if (it != connections.end() && !it->second.lent.empty())
+        {
+            it->second.draining = true;
+            it->second.active = time(NULL);
+            it->second.in.clear();
+            it->second.out.clear();
+            shutdown(fd, SHUT_RD);
+            return;
+        }
+        connections.erase(fd);
+        close(fd);
+    };
+
+    // (Re)arms a connection, for reading, and writing when output is pending.
+    auto arm = [&epollfd](int fd, connection &conn, bool writing) -> bool {
+        if (conn.writing == writing)
+            return true;
+
+        struct epoll_event cev;
+        cev.events = EPOLLIN | EPOLLET | (writing ? (uint32_t)EPOLLOUT : 0);
+        cev.data.fd = fd;
+        conn.writing = writing;
+        return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &cev) != -1;
+    };
+
+    time_t swept = time(NULL);
+
     while (true)
     {
-        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        int nfds = epoll_wait(epollfd, events.data(), events.size(), 1000);
         if (nfds == -1)
         {
+            if (errno == EINTR)
+                continue;
             perror("epoll_wait");
             exit(EXIT_FAILURE);
         }
 
+        time_t now = time(NULL);
+
         for (n = 0; n < nfds; ++n)
         {
             if (events[n].data.fd == sockfd)
             {
-                socklen_t addrlen;
-                struct sockaddr_in client_addr; /* my address information */
+                while (true)
+                {
+                    struct sockaddr_in client_addr; /* my address information */
+                    socklen_t addrlen = sizeof(client_addr);
+
+                    int conn_sock = accept(sockfd, (struct sockaddr *)&client_addr, &addrlen);
+                    if (conn_sock == -1)
+                    {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                            fprintf(stderr, "accept: %s\n", strerror(errno));
+                        break;
+                    }
+
+                    setnonblocking(conn_sock);
+                    ev.events = EPOLLIN | EPOLLET;
+                    ev.data.fd = conn_sock;
+                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock,
+                                  &ev) == -1)
+                    {
+                        perror("epoll_ctl: conn_sock");
+                        close(conn_sock);
+                        continue;
+                    }
 
-                int conn_sock = accept(events[n].data.fd,
-                                       (struct sockaddr *)&client_addr, &addrlen);
-                if (conn_sock == -1)
+                    connection &conn = connections[conn_sock];
+                    conn.active = now;
+
+                    int optval = 1;
+                    if (sopts.zerocopy > 0 && setsockopt(conn_sock, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(optval)) == 0)
+                        conn.zerocopy = sopts.zerocopy;
+                }
+                continue;
+            }
+
+            int fd = events[n].data.fd;
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+
+            connection &conn = it->second;
+
+            // Completions of zerocopy sends are on the error queue, too.
+            if (conn.draining)
+            {
+                reap(fd, conn);
+                if (conn.lent.empty())
+                    disconnect(fd);
+                continue;
+            }
+            conn.active = now;
+
+            if (events[n].events & (EPOLLERR | EPOLLHUP))
+            {
+                if ((events[n].events & EPOLLHUP) || conn.zerocopy == 0 || !reap(fd, conn))
                 {
-                    fprintf(stderr, "accept: %s\n", strerror(errno));
-                    exit(EXIT_FAILURE);
+                    disconnect(fd);
+                    continue;
                 }
+            }
 
-                setnonblocking(conn_sock);
-                ev.events = EPOLLIN | EPOLLET;
-                ev.data.fd = conn_sock;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock,
-                              &ev) == -1)
+            // Edge-triggered, so drain the socket. At most a request's worth
+            // is buffered: what is past it is read once that is answered.
+            std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+            bool eof = false;
+            bool full = true;
+            while (full && !conn.closing)
+            {
+                full = false;
+                if (events[n].events & EPOLLIN)
                 {
-                    perror("epoll_ctl: conn_sock");
-                    exit(EXIT_FAILURE);
+                    char buffer[4096];
+                    while (!(full = conn.in.size() > MAX_REQUEST))
+                    {
+                        ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+                        if (bytes > 0)
+                        {
+                            conn.in.append(buffer, bytes);
+                            continue;
+                        }
+
+                        if (bytes == 0)
+                            eof = true;
+                        else if (errno == EINTR)
+                            continue;
+                        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            eof = true;
+                        break;
+                    }
                 }
+
+                // Answer every complete request, in order.
+                size_t parsed = 0;
+                while (!conn.closing)
+                {
+                    http::request req;
+                    req.received = received;
+                    size_t consumed = 0;
+                    http::parse_result res = http::parse(std::string_view(conn.in).substr(parsed), req, consumed);
+
+                    if (res == http::parse_result::incomplete)
+                    {
+                        if (conn.in.size() - parsed > MAX_REQUEST)
+                        {
+                            queue(conn, custom::generate_prometheus("request too large\n", 431));
+                            conn.closing = true;
+                        }
+                        break;
+                    }
+
+                    if (res == http::parse_result::invalid)
+                    {
+                        queue(conn, custom::generate_prometheus("bad request\n", 400));
+                        conn.closing = true;
+                        break;
+                    }
+
+                    http::response rsp;
+                    if (req.method != "GET" && req.method != "HEAD")
+                    {
+                        rsp.status = 405;
+                        rsp.body = "method not allowed\n";
+                    }
+                    else
+                    {
+                        rsp = fnc(req);
+                    }
+
+                    queue(conn, rsp, req.keep_alive, req.method == "HEAD");
+                    conn.closing = !req.keep_alive;
+                    parsed += consumed;
+                }
+                conn.in.erase(0, parsed);
             }
-            else
+
+            int pending = flush(fd, conn);
+            if (pending < 0 || (pending == 0 && (conn.closing || eof)))
             {
-                // We have data, to read -
-                // send messages, if any. We use a proxy to avoid refencing local/stack-variables and
-                // to avoid the heap.
-                fnc(events[n].data.fd);
+                disconnect(fd);
+                continue;
+            }
+
+            // A half-closed client still gets, what is queued.
+            if (eof && pending > 0)
+                conn.closing = true;
+
+            if (!arm(fd, conn, pending > 0))
+                disconnect(fd);
+        }
+
+        // Close connections, that have been idle for too long, and those
+        // the kernel hasn't given the lent buffers back to in time, e.g as
+        // the client stopped acknowledging: the pages it pinned stay with it.
+        if (now != swept)
+        {
+            swept = now;
+            std::vector<int> expired;
+            for (const auto &[fd, conn] : connections)
+            {
+                if (now - conn.active > (conn.draining ? DRAIN_TIMEOUT : IDLE_TIMEOUT))
+                    expired.push_back(fd);
+            }
+
+            for (int fd : expired)
+            {
+                if (connections[fd].draining)
+                {
+                    connections.erase(fd);
+                    close(fd);
+                }
+                else
+                    disconnect(fd);
             }
         }
     }
 }
 
+/**
+ * @brief stream_server
+ * Serves the port from a number of worker threads, each with its own
+ * listening socket and event loop.
+ * @param port the port to listen on
+ * @param sopts the server options
+ * @param fnc the callback, called concurrently from the workers
+ * @return int
+ */
+int stream_server(int port, const server_options &sopts, handler fnc)
+{
+    std::vector<std::thread> workers;
+
+    // Bind every socket up front, so a failure stops us right away.
+    std::vector<int> sockets;
+    for (int i = 0; i < sopts.workers; i++)
+        sockets.push_back(listen_socket(port, sopts.backlog));
+
+    for (int i = 1; i < sopts.workers; i++)
+        workers.emplace_back(serve, sockets[i], std::cref(sopts), std::cref(fnc));
+
+    serve(sockets[0], sopts, fnc);
+
+    for (std::thread &worker : workers)
+        worker.join();
+
+    return 0;
+}
+
+#ifdef COUNT_ALLOCATIONS
+/**
+ * @brief Counts heap allocations per thread, for libvirt_scrape_allocations.
+ */
+void *operator new(size_t size)
+{
+    instrument::thread_allocations()++;
+    if (void *p = malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+#endif
+
+/**
+ * @brief Prints the command-line syntax.
+ *
+ * @param name the program name
+ */
+void usage(const char *name)
+{
+    fprintf(stderr, "syntax: %s: [--stats=vcpu,interface,block] [--refresh=group=seconds,...] [--aggregate=groups] [--detail-domains=globs] [--detail-tenants=uuids] [--rates] [--interval=seconds] [--workers=n] [--backlog=n] [--max-events=n] [--zerocopy=bytes] [--shards=n] [--deadline=ms] [--resync=seconds] [--reconnect=seconds] [--allow-targets=globs] [--max-targets=n] [--remote-write=url] [--remote-write-queue=n] http-port [name=]libvirt-uri...\n", name);
+}
+
+/**
+ * @brief Reports an option value that is not a number.
+ *
+ * @param name the program name
+ * @param option the option
+ * @param value its value
+ * @return int the exit status
+ */
+int invalid(const char *name, const char *option, const char *value)
+{
+    fprintf(stderr, "invalid %s: %s\n", option, value);
+    usage(name);
+    return 1;
+}
+
 /**
  * @brief Main entry point
  *
@@ -176,120 +668,375 @@ int stream_server(int port, std::function<void(int)> fnc)
  */
 int main(int argc, char **argv)
 {
-    long long requests = 0;
+    std::atomic<long long> requests{0};
+    std::atomic<unsigned long long> response_bytes[3] = {};
+    std::atomic<unsigned long long> responses[3] = {};
+    collector::options opts;
+    server_options sopts;
+    targets::settings tsettings;
+    std::chrono::milliseconds deadline{0};
+    std::atomic<unsigned long long> timeouts{0};
+    remote::options ropts;
+    std::unique_ptr<remote::writer> pusher;
+
+    static struct option long_options[] = {
+        {"stats", required_argument, 0, 's'},
+        {"refresh", required_argument, 0, 'f'},
+        {"aggregate", required_argument, 0, 'a'},
+        {"detail-domains", required_argument, 0, 'D'},
+        {"detail-tenants", required_argument, 0, 'T'},
+        {"rates", no_argument, 0, 'p'},
+        {"interval", required_argument, 0, 'i'},
+        {"workers", required_argument, 0, 'w'},
+        {"backlog", required_argument, 0, 'b'},
+        {"max-events", required_argument, 0, 'e'},
+        {"zerocopy", required_argument, 0, 'z'},
+        {"shards", required_argument, 0, 'n'},
+        {"deadline", required_argument, 0, 'd'},
+        {"resync", required_argument, 0, 'r'},
+        {"reconnect", required_argument, 0, 'R'},
+        {"allow-targets", required_argument, 0, 'A'},
+        {"max-targets", required_argument, 0, 'M'},
+        {"remote-write", required_argument, 0, 'W'},
+        {"remote-write-queue", required_argument, 0, 'Q'},
+        {0, 0, 0, 0}};
+
+    int c;
+    unsigned long number;
+    while ((c = getopt_long(argc, argv, "s:f:a:D:T:pi:w:b:e:z:n:d:r:R:A:M:W:Q:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            try
+            {
+                opts.stats = collector::parse_stats(optarg);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                fprintf(stderr, "%s\n", e.what());
+                return 1;
+            }
+            break;
+        case 'f':
+            try
+            {
+                collector::parse_refresh(optarg, opts);
+            }
+            catch (const std::logic_error &e)
+            {
+                fprintf(stderr, "invalid --refresh: %s\n", e.what());
+                return 1;
+            }
+            break;
+        case 'a':
+            try
+            {
+                collector::parse_aggregate(optarg, opts);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                fprintf(stderr, "invalid --aggregate: %s\n", e.what());
+                return 1;
+            }
+            break;
+        case 'D':
+            for (const std::string &glob : custom::split(optarg, ","))
+                opts.aggregate.domains.push_back(glob);
+            break;
+        case 'T':
+            for (const std::string &tenant : custom::split(optarg, ","))
+                opts.aggregate.tenants.push_back(tenant);
+            break;
+        case 'p':
+            opts.rates = true;
+            break;
+        case 'i':
+            if (!custom::parse_number(optarg, tsettings.interval))
+                return invalid(argv[0], "--interval", optarg);
+            break;
+        case 'w':
+            if (!custom::parse_number(optarg, sopts.workers) || sopts.workers < 1)
+                return invalid(argv[0], "--workers", optarg);
+            break;
+        case 'b':
+            if (!custom::parse_number(optarg, sopts.backlog) || sopts.backlog < 1)
+                return invalid(argv[0], "--backlog", optarg);
+            break;
+        case 'e':
+            if (!custom::parse_number(optarg, sopts.max_events) || sopts.max_events < 1)
+                return invalid(argv[0], "--max-events", optarg);
+            break;
+        case 'z':
+            if (!custom::parse_number(optarg, sopts.zerocopy))
+                return invalid(argv[0], "--zerocopy", optarg);
+            break;
+        case 'n':
+            if (!custom::parse_number(optarg, tsettings.shards) || tsettings.shards == 0)
+                return invalid(argv[0], "--shards", optarg);
+            break;
+        case 'd':
+            if (!custom::parse_number(optarg, number))
+                return invalid(argv[0], "--deadline", optarg);
+            deadline = std::chrono::milliseconds(number);
+            break;
+        case 'r':
+            if (!custom::parse_number(optarg, tsettings.resync))
+                return invalid(argv[0], "--resync", optarg);
+            break;
+        case 'R':
+            if (!custom::parse_number(optarg, number))
+                return invalid(argv[0], "--reconnect", optarg);
+            tsettings.reconnect = std::chrono::seconds(number);
+            break;
+        case 'A':
+            for (const std::string &glob : custom::split(optarg, ","))
+                tsettings.allowed.push_back(glob);
+            break;
+        case 'M':
+            if (!custom::parse_number(optarg, tsettings.max_targets))
+                return invalid(argv[0], "--max-targets", optarg);
+            break;
+        case 'W':
+            ropts.url = optarg;
+            break;
+        case 'Q':
+            if (!custom::parse_number(optarg, ropts.queue) || ropts.queue == 0)
+                return invalid(argv[0], "--remote-write-queue", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc != 3)
+    if (argc - optind < 2)
     {
-        fprintf(stderr, "syntax: %s: http-port libvirt-uri\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
 
-    int port = std::stoi(std::string(argv[1]));
+    // Pushed from the background collections, as they are published.
+    if (!ropts.url.empty())
+    {
+        if (tsettings.interval == 0)
+        {
+            fprintf(stderr, "--remote-write requires --interval\n");
+            return 1;
+        }
 
+        try
+        {
+            pusher = std::make_unique<remote::writer>(ropts);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            fprintf(stderr, "invalid --remote-write: %s\n", e.what());
+            return 1;
+        }
+        tsettings.published = [&pusher](const snapshot::snapshot &snap, const exposition::families *const *sets, size_t count) {
+            pusher->push(snap, sets, count);
+        };
+    }
+
+    int port;
+    if (!custom::parse_number(argv[optind], port) || port <= 0 || port > 65535)
+        return invalid(argv[0], "http-port", argv[optind]);
     printf("using port: %d\n", port);
-    printf("using system: %s\n", argv[2]);
 
-    virConnectPtr conn = virConnectOpenReadOnly(argv[2]);
-    if (conn == NULL)
+    // In the background, groups without a refresh interval of their own take the collector's.
+    if (tsettings.interval > 0)
     {
-        fprintf(stderr, "Failed to connect to %s\n", argv[2]);
+        for (std::chrono::seconds &refresh : opts.refresh)
+        {
+            if (refresh.count() == 0)
+                refresh = std::chrono::seconds(tsettings.interval);
+        }
+    }
+
+    // The event loop must exist, before the connections are opened.
+    if (virEventRegisterDefaultImpl() < 0)
+    {
+        fprintf(stderr, "Failed to register event implementation: %s\n", virGetLastErrorMessage());
         return (EXIT_FAILURE);
     }
 
-    // Setup a stream_server, and use the lambda below
-    // for data-processing.
-    stream_server(port, [&conn, &requests](int fd) -> void {
-        // read from socket, consume data.
-        char buffer[4096] = {0};
-        ssize_t bytes = recv(fd, buffer, 4096, 0);
-
-        // Deal with different reading-scenarios.
-        if (bytes > 0) {
-
-            // Generate output
-            std::string body;
-            virDomainPtr *doms = { 0 };
-            body.append("# prometheus data\n");
-
-            // List, domains and take stats, but only if something is there.
-            unsigned int flags = VIR_CONNECT_LIST_DOMAINS_RUNNING;
-            size_t ret = virConnectListAllDomains(conn, &doms, flags);
-            if (ret <= 0) {
-                std::string output = custom::generate_prometheus(body);
-                send(fd, output.c_str(), output.length(), 0);
-                return;
-            }
+    // A target per uri, each collected over connections of its own. With
+    // more than one, or targets from requests, samples are labelled with
+    // the hypervisor they come from.
+    targets::table table(opts, tsettings);
+    int configured = argc - optind - 1;
+    bool labelled = configured > 1 || !tsettings.allowed.empty();
+    for (int i = optind + 1; i < argc; i++)
+    {
+        auto [name, uri] = targets::parse(argv[i]);
+        printf("using system: %s\n", uri.c_str());
+
+        try
+        {
+            targets::target &t = table.add(name, uri, labelled);
 
-            // cpu-stats.
-            virDomainStatsRecordPtr *statscpu;
-            size_t rc = virDomainListGetStats(doms,
-                                            virDomainStatsTypes::VIR_DOMAIN_STATS_VCPU,
-                                            &statscpu, VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT);
-                                            
-            if (rc > 0)
+            // A single target must be there from the start, others are retried.
+            if (!t.connect() && configured == 1)
+                return (EXIT_FAILURE);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            return (EXIT_FAILURE);
+        }
+    }
+
+    // Backs off, while the event loop fails, rather than spin.
+    std::thread([]() -> void {
+        std::chrono::milliseconds wait{0};
+        while (true)
+        {
+            if (virEventRunDefaultImpl() < 0)
             {
-                serializer::vcpu_metrics(body, rc, statscpu);
+                wait = std::clamp(wait * 2, std::chrono::milliseconds(10), std::chrono::milliseconds(5000));
+                fprintf(stderr, "Failed to run event loop: %s, retrying in %lldms\n", virGetLastErrorMessage(), (long long)wait.count());
+                std::this_thread::sleep_for(wait);
+                continue;
             }
-            // Free structures
-            virDomainStatsRecordListFree(statscpu);             
-
-            // Network stats
-            virDomainStatsRecordPtr *statsnet;
-            size_t nrc = virDomainListGetStats(doms,
-                                            virDomainStatsTypes::VIR_DOMAIN_STATS_INTERFACE,
-                                            &statsnet, VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT);
-            if (nrc > 0)
+            wait = std::chrono::milliseconds(0);
+        }
+    }).detach();
+
+    // Collected in the background, the first collection is there before the first scrape.
+    table.begin();
+
+    // Setup a stream_server, and use the lambda below
+    // for data-processing.
+    // The lambda is called concurrently, from every worker.
+    stream_server(port, sopts, [&table, &opts, &tsettings, &pusher, deadline, &timeouts, &requests, &response_bytes, &responses](const http::request &req) -> http::response {
+        http::response rsp;
+
+        if (req.path != "/" && req.path != "/metrics")
+        {
+            rsp.status = 404;
+            rsp.body = "not found\n";
+            return rsp;
+        }
+
+        // ?collect[]=group&domain=glob&tenant=uuid&target=uri
+        selection::filter sel;
+        std::vector<std::shared_ptr<targets::target>> picked;
+        try
+        {
+            sel = selection::parse(req.query);
+            table.pick(sel.targets, picked);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            rsp.status = 400;
+            rsp.body = std::string(e.what()) + "\n";
+            return rsp;
+        }
+
+        // Latest snapshot of each target, or collect them now, all at once. Concurrent
+        // requests share one collection per target, and past the deadline get its last
+        // one, while it completes. A request for some of the stat groups is cut from it.
+        std::vector<bool> stale(picked.size());
+        std::vector<snapshot::snapshot_ptr> snaps(picked.size());
+        if (tsettings.interval > 0)
+        {
+            for (size_t i = 0; i < picked.size(); i++)
+                snaps[i] = picked[i]->latest().load();
+        }
+        else
+        {
+            for (const std::shared_ptr<targets::target> &t : picked)
+                t->latest().start(req.received, [t]() { return t->collect(); });
+            for (size_t i = 0; i < picked.size(); i++)
             {
-                serializer::network_metrics(body, nrc, statsnet);                
+                bool late = false;
+                snaps[i] = picked[i]->latest().wait(req.received, deadline, late);
+                stale[i] = late;
             }
-            // Free structures
-            virDomainStatsRecordListFree(statsnet);
-
-             // block stats
-            virDomainStatsRecordPtr *statsblocks;
-            size_t nrb = virDomainListGetStats(doms,
-                                            virDomainStatsTypes::VIR_DOMAIN_STATS_BLOCK,
-                                            &statsblocks, VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT);
-            if (nrb > 0)
+        }
+
+        if (std::find(stale.begin(), stale.end(), true) != stale.end())
+            timeouts++;
+
+        snapshot::snapshot_ptr snap = snaps.size() == 1 ? snaps[0] : table.merge(snaps);
+        if (!snap)
+        {
+            rsp.status = 503;
+            rsp.body = "collection in progress\n";
+            return rsp;
+        }
+
+        formats::format fmt = formats::negotiate(req.header("Accept"));
+        compression::encoding enc = compression::negotiate(req.header("Accept-Encoding"));
+        instrument::timer building(instrument::phase::response);
+
+        // Stats about the exporter, and each target.
+        std::string tail;
+        exposition::families f;
+        for (size_t i = 0; i < picked.size(); i++)
+        {
+            const std::string &hypervisor = picked[i]->hypervisor();
+            picked[i]->render(f);
+            if (!snaps[i])
+                continue;
+
+            f.add(f.get("gauge", "Age of the served snapshot.", "libvirt", "snapshot_age_seconds"))
+                .optional_label("hypervisor", hypervisor)
+                .value(snaps[i]->age());
+
+            exposition::family &stale_group = f.get("gauge", "Whether a stat group is served from an earlier collection, as the deadline passed, or it was not due.", "libvirt", "scrape_stale");
+            exposition::family &group_age = f.get("gauge", "Age of the served samples of a stat group.", "libvirt", "scrape_group_age_seconds");
+            for (size_t g = 0; g < collector::GROUPS; g++)
             {
-                serializer::block_metrics(body, nrc, statsblocks);                
-            }
-            // Free structures
-            virDomainStatsRecordListFree(statsblocks);
-
-            // Make "up
-            for (size_t j = 0; j < ret; j++) {
-            
-                char tenantuuid[4096] = {0};
-                custom::virDomainGetTenant(*(&doms[j]), &tenantuuid[0]);
-
-                char uuid[4096] = {0};
-                virDomainGetUUIDString(*(&doms[j]), uuid);
-
-                body.append(custom::format("# TYPE libvirt_%s gauge\n", "up"));
-                body.append(custom::format("libvirt_up{domain=\"%s\" uuid=\"%s\" tenant=\"%s\"} 1\n",
-                                              virDomainGetName(*(&doms[j])), 
-                                              uuid,
-                                              tenantuuid));
+                if ((opts.stats & collector::groups[g].stats) == 0)
+                    continue;
+
+                f.add(stale_group)
+                    .label("group", collector::groups[g].name)
+                    .optional_label("hypervisor", hypervisor)
+                    .value(stale[i] || !(snaps[i]->result.refreshed & collector::groups[g].stats) ? 1 : 0);
+                f.add(group_age)
+                    .label("group", collector::groups[g].name)
+                    .optional_label("hypervisor", hypervisor)
+                    .value(snaps[i]->age(g));
             }
+        }
+        if (pusher)
+            pusher->render(f);
+        f.render(tail);
 
-            // Stats about the exporter
-            body.append(custom::format("# TYPE libvirt_%s counter\n", "requests"));
-            body.append(custom::format("libvirt_requests %ld\n", ++requests));
+        exposition::writer w(tail);
+        w.help("HTTP requests served.", "libvirt", "requests");
+        w.type("counter", "libvirt", "requests");
+        w.metric("libvirt", "requests").value(++requests);
+        w.help("Scrapes that passed the deadline, and were served the last snapshot.", "libvirt", "scrape_timeouts_total");
+        w.type("counter", "libvirt", "scrape_timeouts_total");
+        w.metric("libvirt", "scrape_timeouts_total").value(timeouts.load());
+        instrument::render(w);
 
-            // allways free here.            
-            free(doms);
+        w.help("Bytes of metrics response bodies sent, by content encoding.", "libvirt", "response_bytes_total");
+        w.type("counter", "libvirt", "response_bytes_total");
+        for (compression::encoding e : {compression::encoding::identity, compression::encoding::gzip, compression::encoding::zstd})
+            w.metric("libvirt", "response_bytes_total").label("encoding", compression::name(e)).value(response_bytes[(int)e].load());
+        w.help("Metrics responses sent, by content encoding.", "libvirt", "responses_total");
+        w.type("counter", "libvirt", "responses_total");
+        for (compression::encoding e : {compression::encoding::identity, compression::encoding::gzip, compression::encoding::zstd})
+            w.metric("libvirt", "responses_total").label("encoding", compression::name(e)).value(responses[(int)e].load());
 
-            std::string output = custom::generate_prometheus(body);
-            send(fd, output.c_str(), output.length(), 0);
-        }
+        if (sel.empty())
+            snapshot::render(snap, fmt, enc, tail, rsp);
+        else
+            snapshot::render(snap, sel, fmt, enc, tail, rsp);
+        rsp.content_type = formats::get(fmt).content_type;
+        if (enc != compression::encoding::identity)
+            rsp.content_encoding = compression::name(enc);
 
-        if (bytes <= 0)
-            close(fd); 
-    });
+        response_bytes[(int)enc] += rsp.size();
+        responses[(int)enc]++;
 
-    if (conn != NULL)
-        virConnectClose(conn);
+        return rsp;
+    });
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#ifndef __CHECK_HPP__
+#define __CHECK_HPP__
+
+#include <cstdio>
+
+namespace check
+{
+    /**
+     * @brief Number of failed checks.
+     *
+     * @return int&
+     */
+    inline int &failures()
+    {
+        static int n = 0;
+        return n;
+    }
+
+    /**
+     * @brief Reports how a test went.
+     *
+     * @param name the test
+     * @return int the exit status, 1 if any check failed
+     */
+    inline int done(const char *name)
+    {
+        if (failures() > 0)
+        {
+            fprintf(stderr, "%s: %d checks failed\n", name, failures());
+            return 1;
+        }
+        printf("%s: ok\n", name);
+        return 0;
+    }
+}
+
+/**
+ * @brief Checks a condition, and reports it with its line if it doesn't hold.
+ * The test goes on, so that every failed check is reported.
+ */
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            check::failures()++;                                                     \
+        }                                                                            \
+    } while (0)
+
+#endif
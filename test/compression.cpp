@@ -0,0 +1,111 @@
+/**
+ * @file compression.cpp
+ * @brief Checks that snappy blocks round-trip, across block boundaries
+ * and for incompressible data, that hand-made blocks of each tag decode
+ * as the format says, and that corrupt blocks are refused.
+ *
+ * usage: compression
+ */
+
+#include <random>
+#include <string>
+#include <compression.hpp>
+#include "check.hpp"
+
+/**
+ * @brief Compresses and decompresses data, after a prefix already in the buffers.
+ *
+ * @return size_t the compressed size
+ */
+static size_t round_trip(const std::string &data)
+{
+    std::string compressed = "prefix";
+    compression::snappy_compress(data, compressed);
+
+    std::string out = "prefix";
+    CHECK(compression::snappy_uncompress(std::string_view(compressed).substr(6), out));
+    CHECK(out.size() == data.size() + 6);
+    CHECK(out.compare(6, std::string::npos, data) == 0);
+    return compressed.size() - 6;
+}
+
+static void round_trips()
+{
+    CHECK(round_trip("") == 1);
+    round_trip("a");
+    round_trip("short, under 15");
+
+    // Exposition text repeats, and compresses well.
+    std::string text;
+    for (int i = 0; i < 5000; i++)
+        text += "libvirt_vcpu_time{domain=\"instance-" + std::to_string(i % 50) + "\",vcpu=\"" + std::to_string(i % 8) + "\"} " +
+                std::to_string(i * 7919) + "\n";
+    CHECK(text.size() > (1 << 16) * 3);
+    CHECK(round_trip(text) < text.size() / 4);
+
+    // Runs, as overlapping copies, and long literals across blocks.
+    round_trip(std::string(200000, 'x'));
+    std::mt19937 random(1);
+    std::string noise(150000, '\0');
+    for (char &c : noise)
+        c = (char)random();
+    CHECK(round_trip(noise) <= noise.size() + noise.size() / 6 + 32);
+    round_trip(noise.substr(0, 70000) + text + noise.substr(0, 70000));
+}
+
+static void format()
+{
+    std::string out;
+
+    // A literal.
+    CHECK(compression::snappy_uncompress(std::string("\x05\x10hello", 7), out));
+    CHECK(out == "hello");
+
+    // A literal, then a 1-byte offset copy that overlaps what it appends.
+    out.clear();
+    CHECK(compression::snappy_uncompress(std::string("\x08\x04" "ab" "\x09\x02", 6), out));
+    CHECK(out == "abababab");
+
+    // 2-byte and 4-byte offset copies.
+    out.clear();
+    CHECK(compression::snappy_uncompress(std::string("\x06\x08" "abc" "\x0a\x03\x00", 8), out));
+    CHECK(out == "abcabc");
+    out.clear();
+    CHECK(compression::snappy_uncompress(std::string("\x06\x08" "abc" "\x0b\x03\x00\x00\x00", 10), out));
+    CHECK(out == "abcabc");
+
+    // A literal with its length in the next byte.
+    std::string literal(100, 'q');
+    out.clear();
+    CHECK(compression::snappy_uncompress(std::string("\x64\xf0\x63", 3) + literal, out));
+    CHECK(out == literal);
+}
+
+static void corrupt()
+{
+    std::string out;
+    CHECK(!compression::snappy_uncompress("", out));
+    // Shorter, or longer, than the preamble says.
+    CHECK(!compression::snappy_uncompress(std::string("\x06\x10hello", 7), out));
+    CHECK(!compression::snappy_uncompress(std::string("\x04\x10hello", 7), out));
+    // A truncated literal.
+    CHECK(!compression::snappy_uncompress(std::string("\x05\x10hel", 5), out));
+    // Copies from before the start, or at offset 0.
+    CHECK(!compression::snappy_uncompress(std::string("\x08\x04" "ab" "\x09\x03", 6), out));
+    CHECK(!compression::snappy_uncompress(std::string("\x08\x04" "ab" "\x09\x00", 6), out));
+    // A truncated copy.
+    CHECK(!compression::snappy_uncompress(std::string("\x06\x08" "abc" "\x0a\x03", 7), out));
+
+    std::string compressed;
+    compression::snappy_compress("hello, hello, hello, hello", compressed);
+    compressed.pop_back();
+    CHECK(!compression::snappy_uncompress(compressed, out));
+}
+
+int main()
+{
+    round_trips();
+    format();
+    corrupt();
+    return check::done("compression");
+}
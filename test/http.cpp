@@ -0,0 +1,131 @@
+/**
+ * @file http.cpp
+ * @brief Checks http::parse: request lines and headers, keep-alive,
+ * skipped bodies and pipelining, and that chunked bodies and lengths
+ * past MAX_REQUEST, or past the range of size_t, are refused.
+ *
+ * usage: http
+ */
+
+#include <string>
+#include <http.hpp>
+#include "check.hpp"
+
+/**
+ * @brief Parses buf as one request.
+ */
+static http::parse_result parse_one(std::string_view buf, http::request &req, size_t &consumed)
+{
+    consumed = 0;
+    return http::parse(buf, req, consumed);
+}
+
+static void request_line()
+{
+    http::request req;
+    size_t consumed;
+
+    std::string get = "GET /metrics?collect[]=vcpu&domain=a HTTP/1.1\r\nHost: x\r\naccept-encoding:  gzip \r\n\r\n";
+    CHECK(parse_one(get, req, consumed) == http::parse_result::complete);
+    CHECK(consumed == get.size());
+    CHECK(req.method == "GET");
+    CHECK(req.target == "/metrics?collect[]=vcpu&domain=a");
+    CHECK(req.path == "/metrics");
+    CHECK(req.query == "collect[]=vcpu&domain=a");
+    CHECK(req.version == "HTTP/1.1");
+    CHECK(req.headers.size() == 2);
+    CHECK(req.header("Accept-Encoding") == "gzip");
+    CHECK(req.header("host") == "x");
+    CHECK(req.header("Connection").empty());
+
+    CHECK(parse_one("GET /metrics HTTP/1.1\r\nHost: x\r\n", req, consumed) == http::parse_result::incomplete);
+    CHECK(parse_one("", req, consumed) == http::parse_result::incomplete);
+    CHECK(parse_one("GET\r\n\r\n", req, consumed) == http::parse_result::invalid);
+    CHECK(parse_one("GET /metrics\r\n\r\n", req, consumed) == http::parse_result::invalid);
+    CHECK(parse_one("GET /metrics FTP/1.0\r\n\r\n", req, consumed) == http::parse_result::invalid);
+    CHECK(parse_one("GET /metrics HTTP/1.1\r\nno colon\r\n\r\n", req, consumed) == http::parse_result::invalid);
+}
+
+static void keep_alive()
+{
+    http::request req;
+    size_t consumed;
+
+    CHECK(parse_one("GET / HTTP/1.1\r\n\r\n", req, consumed) == http::parse_result::complete);
+    CHECK(req.keep_alive);
+    CHECK(parse_one("GET / HTTP/1.1\r\nConnection: Upgrade, close\r\n\r\n", req, consumed) == http::parse_result::complete);
+    CHECK(!req.keep_alive);
+    CHECK(parse_one("GET / HTTP/1.0\r\n\r\n", req, consumed) == http::parse_result::complete);
+    CHECK(!req.keep_alive);
+    CHECK(parse_one("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n", req, consumed) == http::parse_result::complete);
+    CHECK(req.keep_alive);
+    // A token, not a substring.
+    CHECK(parse_one("GET / HTTP/1.1\r\nConnection: closed\r\n\r\n", req, consumed) == http::parse_result::complete);
+    CHECK(req.keep_alive);
+}
+
+static void bodies()
+{
+    http::request req;
+    size_t consumed;
+
+    std::string head = "POST /metrics HTTP/1.1\r\nContent-Length: 5\r\n\r\n";
+    CHECK(parse_one(head, req, consumed) == http::parse_result::incomplete);
+    CHECK(parse_one(head + "abc", req, consumed) == http::parse_result::incomplete);
+
+    // The body is skipped, and the next request parsed after it.
+    std::string next = "GET /next HTTP/1.1\r\n\r\n";
+    std::string pipelined = head + "abcde" + next;
+    CHECK(parse_one(pipelined, req, consumed) == http::parse_result::complete);
+    CHECK(consumed == head.size() + 5);
+    CHECK(parse_one(std::string_view(pipelined).substr(consumed), req, consumed) == http::parse_result::complete);
+    CHECK(req.path == "/next");
+    CHECK(consumed == next.size());
+
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\n", req, consumed) == http::parse_result::complete);
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: " + std::to_string(MAX_REQUEST) + "\r\n\r\n", req, consumed) ==
+          http::parse_result::incomplete);
+}
+
+static void refused()
+{
+    http::request req;
+    size_t consumed;
+
+    // Past MAX_REQUEST, or so large that adding it to the head would wrap.
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: " + std::to_string(MAX_REQUEST + 1) + "\r\n\r\n", req, consumed) ==
+          http::parse_result::invalid);
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: 18446744073709551615\r\n\r\nGET / HTTP/1.1\r\n\r\n", req, consumed) ==
+          http::parse_result::invalid);
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: 18446744073709551616\r\n\r\n", req, consumed) ==
+          http::parse_result::invalid);
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: 5x\r\n\r\nabcde", req, consumed) == http::parse_result::invalid);
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", req, consumed) == http::parse_result::invalid);
+
+    // A chunked body can't be skipped.
+    CHECK(parse_one("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nabcde\r\n0\r\n\r\n", req, consumed) ==
+          http::parse_result::invalid);
+    CHECK(parse_one("POST / HTTP/1.1\r\nContent-Length: 5\r\ntransfer-encoding: chunked\r\n\r\nabcde", req, consumed) ==
+          http::parse_result::invalid);
+}
+
+static void tokens()
+{
+    CHECK(http::has_token("keep-alive, Upgrade", "upgrade"));
+    CHECK(!http::has_token("keep-alive", "alive"));
+    CHECK(http::accepts("gzip, deflate", "gzip"));
+    CHECK(!http::accepts("gzip;q=0, *", "gzip"));
+    CHECK(http::accepts("identity; q=0.5, *", "gzip"));
+    CHECK(!http::accepts("*;q=0.0", "gzip"));
+    CHECK(!http::accepts("", "gzip"));
+}
+
+int main()
+{
+    request_line();
+    keep_alive();
+    bodies();
+    refused();
+    tokens();
+    return check::done("http");
+}
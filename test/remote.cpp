@@ -0,0 +1,147 @@
+/**
+ * @file remote.cpp
+ * @brief Checks remote::encode: decodes the WriteRequests it makes, and
+ * checks that each sample of the sets is a TimeSeries, in order, with
+ * __name__, its labels unescaped and sorted, its value and timestamp,
+ * split in batches of the asked size.
+ *
+ * usage: remote
+ */
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <compression.hpp>
+#include <exposition.hpp>
+#include <protobuf.hpp>
+#include <remote.hpp>
+#include "check.hpp"
+
+struct series
+{
+    std::vector<std::pair<std::string, std::string>> labels;
+    std::vector<std::pair<double, int64_t>> samples;
+};
+
+/**
+ * @brief Decodes a snappy-compressed WriteRequest, appending its series to out.
+ *
+ * @return bool false, if it is malformed
+ */
+static bool decode(std::string_view body, std::vector<series> &out)
+{
+    std::string request;
+    if (!compression::snappy_uncompress(body, request))
+        return false;
+
+    protobuf::reader write_request(request);
+    int field;
+    protobuf::wire type;
+    while (write_request.next(field, type))
+    {
+        if (field != 1 || type != protobuf::wire::length)
+            return false;
+
+        series &s = out.emplace_back();
+        protobuf::reader ts(write_request.bytes());
+        while (ts.next(field, type))
+        {
+            protobuf::reader inner(ts.bytes());
+            if (field == 1)
+            {
+                std::pair<std::string, std::string> &l = s.labels.emplace_back();
+                while (inner.next(field, type))
+                {
+                    if (field == 1)
+                        l.first = inner.bytes();
+                    else if (field == 2)
+                        l.second = inner.bytes();
+                    else
+                        return false;
+                }
+            }
+            else if (field == 2)
+            {
+                std::pair<double, int64_t> &v = s.samples.emplace_back(0, 0);
+                while (inner.next(field, type))
+                {
+                    if (field == 1 && type == protobuf::wire::fixed64)
+                        v.first = inner.fixed64();
+                    else if (field == 2 && type == protobuf::wire::varint)
+                        v.second = (int64_t)inner.varint();
+                    else
+                        return false;
+                }
+            }
+            else
+                return false;
+
+            if (!inner.ok())
+                return false;
+        }
+        if (!ts.ok())
+            return false;
+    }
+
+    return write_request.ok();
+}
+
+int main()
+{
+    exposition::families first, second;
+    exposition::family &up = first.get("gauge", "Whether the domain is up.", "libvirt", "up");
+    first.add(up).label("domain", "a").value(1);
+    first.add(up).label("domain", "b\"q\\x\ny").value(0);
+    exposition::family &time = first.get("counter", "vCPU time.", "libvirt", "vcpu", "time");
+    first.add(time).label("vcpu", 3ULL).label("domain", "a").value(1.5e300);
+    first.add(first.get("gauge", "libvirt RPCs.", "libvirt", "scrape_rpcs")).value(7);
+    second.add(second.get("gauge", "Whether the domain is up.", "libvirt", "up")).label("domain", "c").label("hypervisor", "h2").value(1);
+
+    const exposition::families *sets[] = {&first, &second};
+    const int64_t timestamp = 1700000000123;
+    std::vector<remote::batch> batches;
+    CHECK(remote::encode(sets, 2, timestamp, 2, batches) == 5);
+    CHECK(batches.size() == 3);
+
+    std::vector<series> got;
+    size_t samples = 0;
+    for (const remote::batch &b : batches)
+    {
+        size_t before = got.size();
+        CHECK(decode(b.body, got));
+        CHECK(got.size() - before == b.samples);
+        samples += b.samples;
+    }
+    CHECK(samples == 5);
+    CHECK(batches.size() == 3 && batches[0].samples == 2 && batches[1].samples == 2 && batches[2].samples == 1);
+
+    using labels = std::vector<std::pair<std::string, std::string>>;
+    const labels expected[] = {
+        {{"__name__", "libvirt_up"}, {"domain", "a"}},
+        {{"__name__", "libvirt_up"}, {"domain", "b\"q\\x\ny"}},
+        {{"__name__", "libvirt_vcpu_time"}, {"domain", "a"}, {"vcpu", "3"}},
+        {{"__name__", "libvirt_scrape_rpcs"}},
+        {{"__name__", "libvirt_up"}, {"domain", "c"}, {"hypervisor", "h2"}},
+    };
+    const double values[] = {1, 0, 1.5e300, 7, 1};
+
+    CHECK(got.size() == 5);
+    for (size_t i = 0; i < got.size() && i < 5; i++)
+    {
+        CHECK(got[i].labels == expected[i]);
+        CHECK(got[i].samples.size() == 1);
+        CHECK(!got[i].samples.empty() && got[i].samples[0].first == values[i] && got[i].samples[0].second == timestamp);
+    }
+
+    // One batch, if it fits, and none without samples.
+    batches.clear();
+    CHECK(remote::encode(sets, 2, timestamp, 500, batches) == 5);
+    CHECK(batches.size() == 1 && batches[0].samples == 5);
+    batches.clear();
+    exposition::families none;
+    const exposition::families *empty[] = {&none};
+    CHECK(remote::encode(empty, 1, timestamp, 500, batches) == 0);
+    CHECK(batches.empty());
+
+    return check::done("remote");
+}
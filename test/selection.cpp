@@ -0,0 +1,69 @@
+/**
+ * @file selection.cpp
+ * @brief Checks selection::parse, and what a filter asks for.
+ *
+ * usage: selection
+ */
+
+#include <stdexcept>
+#include <selection.hpp>
+#include "check.hpp"
+
+static void parse()
+{
+    selection::filter all = selection::parse("");
+    CHECK(all.empty());
+    CHECK(all.targets.empty());
+
+    selection::filter f = selection::parse("collect[]=vcpu&collect[]=net&domain=instance-*&tenant=t1&tenant=t2&target=qemu:///system");
+    CHECK(f.stats == (VIR_DOMAIN_STATS_VCPU | VIR_DOMAIN_STATS_INTERFACE));
+    CHECK(f.domains == std::vector<std::string>{"instance-*"});
+    CHECK((f.tenants == std::vector<std::string>{"t1", "t2"}));
+    CHECK(f.targets == std::vector<std::string>{"qemu:///system"});
+    CHECK(!f.empty());
+
+    // Percent-encoded, '+' for space, and collect without the brackets.
+    selection::filter encoded = selection::parse("collect%5B%5D=block&collect=memory&domain=a%2Ab+c&domain=%zz");
+    CHECK(encoded.stats == (VIR_DOMAIN_STATS_BLOCK | VIR_DOMAIN_STATS_BALLOON));
+    CHECK((encoded.domains == std::vector<std::string>{"a*b c", "%zz"}));
+
+    // Unknown parameters, empty values and pairs without '=' are ignored.
+    selection::filter ignored = selection::parse("foo=bar&domain=&tenant&&collect[]=");
+    CHECK(ignored.empty());
+
+    // A target alone doesn't narrow the samples.
+    CHECK(selection::parse("target=a").empty());
+
+    bool thrown = false;
+    try
+    {
+        selection::parse("collect[]=nope");
+    }
+    catch (const std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+static void wants()
+{
+    selection::filter all;
+    for (size_t g = 0; g < collector::GROUPS; g++)
+        CHECK(all.wants(g));
+    CHECK(all.wants("any", "uuid"));
+
+    selection::filter f = selection::parse("collect[]=interface&domain=instance-*&domain=1234*");
+    CHECK(f.wants(collector::find_group("interface")));
+    CHECK(!f.wants(collector::find_group("vcpu")));
+    CHECK(f.wants("instance-1", "abcd"));
+    CHECK(f.wants("other", "1234-5678"));
+    CHECK(!f.wants("other", "abcd"));
+}
+
+int main()
+{
+    parse();
+    wants();
+    return check::done("selection");
+}
@@ -0,0 +1,151 @@
+/**
+ * @file snapshot.cpp
+ * @brief Checks snapshot::index: that a body cut by a filter keeps the
+ * samples of the domains, tenants and stat groups it asks for, with one
+ * header per family that has any, and the samples of no domain unless
+ * they are a stat group's and a tenant is asked for; and that merged
+ * bodies are cut the same way.
+ *
+ * usage: snapshot
+ */
+
+#include <memory>
+#include <string>
+#include <selection.hpp>
+#include <snapshot.hpp>
+#include "check.hpp"
+
+static size_t count(std::string_view text, std::string_view what)
+{
+    size_t n = 0;
+    for (size_t pos = text.find(what); pos != std::string_view::npos; pos = text.find(what, pos + 1))
+        n++;
+    return n;
+}
+
+static std::shared_ptr<const cache::domain_info> domain(const char *name, const char *uuid, const char *tenant)
+{
+    return std::make_shared<const cache::domain_info>(cache::domain_info{name, uuid, tenant});
+}
+
+/**
+ * @brief Renders the samples of domains a and b, of no domain, and the
+ * collection's own, as snapshot::collect does, and indexes them.
+ */
+struct rendered
+{
+    std::string body = "# prometheus data\n";
+    std::unique_ptr<snapshot::index> where;
+
+    rendered(const std::shared_ptr<const cache::domain_info> &a, const std::shared_ptr<const cache::domain_info> &b)
+    {
+        exposition::families f, own;
+        exposition::family &up = f.get("gauge", "Whether the domain is up.", "libvirt", "up");
+        f.add(up, a).label("domain", a->name).value(1);
+        f.add(up, b).label("domain", b->name).value(1);
+
+        exposition::family &time = f.get("counter", "vCPU time.", "libvirt", "vcpu", "time");
+        f.add(time, a).label("domain", a->name).label("vcpu", 0ULL).value(10);
+        f.add(time, a).label("domain", a->name).label("vcpu", 1ULL).value(11);
+        f.add(time, b).label("domain", b->name).label("vcpu", 0ULL).value(20);
+        // A stat group's sample of no one domain.
+        f.add(time).label("vcpu", "all").value(41);
+
+        exposition::family &rx = f.get("counter", "Received bytes.", "libvirt", "net", "bytes", "rx");
+        f.add(rx, a).label("domain", a->name).label("interface", "vnet0").value(5);
+
+        own.add(own.get("gauge", "libvirt RPCs made by the collection.", "libvirt", "scrape_rpcs")).value(7);
+
+        exposition::layout layout;
+        f.render(body, &layout);
+        own.render(body, &layout);
+        where = std::make_unique<snapshot::index>(body, layout);
+    }
+
+    std::string render(std::string_view query) const
+    {
+        std::string out;
+        where->render(selection::parse(query), out);
+        return out;
+    }
+};
+
+static void filters()
+{
+    rendered r(domain("a", "ua", "t1"), domain("b", "ub", "t2"));
+    CHECK(r.render("") == r.body);
+
+    std::string a = r.render("domain=a");
+    CHECK(a.compare(0, 18, "# prometheus data\n") == 0);
+    CHECK(count(a, "libvirt_up{domain=\"a\"} 1\n") == 1);
+    CHECK(count(a, "domain=\"b\"") == 0);
+    CHECK(count(a, "libvirt_vcpu_time{domain=\"a\"") == 2);
+    CHECK(count(a, "libvirt_vcpu_time{vcpu=\"all\"} 41\n") == 1);
+    CHECK(count(a, "libvirt_net_bytes_rx{domain=\"a\"") == 1);
+    CHECK(count(a, "libvirt_scrape_rpcs 7\n") == 1);
+    CHECK(count(a, "# HELP libvirt_up ") == 1 && count(a, "# TYPE libvirt_up gauge\n") == 1);
+    CHECK(count(a, "# HELP libvirt_vcpu_time ") == 1);
+
+    // By uuid, the same.
+    CHECK(r.render("domain=u%2A&domain=nope") == r.body);
+    CHECK(r.render("domain=ua") == a);
+
+    // A tenant's samples, without those of the stat groups that are no one tenant's.
+    std::string t2 = r.render("tenant=t2");
+    CHECK(count(t2, "domain=\"b\"") == 2);
+    CHECK(count(t2, "domain=\"a\"") == 0);
+    CHECK(count(t2, "vcpu=\"all\"") == 0);
+    CHECK(count(t2, "libvirt_scrape_rpcs 7\n") == 1);
+    CHECK(count(t2, "# HELP libvirt_net_bytes_rx ") == 0);
+    CHECK(r.render("tenant=t1&tenant=t2") == r.render("domain=*&tenant=t1&tenant=t2"));
+    CHECK(count(r.render("tenant=t2&domain=a"), "domain=") == 0);
+
+    // A stat group: the families of no group are kept.
+    std::string net = r.render("collect[]=interface");
+    CHECK(count(net, "libvirt_vcpu_time") == 0);
+    CHECK(count(net, "libvirt_up{") == 2);
+    CHECK(count(net, "libvirt_net_bytes_rx{domain=\"a\"") == 1);
+    CHECK(count(net, "libvirt_scrape_rpcs 7\n") == 1);
+    CHECK(count(r.render("collect[]=interface&collect[]=vcpu"), "libvirt_vcpu_time{") == 4);
+
+    // No domain: no headers of families left without samples.
+    std::string none = r.render("domain=nope");
+    CHECK(count(none, "libvirt_up") == 0);
+    CHECK(count(none, "libvirt_net_bytes_rx") == 0);
+    CHECK(count(none, "libvirt_vcpu_time{vcpu=\"all\"} 41\n") == 1);
+    CHECK(count(none, "libvirt_scrape_rpcs 7\n") == 1);
+}
+
+static void merged()
+{
+    rendered first(domain("a", "ua", "t1"), domain("b", "ub", "t2"));
+    rendered second(domain("c", "uc", "t1"), domain("d", "ud", "t3"));
+
+    std::string out;
+    snapshot::index both(out, {first.where.get(), second.where.get()});
+
+    std::string all;
+    both.render(selection::filter(), all);
+    CHECK(all == out);
+    CHECK(count(all, "# prometheus data\n") == 1);
+    CHECK(count(all, "# HELP libvirt_up ") == 1);
+    CHECK(count(all, "libvirt_up{") == 4);
+    CHECK(count(all, "libvirt_scrape_rpcs 7\n") == 2);
+    // Each family's samples follow its one header.
+    CHECK(all.find("libvirt_up{domain=\"d\"") < all.find("# HELP libvirt_vcpu_time "));
+
+    std::string t1;
+    both.render(selection::parse("tenant=t1"), t1);
+    CHECK(count(t1, "libvirt_up{") == 2);
+    CHECK(count(t1, "libvirt_up{domain=\"a\"") == 1 && count(t1, "libvirt_up{domain=\"c\"") == 1);
+    CHECK(count(t1, "libvirt_vcpu_time{domain=") == 4);
+    CHECK(count(t1, "vcpu=\"all\"") == 0);
+    CHECK(count(t1, "libvirt_net_bytes_rx{") == 2);
+}
+
+int main()
+{
+    filters();
+    merged();
+    return check::done("snapshot");
+}